@@ -11,14 +11,19 @@
  *     cpu.mem_write = my_mem_write_cb;
  *     cpu.io_read = my_io_read_cb;      // optional
  *     cpu.io_write = my_io_write_cb;    // optional
+ *     cpu.ports = my_port_table;        // optional
+ *     cpu.traps = my_trap_table;        // optional
  *     cpu.intr_read = my_intr_read_cb;  // optional
+ *     cpu.wake = my_wake_cb;            // optional
+ *     cpu.intr_accept = my_accept_cb;   // optional
  *     
  *     i8080_reset(&cpu);
  *     
- *     while (i8080_next(&cpu) == 0 && cpu.cycles < num_clk_cycles) {
+ *     while (i8080_step(&cpu) == 0 && cpu.cycles < num_clk_cycles) {
  *         // some code
  *         // call i8080_interrupt(&cpu) here
  *     }
+ *     // or call i8080_interrupt_async(&cpu, i8080_RST_1) from any thread
  *     printf("Done!");
  * }
  */
@@ -27,6 +32,7 @@
 #define I8080_H
 
 #include "i8080_types.h"
+#include <stddef.h>
 
 #ifndef I8080_FREESTANDING
 #include <stdio.h>
@@ -36,6 +42,241 @@
 extern "C" {
 #endif
 
+struct i8080;
+
+/* Handlers for one I/O port, see i8080.ports. */
+struct i8080_port
+{
+    /* Handles opcode IN for this port. */
+    i8080_word_t(*in)(void* ctx, const struct i8080*, i8080_word_t port);
+    /* Handles opcode OUT for this port. */
+    void(*out)(void* ctx, const struct i8080*, i8080_word_t port, i8080_word_t word);
+
+    /* Passed to in() and out(). */
+    void* ctx;
+};
+
+#define I8080_NUM_PORTS 256
+
+/* Native handler for a trapped address, see i8080.traps. */
+/* Returns 0 if it emulated the instruction at the address */
+/* (usually a whole subroutine, ending with i8080_return()), */
+/* I8080_TRAP_EXEC to execute the instruction normally, or */
+/* an error code to return from i8080_step(). */
+typedef int(*i8080_trap_fn)(void* ctx, struct i8080* cpu);
+
+#define I8080_TRAP_EXEC (-1)
+#define I8080_MAX_TRAPS 32
+
+/* High-level emulation of a subroutine, see i8080_hle_set(). */
+/* Performs the register, flag and memory effects of the */
+/* subroutine, except for the final RET. Memory must be */
+/* accessed through cpu->mem_read() and cpu->mem_write(). */
+typedef void(*i8080_hle_fn)(void* ctx, struct i8080* cpu);
+
+struct i8080_trap
+{
+    i8080_addr_t addr;
+    /* One of fn or hle is set. */
+    i8080_trap_fn fn;
+    i8080_hle_fn hle;
+    void* ctx;
+    /* Charged for an HLE routine, including the RET. */
+    i8080_cycles_t cycles;
+};
+
+struct i8080_hle_verify;
+
+/* PC traps. Initialize with i8080_traps_init(). */
+struct i8080_traps
+{
+    /* One bit per address, tested at instruction fetch. */
+    unsigned char map[65536 / 8];
+
+    /* Optional. If set, HLE routines are checked against */
+    /* the interpreted routines, see i8080_hle_verify. */
+    struct i8080_hle_verify* verify;
+
+    int ntraps;
+    struct i8080_trap trap[I8080_MAX_TRAPS];
+};
+
+#define I8080_WATCH_READ 0x1
+#define I8080_WATCH_WRITE 0x2
+
+/* Breakpoints and watchpoints. Initialize with i8080_debug_init() */
+/* and set with i8080_break_set() and i8080_watch_set(). */
+struct i8080_debug
+{
+    /* One bit per address, tested at instruction fetch. */
+    unsigned char brk[65536 / 8];
+    /* One bit per address, tested on data reads and writes. */
+    /* Instruction fetches and accesses made by trap */
+    /* handlers are not watched. */
+    unsigned char watch_rd[65536 / 8];
+    unsigned char watch_wr[65536 / 8];
+    /* I8080_WATCH_* flags for each 256-byte page. Pages */
+    /* with no watchpoints skip the bitmaps above. */
+    unsigned char page[256];
+
+    /* Last hit. For a breakpoint, addr and pc are */
+    /* the breakpoint. For a watchpoint, addr is the */
+    /* address accessed, pc is the instruction that */
+    /* accessed it, and word is the value read or written. */
+    i8080_addr_t hit_addr;
+    i8080_addr_t hit_pc;
+    int hit_kind; /* 0 for a breakpoint, else I8080_WATCH_* */
+    i8080_word_t hit_word;
+
+    /* Internal */
+    i8080_addr_t inst_pc;
+    int watch_hit;
+    int resume;
+    i8080_addr_t resume_pc;
+};
+
+/* Code coverage. Initialize with i8080_coverage_init(). */
+/* Bit (addr & 7) of byte (addr >> 3) of each map is for */
+/* address addr. Only instructions fetched from memory are */
+/* covered, not interrupt instructions or trapped addresses. */
+struct i8080_coverage
+{
+    /* An instruction started at addr. */
+    unsigned char exec[65536 / 8];
+    /* The conditional jump, call or return at addr was */
+    /* taken, or not taken. */
+    unsigned char taken[65536 / 8];
+    unsigned char not_taken[65536 / 8];
+};
+
+#ifdef I8080_PROFILE
+/* Execution counts and cycles of instructions fetched */
+/* from memory, by opcode and by address. Not counted: */
+/* interrupt instructions and trapped addresses. */
+/* This is large; allocate it on the heap and initialize */
+/* it with i8080_profile_init(). */
+#define I8080_PROFILE_NODES 4096
+#define I8080_PROFILE_DEPTH 256
+
+/* A node in the call tree, i.e. a call path from the start. */
+/* Node 0 is the root, so 0 also means none. */
+struct i8080_call_node
+{
+    i8080_addr_t addr; /* Called address */
+    unsigned short parent;
+    unsigned short child; /* First child */
+    unsigned short next; /* Next sibling */
+    i8080_cycles_t count; /* Times called */
+    i8080_cycles_t cycles; /* Cycles spent, excluding children */
+};
+
+struct i8080_profile
+{
+    i8080_cycles_t op_count[256];
+    i8080_cycles_t op_cycles[256];
+    i8080_cycles_t pc_count[65536];
+    i8080_cycles_t pc_cycles[65536];
+
+    /* Call tree, built from a shadow call stack. Calls are */
+    /* CALL, Cxx and RST. A frame is popped once SP moves */
+    /* above its return address, so RET, Rxx and stack */
+    /* tricks like POP, XTHL and SPHL all unwind correctly. */
+    struct i8080_call_node node[I8080_PROFILE_NODES];
+    unsigned nnodes;
+    unsigned short stack_node[I8080_PROFILE_DEPTH];
+    i8080_addr_t stack_sp[I8080_PROFILE_DEPTH]; /* SP holding the return address */
+    unsigned depth;
+    /* Calls not recorded because the tree or stack was full. */
+    /* Their cycles are charged to the caller. */
+    unsigned long lost_calls;
+};
+#endif
+
+#ifdef I8080_TRACE
+/* One traced instruction: state before it executed. Fields are */
+/* bytes, multi-byte fields little-endian, so traces can be */
+/* written to disk as is and read on any host. */
+struct i8080_trace_rec
+{
+    unsigned char pc[2];
+    unsigned char sp[2];
+    unsigned char op[3]; /* Opcode and operands */
+    unsigned char len; /* Instruction length, 1-3 */
+    unsigned char a;
+    unsigned char flags;
+    unsigned char reserved[2];
+    unsigned char cycles[4]; /* Low 32 bits of cpu->cycles */
+};
+
+/* Lock-free ring of trace records, written by the CPU thread */
+/* and read by one consumer thread with i8080_trace_peek() and */
+/* i8080_trace_consume(). Initialize with i8080_trace_init(). */
+struct i8080_trace
+{
+    struct i8080_trace_rec* buf;
+    unsigned long size; /* Records in buf, a power of 2 */
+    volatile unsigned long head; /* Records written */
+    volatile unsigned long tail; /* Records consumed */
+
+    /* If nonzero, the oldest records are overwritten when the */
+    /* ring is full, keeping the last size records (there must */
+    /* be no consumer). Otherwise full() is called. */
+    int overwrite;
+    /* Called on the CPU thread when the ring is full. Should */
+    /* wait for the consumer to make room. If there is still no */
+    /* room after it returns, the record is dropped. */
+    void(*full)(void* ctx, struct i8080_trace* trace);
+    void* ctx;
+    unsigned long dropped;
+};
+#endif
+
+/* Kinds of memory access, see i8080_heatmap. Stack accesses */
+/* are those of PUSH, POP, XTHL, calls, RST and returns. */
+#define I8080_HEAT_FETCH 0 /* Instruction fetches, including operands */
+#define I8080_HEAT_READ 1
+#define I8080_HEAT_WRITE 2
+#define I8080_HEAT_STACK_READ 3
+#define I8080_HEAT_STACK_WRITE 4
+#define I8080_HEAT_KINDS 5
+
+#ifdef I8080_HEATMAP
+/* Memory accesses by kind (I8080_HEAT_*) and 256-byte page, */
+/* and optionally by address. Initialize with i8080_heatmap_init(). */
+struct i8080_heatmap
+{
+    i8080_cycles_t page[I8080_HEAT_KINDS][256];
+    /* Optional, NULL if not wanted. I8080_HEAT_KINDS * 65536 */
+    /* counters: kind * 65536 + addr. */
+    i8080_cycles_t* addr;
+};
+#endif
+
+#ifdef I8080_STATS
+/* Counters kept by the CPU while it runs, see i8080_get_stats(). */
+struct i8080_stats
+{
+    i8080_cycles_t instructions; /* Instructions retired, including interrupt instructions */
+    i8080_cycles_t interrupts; /* Interrupts accepted */
+    /* Cycles from each interrupt request to its acceptance, */
+    /* summed and at most. */
+    i8080_cycles_t int_latency;
+    i8080_cycles_t int_latency_max;
+    i8080_cycles_t io_reads[I8080_NUM_PORTS]; /* IN, by port */
+    i8080_cycles_t io_writes[I8080_NUM_PORTS]; /* OUT, by port */
+    i8080_cycles_t mem_reads; /* Data reads, not instruction fetches */
+    i8080_cycles_t mem_writes;
+    i8080_cycles_t halts; /* HLT instructions */
+    /* Cycles that passed while halted. The CPU does not count */
+    /* cycles while halted; the host may, e.g. to keep time. */
+    i8080_cycles_t halted_cycles;
+
+    /* Internal: cycles at the pending request, and at HLT. */
+    i8080_cycles_t int_rq_cycles;
+    i8080_cycles_t halt_cycles;
+};
+#endif
+
 struct i8080
 {
     /* Working registers */
@@ -45,6 +286,7 @@ struct i8080
     i8080_addr_t pc; /* Program counter */
 
     i8080_word_t int_rq; /* Interrupt request */
+    i8080_word_t int_op; /* Opcode posted with the request, see int_posted */
 
     i8080_word_t s : 1;  /* Sign flag */
     i8080_word_t z : 1;  /* Zero flag */
@@ -56,6 +298,11 @@ struct i8080
 
     i8080_word_t int_en : 1; /* Interrupts enabled (INTE pin) */
     i8080_word_t int_ff : 1; /* Interrupt latch */
+    i8080_word_t int_posted : 1; /* Execute int_op instead of intr_read() */
+
+    /* Interrupt mailbox, written by i8080_interrupt_async(). */
+    /* Lock-free, can be posted to from any thread. */
+    volatile long int_mbox;
 
     /* Clock cycles */
     i8080_cycles_t cycles;
@@ -70,9 +317,52 @@ struct i8080
     /* Handles opcode OUT. */
     void(*io_write)(const struct i8080*, i8080_word_t port, i8080_word_t word);
 
+    /* Optional per-port dispatch table with I8080_NUM_PORTS entries. */
+    /* Ports with a NULL in() or out() fall back to io_read or io_write. */
+    struct i8080_port* ports;
+
+    /* Optional. Native handlers for addresses, e.g. OS entry points. */
+    struct i8080_traps* traps;
+
+    /* Optional. Breakpoints and watchpoints. */
+    struct i8080_debug* debug;
+
+    /* Optional. Code coverage. */
+    struct i8080_coverage* coverage;
+
+#ifdef I8080_PROFILE
+    /* Optional. Build with I8080_PROFILE defined. */
+    struct i8080_profile* profile;
+#endif
+
+#ifdef I8080_TRACE
+    /* Optional. Build with I8080_TRACE defined. */
+    struct i8080_trace* trace;
+#endif
+
+#ifdef I8080_HEATMAP
+    /* Optional. Build with I8080_HEATMAP defined. */
+    struct i8080_heatmap* heatmap;
+#endif
+
+#ifdef I8080_STATS
+    /* Build with I8080_STATS defined. Cleared by i8080_reset(). */
+    struct i8080_stats stats;
+#endif
+
     /* Handles an interrupt. */
     i8080_word_t(*intr_read)(const struct i8080*);
 
+    /* Optional. Called by i8080_interrupt_async() on the posting */
+    /* thread, after the interrupt is posted. Use this to wake up */
+    /* a halted CPU. Must be signal-safe if posting from a signal handler. */
+    void(*wake)(const struct i8080*);
+
+    /* Optional. Called by i8080_step() when an interrupt is */
+    /* accepted, with the opcode about to be executed, whether */
+    /* it came from intr_read() or i8080_interrupt_async(). */
+    void(*intr_accept)(const struct i8080*, i8080_word_t opcode);
+
     /* User data */
     void* udata;
 };
@@ -83,7 +373,68 @@ enum i8080_err
     i8080_EHNDLR = 1,
     /* Unrecognized opcode.
      * Only possible if i8080_word_t is not 8-bit. */
-    i8080_EOPCODE = 2
+    i8080_EOPCODE = 2,
+    /* Stopped by i8080_stop(). */
+    i8080_ESTOP = 3,
+    /* An HLE routine did not match the interpreted
+     * routine, see i8080_hle_verify.mismatch. */
+    i8080_EHLE = 4,
+    /* Hit a breakpoint, see i8080_debug. The instruction */
+    /* at the breakpoint has not run yet; it runs on the next */
+    /* call to i8080_step() or i8080_run() unless PC is changed. */
+    i8080_EBREAK = 5,
+    /* Hit a watchpoint, see i8080_debug. The instruction */
+    /* that made the access has completed. */
+    i8080_EWATCH = 6
+};
+
+/* Memory written by one side of an HLE check. */
+struct i8080_hle_log
+{
+    unsigned char written[65536 / 8];
+    i8080_word_t old[65536]; /* Before the first write */
+    i8080_word_t val[65536]; /* After the last write */
+    i8080_addr_t addr[65536]; /* Written addresses, in order */
+    unsigned long n;
+};
+
+/* Checks each HLE routine by running it on a copy of the CPU, */
+/* then interpreting the real routine until it returns, and */
+/* comparing registers, flags and memory writes. Cycles are not */
+/* compared, interp_cycles can be used to tune an HLE's cost. */
+/* Interrupts taken during a check may cause false mismatches. */
+/* This is large; allocate it on the heap and initialize */
+/* it with i8080_hle_verify_init(). */
+struct i8080_hle_verify
+{
+    /* Runs the HLE routine. Must be first. */
+    struct i8080 shadow;
+    struct i8080* real;
+
+    /* Real memory callbacks, while a check is active. */
+    i8080_word_t(*mem_read)(const struct i8080*, i8080_addr_t addr);
+    void(*mem_write)(const struct i8080*, i8080_addr_t addr, i8080_word_t word);
+
+    int active;
+    i8080_addr_t ret_addr;
+    i8080_addr_t ret_sp;
+    i8080_cycles_t start_cycles;
+
+    /* Trap replaced while waiting at ret_addr. */
+    int has_saved;
+    struct i8080_trap saved;
+
+    struct i8080_hle_log native;
+    struct i8080_hle_log interp;
+
+    /* Routine checked last. */
+    i8080_addr_t routine;
+    /* Cycles taken by the interpreted routine. */
+    i8080_cycles_t interp_cycles;
+    /* On mismatch, names what differed, e.g. "a", "flags" or "memory". */
+    const char* mismatch;
+    /* Address that differed if mismatch is "memory". */
+    i8080_addr_t mismatch_addr;
 };
 
 /* Reset chip. Eq to low on RESET pin. */
@@ -93,6 +444,114 @@ void i8080_reset(struct i8080* const cpu);
 /* Returns 0 on success. */
 int i8080_step(struct i8080* const cpu);
 
+/* Run instructions until at least ncycles clock cycles */
+/* have elapsed, the CPU halts, or i8080_stop() is called. */
+/* Use (i8080_cycles_t)-1 to run until halted or stopped. */
+/* Returns 0 on success; check cpu->halt to see if the CPU halted. */
+int i8080_run(struct i8080* const cpu, i8080_cycles_t ncycles);
+
+/* Clear all traps. */
+void i8080_traps_init(struct i8080_traps* const traps);
+
+/* Call fn when the CPU is about to execute the instruction at addr. */
+/* Replaces any existing trap at addr. */
+/* Returns 0 on success, or -1 if there are already I8080_MAX_TRAPS traps. */
+int i8080_trap_set(struct i8080_traps* const traps,
+    i8080_addr_t addr, i8080_trap_fn fn, void* ctx);
+
+/* Remove the trap at addr, if there is one. */
+void i8080_trap_clear(struct i8080_traps* const traps, i8080_addr_t addr);
+
+/* Emulate RET (return from subroutine), for use in trap handlers. */
+void i8080_return(struct i8080* const cpu);
+
+/* Replace the subroutine at addr with a native routine. fn is called */
+/* instead of executing the subroutine, then cycles are added and */
+/* a RET is emulated. Replaces any existing trap at addr. */
+/* Returns 0 on success, or -1 if there are already I8080_MAX_TRAPS traps. */
+int i8080_hle_set(struct i8080_traps* const traps, i8080_addr_t addr,
+    i8080_hle_fn fn, void* ctx, i8080_cycles_t cycles);
+
+/* Initialize HLE verification state. */
+void i8080_hle_verify_init(struct i8080_hle_verify* const verify);
+
+/* Clear all breakpoints and watchpoints. */
+void i8080_debug_init(struct i8080_debug* const debug);
+
+/* Stop with i8080_EBREAK before executing the instruction at addr. */
+void i8080_break_set(struct i8080_debug* const debug, i8080_addr_t addr);
+void i8080_break_clear(struct i8080_debug* const debug, i8080_addr_t addr);
+
+/* Stop with i8080_EWATCH after an instruction reads and/or writes */
+/* addr. flags is a combination of I8080_WATCH_READ and I8080_WATCH_WRITE. */
+void i8080_watch_set(struct i8080_debug* const debug, i8080_addr_t addr, int flags);
+void i8080_watch_clear(struct i8080_debug* const debug, i8080_addr_t addr, int flags);
+
+/* Clear all coverage bits. */
+void i8080_coverage_init(struct i8080_coverage* const cov);
+
+#ifdef I8080_PROFILE
+/* Clear all profile counters. */
+void i8080_profile_init(struct i8080_profile* const profile);
+#endif
+
+#ifdef I8080_TRACE
+/* Set up a trace ring over buf, which holds size records. */
+/* size must be a power of 2. */
+void i8080_trace_init(struct i8080_trace* const trace,
+    struct i8080_trace_rec* buf, unsigned long size);
+
+/* Consumer side. Returns the oldest unconsumed records, */
+/* and sets *n to how many are contiguous in the ring. */
+const struct i8080_trace_rec* i8080_trace_peek(struct i8080_trace* const trace, unsigned long* n);
+
+/* Consumer side. Release n records returned by i8080_trace_peek(). */
+void i8080_trace_consume(struct i8080_trace* const trace, unsigned long n);
+
+/* Records written and not yet consumed, wherever they are in */
+/* the ring. Can be called from either thread, e.g. by full() */
+/* to wait until this is less than size. */
+unsigned long i8080_trace_used(struct i8080_trace* const trace);
+#endif
+
+#ifdef I8080_HEATMAP
+/* Clear all counters of map, and set its per-address */
+/* counters to addr, which may be NULL. */
+void i8080_heatmap_init(struct i8080_heatmap* const map, i8080_cycles_t* addr);
+#endif
+
+#ifdef I8080_STATS
+/* Copy cpu's counters to stats. */
+void i8080_get_stats(const struct i8080* const cpu, struct i8080_stats* stats);
+
+/* Clear cpu's counters. */
+void i8080_reset_stats(struct i8080* const cpu);
+#endif
+
+/* Stop i8080_run() or i8080_step() at the next instruction */
+/* boundary; they return i8080_ESTOP. Can be called from any */
+/* thread, or from a callback such as io_write(). */
+void i8080_stop(struct i8080* const cpu);
+
+/* Length in bytes (1-3) of the instruction starting with */
+/* opcode, or 0 if opcode is not a byte. */
+int i8080_instr_len(i8080_word_t opcode);
+
+/* Disassemble the instruction at the start of bytes, which */
+/* holds len bytes, into out as a terminated string, e.g. */
+/* "lxi   sp, 0100h". Uses no CPU state and does no I/O. */
+/* Returns the instruction's length (1-3), or 0 if it does */
+/* not fit in len bytes or its text does not fit in outlen. */
+int i8080_disasm(const i8080_word_t* bytes, size_t len, char* out, size_t outlen);
+
+/* Disassemble len bytes starting at address addr into out, */
+/* one instruction per line, e.g. "0x0100\tlxi   sp, 0100h\n". */
+/* Stops early at an instruction cut off by len, or when out */
+/* is full. out is always terminated. */
+/* Returns the number of bytes disassembled. */
+size_t i8080_disasm_range(const i8080_word_t* bytes, size_t len, 
+    i8080_addr_t addr, char* out, size_t outlen);
+
 #ifndef I8080_FREESTANDING
 /* Disassemble one instruction. */
 /* This can be called before i8080_step() to print the */
@@ -108,6 +567,20 @@ int i8080_disassemble(struct i8080* const cpu, FILE* os);
 /* will be executed. */
 void i8080_interrupt(struct i8080* const cpu);
 
+/* Send an interrupt request from any thread (or a signal handler). */
+/* The request is picked up by i8080_step() at the next */
+/* instruction boundary, and opcode (usually an RST) is executed */
+/* once interrupts are enabled. If more than one request is */
+/* posted before it is picked up, the last opcode wins. */
+/* Lock-free if the compiler supports atomics (GCC, clang, MSVC). */
+void i8080_interrupt_async(struct i8080* const cpu, i8080_word_t opcode);
+
+/* Returns nonzero if an interrupt posted with */
+/* i8080_interrupt_async() has not been picked up yet. */
+/* Can be called from any thread, e.g. to wait on a halted CPU: */
+/* while (cpu.halt && !i8080_interrupt_pending(&cpu)) wait(); */
+int i8080_interrupt_pending(const struct i8080* const cpu);
+
 #ifdef __cplusplus
 }
 #endif
@@ -33,6 +33,14 @@
 #define unlikely(x) (x)
 #endif
 
+/* Atomics for the interrupt mailbox. */
+#if defined(__ATOMIC_RELAXED)
+#define HAS_GNU_ATOMICS
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define HAS_MSVC_ATOMICS
+#endif
+
 #define min2(a, b) (((a) < (b)) ? (a) : (b))
 
 #define CARRY_BIT     0
@@ -55,6 +63,11 @@
 
 #define concatenate(word1, word2) (((i8080_dword_t)(word1) << 8) | (word2))
 
+/* Test a bit in a bitmap with one bit per address. */
+#define map_test(map, addr) (((map)[(addr) >> 3] >> ((addr) & 7)) & 0x1)
+#define map_set(map, addr) ((map)[(addr) >> 3] |= (unsigned char)(1 << ((addr) & 7)))
+#define map_clear(map, addr) ((map)[(addr) >> 3] &= (unsigned char)~(1 << ((addr) & 7)))
+
 #if I8080_WORD_T_MAX == WORD_MAX
 #define limit_word(word) (word)
 #else
@@ -67,6 +80,13 @@
 #define limit_dword(dword) ((dword) & DWORD_MAX)
 #endif
 
+/* Count an event in cpu->stats. */
+#ifdef I8080_STATS
+#define stats_inc(cpu, counter) ((cpu)->stats.counter++)
+#else
+#define stats_inc(cpu, counter) ((void)0)
+#endif
+
 
 /* Intel manual, pg 77-79 */
 /* For conditional RETs and CALLs, add 6 if condition is true. */
@@ -90,6 +110,27 @@ static const unsigned char CYCLES[] = {
     5,  10, 10, 4,  11, 11, 7,  11, 5,  5,  10, 4,  11, 17, 7,  11  /* F */
 };
 
+/* Instruction lengths. */
+static const unsigned char LENGTH[] = {
+/*  0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F */
+    1,  3,  1,  1,  1,  1,  2,  1,  1,  1,  1,  1,  1,  1,  2,  1,  /* 0 */
+    1,  3,  1,  1,  1,  1,  2,  1,  1,  1,  1,  1,  1,  1,  2,  1,  /* 1 */
+    1,  3,  3,  1,  1,  1,  2,  1,  1,  1,  3,  1,  1,  1,  2,  1,  /* 2 */
+    1,  3,  3,  1,  1,  1,  2,  1,  1,  1,  3,  1,  1,  1,  2,  1,  /* 3 */
+    1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 4 */
+    1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 5 */
+    1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 6 */
+    1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 7 */
+    1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 8 */
+    1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* 9 */
+    1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* A */
+    1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  /* B */
+    1,  1,  3,  3,  3,  1,  2,  1,  1,  1,  3,  3,  3,  3,  2,  1,  /* C */
+    1,  1,  3,  2,  3,  1,  2,  1,  1,  1,  3,  2,  3,  3,  2,  1,  /* D */
+    1,  1,  3,  1,  3,  1,  2,  1,  1,  1,  3,  1,  3,  3,  2,  1,  /* E */
+    1,  1,  3,  1,  3,  1,  2,  1,  1,  1,  3,  1,  3,  3,  2,  1   /* F */
+};
+
 /* Get carry out of bit 3. */
 static inline i8080_word_t aux_carry(i8080_word_t w1, i8080_word_t w2, i8080_word_t cy) {
     return get_bit(word_lo(w1) + word_lo(w2) + cy, 4);
@@ -157,15 +198,71 @@ static inline void set_psw(struct i8080* const cpu, i8080_dword_t dword) {
     set_flags(cpu, dword_lo(dword));
 }
 
+/* Record the first watchpoint hit in an instruction. */
+static void watch_hit(struct i8080* const cpu, i8080_addr_t addr, int kind, i8080_word_t word) {
+    struct i8080_debug* const dbg = cpu->debug;
+    const unsigned char* map = (kind == I8080_WATCH_READ) ? dbg->watch_rd : dbg->watch_wr;
+    if (map_test(map, addr) && !dbg->watch_hit) {
+        dbg->watch_hit = 1;
+        dbg->hit_addr = addr;
+        dbg->hit_pc = dbg->inst_pc;
+        dbg->hit_kind = kind;
+        dbg->hit_word = word;
+    }
+}
+
+/* Count an access of kind (I8080_HEAT_*) to addr in cpu->heatmap. */
+#ifdef I8080_HEATMAP
+static inline void heat(struct i8080* const cpu, int kind, i8080_addr_t addr) {
+    struct i8080_heatmap* const map = cpu->heatmap;
+    if (unlikely(map != NULL)) {
+        map->page[kind][addr >> 8]++;
+        if (map->addr)
+            map->addr[((unsigned long)kind << 16) | addr]++;
+    }
+}
+#else
+#define heat(cpu, kind, addr) ((void)(kind))
+#endif
+
+/* Read data (not an instruction) from memory. */
+/* kind is I8080_HEAT_READ or I8080_HEAT_STACK_READ. */
+static inline i8080_word_t data_read_as(struct i8080* const cpu, i8080_addr_t addr, int kind) {
+    i8080_word_t word = cpu->mem_read(cpu, addr);
+    stats_inc(cpu, mem_reads);
+    heat(cpu, kind, addr);
+    if (unlikely(cpu->debug != NULL) && (cpu->debug->page[addr >> 8] & I8080_WATCH_READ))
+        watch_hit(cpu, addr, I8080_WATCH_READ, word);
+    return word;
+}
+
+/* Write data to memory. */
+/* kind is I8080_HEAT_WRITE or I8080_HEAT_STACK_WRITE. */
+static inline void data_write_as(struct i8080* const cpu, i8080_addr_t addr, i8080_word_t word, int kind) {
+    if (unlikely(cpu->debug != NULL) && (cpu->debug->page[addr >> 8] & I8080_WATCH_WRITE))
+        watch_hit(cpu, addr, I8080_WATCH_WRITE, word);
+    cpu->mem_write(cpu, addr, word);
+    stats_inc(cpu, mem_writes);
+    heat(cpu, kind, addr);
+}
+
+#define data_read(cpu, addr) data_read_as(cpu, addr, I8080_HEAT_READ)
+#define data_write(cpu, addr, word) data_write_as(cpu, addr, word, I8080_HEAT_WRITE)
+
+/* Stack accesses by PUSH, POP, XTHL, calls and returns. */
+#define stack_read(cpu, addr) data_read_as(cpu, addr, I8080_HEAT_STACK_READ)
+#define stack_write(cpu, addr, word) data_write_as(cpu, addr, word, I8080_HEAT_STACK_WRITE)
+
 /* Read word at [HL] */
-#define read_mem_hl(cpu) (cpu->mem_read(cpu, get_hl(cpu)))
+#define read_mem_hl(cpu) data_read(cpu, get_hl(cpu))
 
 /* Write word to [HL] */
-#define write_mem_hl(cpu, word) (cpu->mem_write(cpu, get_hl(cpu), word))
+#define write_mem_hl(cpu, word) data_write(cpu, get_hl(cpu), word)
 
 /* Read word, advance PC by 1. */
 static inline i8080_word_t read_word_adv(struct i8080* const cpu) {
     i8080_word_t word = cpu->mem_read(cpu, cpu->pc);
+    heat(cpu, I8080_HEAT_FETCH, cpu->pc);
     cpu->pc = limit_dword(cpu->pc + 1);
     return word;
 }
@@ -250,16 +347,16 @@ static void i8080_dad(struct i8080* const cpu, i8080_dword_t dword) {
 
 static inline void i8080_shld(struct i8080* const cpu) {
     i8080_addr_t addr = read_addr_adv(cpu);
-    cpu->mem_write(cpu, addr, cpu->l);
+    data_write(cpu, addr, cpu->l);
     addr = limit_dword(addr + 1);
-    cpu->mem_write(cpu, addr, cpu->h);
+    data_write(cpu, addr, cpu->h);
 }
 
 static inline void i8080_lhld(struct i8080* const cpu) {
     i8080_addr_t addr = read_addr_adv(cpu);
-    cpu->l = cpu->mem_read(cpu, addr);
+    cpu->l = data_read(cpu, addr);
     addr = limit_dword(addr + 1);
-    cpu->h = cpu->mem_read(cpu, addr);
+    cpu->h = data_read(cpu, addr);
 }
 
 /* Circular shift accumulator left, set carry to old MSB. */
@@ -317,15 +414,15 @@ static void i8080_push(struct i8080* const cpu, i8080_dword_t dword) {
     i8080_word_t hi = dword_hi(dword);
     i8080_word_t lo = dword_lo(dword);
     cpu->sp = limit_dword(cpu->sp - 1);
-    cpu->mem_write(cpu, cpu->sp, hi);
+    stack_write(cpu, cpu->sp, hi);
     cpu->sp = limit_dword(cpu->sp - 1);
-    cpu->mem_write(cpu, cpu->sp, lo);
+    stack_write(cpu, cpu->sp, lo);
 }
 
 static i8080_dword_t i8080_pop(struct i8080* const cpu) {
-    i8080_word_t lo = cpu->mem_read(cpu, cpu->sp);
+    i8080_word_t lo = stack_read(cpu, cpu->sp);
     cpu->sp = limit_dword(cpu->sp + 1);
-    i8080_word_t hi = cpu->mem_read(cpu, cpu->sp);
+    i8080_word_t hi = stack_read(cpu, cpu->sp);
     cpu->sp = limit_dword(cpu->sp + 1);
     return concatenate(hi, lo);
 }
@@ -366,12 +463,12 @@ static void i8080_cond_ret(struct i8080* const cpu, i8080_word_t cond) {
 
 /* Exchange HL with top two words on the stack. */
 static inline void i8080_xthl(struct i8080* const cpu) {
-    i8080_word_t lo = cpu->mem_read(cpu, cpu->sp);
+    i8080_word_t lo = stack_read(cpu, cpu->sp);
     cpu->sp = limit_dword(cpu->sp + 1);
-    i8080_word_t hi = cpu->mem_read(cpu, cpu->sp);
-    cpu->mem_write(cpu, cpu->sp, cpu->h);
+    i8080_word_t hi = stack_read(cpu, cpu->sp);
+    stack_write(cpu, cpu->sp, cpu->h);
     cpu->sp = limit_dword(cpu->sp - 1);
-    cpu->mem_write(cpu, cpu->sp, cpu->l);
+    stack_write(cpu, cpu->sp, cpu->l);
     cpu->h = hi;
     cpu->l = lo;
 }
@@ -386,6 +483,44 @@ static inline void i8080_xchg(struct i8080* const cpu) {
     cpu->e = old_l;
 }
 
+/* Read input port into accumulator. */
+/* Returns nonzero if there is no handler. */
+static inline int i8080_in(struct i8080* const cpu) {
+    i8080_word_t port = cpu->mem_read(cpu, cpu->pc);
+    const struct i8080_port* p = cpu->ports ? &cpu->ports[port] : NULL;
+    if (p && p->in) {
+        cpu->pc = limit_dword(cpu->pc + 1);
+        cpu->a = p->in(p->ctx, cpu, port);
+    } else {
+        if (unlikely(!cpu->io_read))
+            return 1;
+        cpu->pc = limit_dword(cpu->pc + 1);
+        cpu->a = cpu->io_read(cpu, port);
+    }
+    heat(cpu, I8080_HEAT_FETCH, limit_dword(cpu->pc - 1));
+    stats_inc(cpu, io_reads[port]);
+    return 0;
+}
+
+/* Write accumulator to output port. */
+/* Returns nonzero if there is no handler. */
+static inline int i8080_out(struct i8080* const cpu) {
+    i8080_word_t port = cpu->mem_read(cpu, cpu->pc);
+    const struct i8080_port* p = cpu->ports ? &cpu->ports[port] : NULL;
+    if (p && p->out) {
+        cpu->pc = limit_dword(cpu->pc + 1);
+        p->out(p->ctx, cpu, port, cpu->a);
+    } else {
+        if (unlikely(!cpu->io_write))
+            return 1;
+        cpu->pc = limit_dword(cpu->pc + 1);
+        cpu->io_write(cpu, port, cpu->a);
+    }
+    heat(cpu, I8080_HEAT_FETCH, limit_dword(cpu->pc - 1));
+    stats_inc(cpu, io_writes[port]);
+    return 0;
+}
+
 static int i8080_exec(struct i8080* const cpu, i8080_word_t opcode) {
     switch (opcode)
     {
@@ -563,14 +698,14 @@ static int i8080_exec(struct i8080* const cpu, i8080_word_t opcode) {
     case i8080_LXI_SP: cpu->sp = read_addr_adv(cpu); break;
 
     /* Indirect load/store accumulator from immediate */
-    case i8080_STA: cpu->mem_write(cpu, read_addr_adv(cpu), cpu->a); break;
-    case i8080_LDA: cpu->a = cpu->mem_read(cpu, read_addr_adv(cpu)); break;
+    case i8080_STA: data_write(cpu, read_addr_adv(cpu), cpu->a); break;
+    case i8080_LDA: cpu->a = data_read(cpu, read_addr_adv(cpu)); break;
 
     /* Indirect load/store accumulator from register pair */
-    case i8080_LDAX_B: cpu->a = cpu->mem_read(cpu, get_bc(cpu)); break;
-    case i8080_LDAX_D: cpu->a = cpu->mem_read(cpu, get_de(cpu)); break;
-    case i8080_STAX_B: cpu->mem_write(cpu, get_bc(cpu), cpu->a); break;
-    case i8080_STAX_D: cpu->mem_write(cpu, get_de(cpu), cpu->a); break;
+    case i8080_LDAX_B: cpu->a = data_read(cpu, get_bc(cpu)); break;
+    case i8080_LDAX_D: cpu->a = data_read(cpu, get_de(cpu)); break;
+    case i8080_STAX_B: data_write(cpu, get_bc(cpu), cpu->a); break;
+    case i8080_STAX_D: data_write(cpu, get_de(cpu), cpu->a); break;
 
     /* Indirect load/store register pair from immediate */
     case i8080_SHLD: i8080_shld(cpu); break;
@@ -654,16 +789,14 @@ static int i8080_exec(struct i8080* const cpu, i8080_word_t opcode) {
 
      /* Read input port into accumulator. */
     case i8080_IN: 
-        if (unlikely(!cpu->io_read)) 
+        if (unlikely(i8080_in(cpu)))
             return i8080_EHNDLR;
-        cpu->a = cpu->io_read(cpu, read_word_adv(cpu));
         break;
     
     /* Write accumulator to output port. */
     case i8080_OUT:
-        if (unlikely(!cpu->io_write))
+        if (unlikely(i8080_out(cpu)))
             return i8080_EHNDLR;
-        cpu->io_write(cpu, read_word_adv(cpu), cpu->a);
         break;
 
     /* Soft interrupt */
@@ -681,59 +814,844 @@ static int i8080_exec(struct i8080* const cpu, i8080_word_t opcode) {
     case i8080_DI: cpu->int_en = 0; break;
 
     /* Halt */
-    case i8080_HLT: cpu->halt = 1; break;
+    case i8080_HLT:
+        cpu->halt = 1;
+#ifdef I8080_STATS
+        cpu->stats.halts++;
+        cpu->stats.halt_cycles = cpu->cycles + CYCLES[i8080_HLT];
+#endif
+        break;
 
     default: return i8080_EOPCODE;
     }
     
     cpu->cycles += CYCLES[opcode];
+    stats_inc(cpu, instructions);
     return 0;
 }
 
+/* Mailbox layout: bit 8 is set if an interrupt */
+/* is posted, bits 0-7 hold the opcode to execute. */
+/* Bit 9 is set if a stop is requested. */
+#define MBOX_STOP 0x200L
+#define MBOX_INTR 0x100L
+#define MBOX_OPCODE 0xffL
+
+static inline long mbox_load(const volatile long* mbox) {
+#if defined(HAS_GNU_ATOMICS)
+    return __atomic_load_n(mbox, __ATOMIC_RELAXED);
+#else
+    return *mbox;
+#endif
+}
+
+/* Atomically take everything in the mailbox. */
+static inline long mbox_take(volatile long* mbox) {
+#if defined(HAS_GNU_ATOMICS)
+    return __atomic_exchange_n(mbox, 0, __ATOMIC_ACQUIRE);
+#elif defined(HAS_MSVC_ATOMICS)
+    return _InterlockedExchange(mbox, 0);
+#else
+    long val = *mbox;
+    *mbox = 0;
+    return val;
+#endif
+}
+
+/* Atomically clear the bits in mask, then set the bits in val. */
+static inline void mbox_post(volatile long* mbox, long mask, long val) {
+#if defined(HAS_GNU_ATOMICS)
+    long old = __atomic_load_n(mbox, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(mbox, &old, (old & ~mask) | val,
+        1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+#elif defined(HAS_MSVC_ATOMICS)
+    long old, cur = *mbox;
+    do {
+        old = cur;
+        cur = _InterlockedCompareExchange(mbox, (old & ~mask) | val, old);
+    } while (cur != old);
+#else
+    *mbox = (*mbox & ~mask) | val;
+#endif
+}
+
 void i8080_reset(struct i8080* const cpu) {
     cpu->pc = 0;
     cpu->int_en = 0;
     cpu->int_rq = 0;
     cpu->int_ff = 0;
+    cpu->int_posted = 0;
     cpu->halt = 0;
     cpu->cycles = 0;
+    mbox_take(&cpu->int_mbox);
+#ifdef I8080_STATS
+    i8080_reset_stats(cpu);
+#endif
+}
+
+#ifdef I8080_HEATMAP
+void i8080_heatmap_init(struct i8080_heatmap* const map, i8080_cycles_t* addr) {
+    unsigned long i;
+    int kind;
+    /* no memset if freestanding */
+    for (kind = 0; kind < I8080_HEAT_KINDS; ++kind) {
+        for (i = 0; i < 256; ++i)
+            map->page[kind][i] = 0;
+    }
+    map->addr = addr;
+    if (addr) {
+        for (i = 0; i < (unsigned long)I8080_HEAT_KINDS << 16; ++i)
+            addr[i] = 0;
+    }
+}
+#endif
+
+#ifdef I8080_STATS
+/* Note the time of an interrupt request, if there is none pending. */
+static void stats_request(struct i8080* const cpu) {
+    if (!cpu->int_rq)
+        cpu->stats.int_rq_cycles = cpu->cycles;
+}
+
+/* Count an accepted interrupt, and the time spent halted. */
+static void stats_accept(struct i8080* const cpu) {
+    i8080_cycles_t latency = cpu->cycles - cpu->stats.int_rq_cycles;
+    cpu->stats.interrupts++;
+    cpu->stats.int_latency += latency;
+    if (latency > cpu->stats.int_latency_max)
+        cpu->stats.int_latency_max = latency;
+    if (cpu->halt)
+        cpu->stats.halted_cycles += cpu->cycles - cpu->stats.halt_cycles;
+}
+
+void i8080_get_stats(const struct i8080* const cpu, struct i8080_stats* stats) {
+    *stats = cpu->stats;
+}
+
+void i8080_reset_stats(struct i8080* const cpu) {
+    static const struct i8080_stats zero = { 0 };
+    cpu->stats = zero;
+    cpu->stats.int_rq_cycles = cpu->cycles;
+    cpu->stats.halt_cycles = cpu->cycles;
+}
+#endif
+
+void i8080_interrupt(struct i8080* const cpu) {
+#ifdef I8080_STATS
+    stats_request(cpu);
+#endif
+    cpu->int_rq = 1;
+}
+
+void i8080_interrupt_async(struct i8080* const cpu, i8080_word_t opcode) {
+    mbox_post(&cpu->int_mbox, MBOX_INTR | MBOX_OPCODE, MBOX_INTR | limit_word(opcode));
+    if (cpu->wake)
+        cpu->wake(cpu);
+}
+
+int i8080_interrupt_pending(const struct i8080* const cpu) {
+    return (mbox_load(&cpu->int_mbox) & MBOX_INTR) != 0;
+}
+
+void i8080_stop(struct i8080* const cpu) {
+    mbox_post(&cpu->int_mbox, 0, MBOX_STOP);
+}
+
+#define trap_test(traps, addr) map_test((traps)->map, addr)
+
+void i8080_traps_init(struct i8080_traps* const traps) {
+    unsigned i;
+    /* no memset if freestanding */
+    for (i = 0; i < sizeof(traps->map); ++i)
+        traps->map[i] = 0;
+    traps->verify = NULL;
+    traps->ntraps = 0;
+}
+
+/* Find the trap at addr, or a free slot for it. */
+/* Returns NULL if the table is full. */
+static struct i8080_trap* trap_slot(struct i8080_traps* const traps, i8080_addr_t addr) {
+    int i;
+    for (i = 0; i < traps->ntraps; ++i) {
+        if (traps->trap[i].addr == addr)
+            return &traps->trap[i];
+    }
+    if (traps->ntraps == I8080_MAX_TRAPS)
+        return NULL;
+    map_set(traps->map, addr);
+    traps->trap[i].addr = addr;
+    traps->ntraps++;
+    return &traps->trap[i];
+}
+
+int i8080_trap_set(struct i8080_traps* const traps,
+    i8080_addr_t addr, i8080_trap_fn fn, void* ctx)
+{
+    struct i8080_trap* t = trap_slot(traps, addr);
+    if (!t) return -1;
+    t->fn = fn;
+    t->hle = NULL;
+    t->ctx = ctx;
+    t->cycles = 0;
+    return 0;
+}
+
+int i8080_hle_set(struct i8080_traps* const traps, i8080_addr_t addr,
+    i8080_hle_fn fn, void* ctx, i8080_cycles_t cycles)
+{
+    struct i8080_trap* t = trap_slot(traps, addr);
+    if (!t) return -1;
+    t->fn = NULL;
+    t->hle = fn;
+    t->ctx = ctx;
+    t->cycles = cycles;
+    return 0;
+}
+
+void i8080_trap_clear(struct i8080_traps* const traps, i8080_addr_t addr) {
+    int i;
+    for (i = 0; i < traps->ntraps; ++i) {
+        if (traps->trap[i].addr == addr) {
+            traps->trap[i] = traps->trap[--traps->ntraps];
+            map_clear(traps->map, addr);
+            return;
+        }
+    }
+}
+
+void i8080_return(struct i8080* const cpu) {
+    i8080_ret(cpu);
+    cpu->cycles += CYCLES[i8080_RET];
+}
+
+#define log_test(log, addr) (((log)->written[(addr) >> 3] >> ((addr) & 7)) & 0x1)
+
+static void hle_log_clear(struct i8080_hle_log* const log) {
+    unsigned long i;
+    /* every bit set in these bytes is being cleared */
+    for (i = 0; i < log->n; ++i)
+        log->written[log->addr[i] >> 3] = 0;
+    log->n = 0;
+}
+
+static void hle_log(struct i8080_hle_log* const log,
+    i8080_addr_t addr, i8080_word_t old, i8080_word_t word)
+{
+    if (!log_test(log, addr)) {
+        log->written[addr >> 3] |= (unsigned char)(1 << (addr & 7));
+        log->addr[log->n++] = addr;
+        log->old[addr] = old;
+    }
+    log->val[addr] = word;
+}
+
+void i8080_hle_verify_init(struct i8080_hle_verify* const verify) {
+    unsigned i;
+    for (i = 0; i < sizeof(verify->native.written); ++i) {
+        verify->native.written[i] = 0;
+        verify->interp.written[i] = 0;
+    }
+    verify->native.n = 0;
+    verify->interp.n = 0;
+    verify->active = 0;
+    verify->mismatch = NULL;
+}
+
+/* Memory callbacks for the shadow CPU, which runs the HLE routine. */
+/* Writes go to a log instead of memory. */
+static i8080_word_t hle_native_read(const struct i8080* shadow, i8080_addr_t addr) {
+    const struct i8080_hle_verify* v = (const struct i8080_hle_verify*)shadow;
+    if (log_test(&v->native, addr))
+        return v->native.val[addr];
+    return v->mem_read(v->real, addr);
+}
+
+static void hle_native_write(const struct i8080* shadow, i8080_addr_t addr, i8080_word_t word) {
+    struct i8080_hle_verify* v = (struct i8080_hle_verify*)shadow;
+    i8080_word_t old = log_test(&v->native, addr) ? 0 : v->mem_read(v->real, addr);
+    hle_log(&v->native, addr, old, word);
+}
+
+/* Logs writes made while interpreting the real routine. */
+static void hle_interp_write(const struct i8080* cpu, i8080_addr_t addr, i8080_word_t word) {
+    struct i8080_hle_verify* v = cpu->traps->verify;
+    i8080_word_t old = log_test(&v->interp, addr) ? 0 : v->mem_read(cpu, addr);
+    hle_log(&v->interp, addr, old, word);
+    v->mem_write(cpu, addr, word);
+}
+
+#define hle_check(v, cpu, field, name) \
+    if ((v)->shadow.field != (cpu)->field) { (v)->mismatch = (name); return 1; }
+
+/* Returns nonzero on mismatch. */
+static int hle_compare(struct i8080_hle_verify* const v, struct i8080* const cpu) {
+    unsigned long i;
+    hle_check(v, cpu, a, "a"); hle_check(v, cpu, b, "b"); hle_check(v, cpu, c, "c");
+    hle_check(v, cpu, d, "d"); hle_check(v, cpu, e, "e"); hle_check(v, cpu, h, "h");
+    hle_check(v, cpu, l, "l"); hle_check(v, cpu, sp, "sp"); hle_check(v, cpu, pc, "pc");
+    hle_check(v, cpu, int_en, "int_en");
+    if (get_flags(&v->shadow) != get_flags(cpu)) {
+        v->mismatch = "flags";
+        return 1;
+    }
+    /* bytes written by the interpreter */
+    for (i = 0; i < v->interp.n; ++i) {
+        i8080_addr_t addr = v->interp.addr[i];
+        i8080_word_t expect = log_test(&v->native, addr) ?
+            v->native.val[addr] : v->interp.old[addr];
+        if (expect != v->interp.val[addr]) {
+            v->mismatch = "memory";
+            v->mismatch_addr = addr;
+            return 1;
+        }
+    }
+    /* bytes written only by the HLE routine */
+    for (i = 0; i < v->native.n; ++i) {
+        i8080_addr_t addr = v->native.addr[i];
+        if (!log_test(&v->interp, addr) &&
+            v->native.val[addr] != cpu->mem_read(cpu, addr)) {
+            v->mismatch = "memory";
+            v->mismatch_addr = addr;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int trap_dispatch(struct i8080* const cpu, const struct i8080_trap* t);
+
+/* Trapped at the return address of a routine being checked. */
+static int hle_check_end(void* ctx, struct i8080* cpu) {
+    struct i8080_hle_verify* v = (struct i8080_hle_verify*)ctx;
+    struct i8080_trap saved = v->saved;
+    int has_saved = v->has_saved;
+
+    /* not returning from the routine, e.g. a recursive call */
+    if (cpu->sp != v->ret_sp)
+        return has_saved ? trap_dispatch(cpu, &saved) : I8080_TRAP_EXEC;
+
+    cpu->mem_write = v->mem_write;
+    v->active = 0;
+    v->interp_cycles = cpu->cycles - v->start_cycles;
+
+    i8080_trap_clear(cpu->traps, v->ret_addr);
+    if (has_saved)
+        *trap_slot(cpu->traps, v->ret_addr) = saved;
+
+    if (hle_compare(v, cpu))
+        return i8080_EHLE;
+    return has_saved ? trap_dispatch(cpu, &saved) : I8080_TRAP_EXEC;
+}
+
+/* Run the HLE routine on the shadow CPU, then let */
+/* the real routine run until it returns. */
+static int hle_check_begin(struct i8080* const cpu,
+    const struct i8080_trap* t, struct i8080_hle_verify* const v)
+{
+    struct i8080* const shadow = &v->shadow;
+    struct i8080_trap* ret_trap;
+
+    v->shadow = *cpu;
+    v->real = cpu;
+    v->mem_read = cpu->mem_read;
+    v->mem_write = cpu->mem_write;
+    v->shadow.mem_read = hle_native_read;
+    v->shadow.mem_write = hle_native_write;
+    v->shadow.traps = NULL;
+    v->shadow.debug = NULL;
+    hle_log_clear(&v->native);
+    hle_log_clear(&v->interp);
+
+    t->hle(t->ctx, shadow);
+    i8080_ret(shadow);
+    shadow->cycles += t->cycles;
+
+    v->routine = cpu->pc;
+    v->ret_sp = limit_dword(cpu->sp + 2);
+    v->ret_addr = concatenate(
+        cpu->mem_read(cpu, limit_dword(cpu->sp + 1)),
+        cpu->mem_read(cpu, cpu->sp));
+    v->start_cycles = cpu->cycles;
+    v->mismatch = NULL;
+
+    v->has_saved = trap_test(cpu->traps, v->ret_addr);
+    ret_trap = trap_slot(cpu->traps, v->ret_addr);
+    if (!ret_trap) {
+        v->mismatch = "no free trap for return address";
+        return i8080_EHLE;
+    }
+    if (v->has_saved)
+        v->saved = *ret_trap;
+
+    ret_trap->fn = hle_check_end;
+    ret_trap->hle = NULL;
+    ret_trap->ctx = v;
+
+    cpu->mem_write = hle_interp_write;
+    v->active = 1;
+    return I8080_TRAP_EXEC;
+}
+
+static int trap_dispatch(struct i8080* const cpu, const struct i8080_trap* t) {
+    struct i8080_hle_verify* v;
+    if (t->fn)
+        return t->fn(t->ctx, cpu);
+
+    v = cpu->traps->verify;
+    if (v && !v->active)
+        return hle_check_begin(cpu, t, v);
+
+    t->hle(t->ctx, cpu);
+    i8080_ret(cpu);
+    cpu->cycles += t->cycles;
+    return 0;
+}
+
+/* Run the handler for a trapped address. */
+static int i8080_trap(struct i8080* const cpu) {
+    struct i8080_traps* const traps = cpu->traps;
+    int i;
+    for (i = 0; i < traps->ntraps; ++i) {
+        if (traps->trap[i].addr == cpu->pc)
+            return trap_dispatch(cpu, &traps->trap[i]);
+    }
+    return I8080_TRAP_EXEC;
+}
+
+void i8080_debug_init(struct i8080_debug* const debug) {
+    unsigned i;
+    /* no memset if freestanding */
+    for (i = 0; i < sizeof(debug->brk); ++i) {
+        debug->brk[i] = 0;
+        debug->watch_rd[i] = 0;
+        debug->watch_wr[i] = 0;
+    }
+    for (i = 0; i < sizeof(debug->page); ++i)
+        debug->page[i] = 0;
+    debug->hit_addr = 0;
+    debug->hit_pc = 0;
+    debug->hit_kind = 0;
+    debug->hit_word = 0;
+    debug->inst_pc = 0;
+    debug->watch_hit = 0;
+    debug->resume = 0;
+    debug->resume_pc = 0;
+}
+
+void i8080_break_set(struct i8080_debug* const debug, i8080_addr_t addr) {
+    map_set(debug->brk, addr);
+}
+
+void i8080_break_clear(struct i8080_debug* const debug, i8080_addr_t addr) {
+    map_clear(debug->brk, addr);
+}
+
+void i8080_watch_set(struct i8080_debug* const debug, i8080_addr_t addr, int flags) {
+    if (flags & I8080_WATCH_READ)
+        map_set(debug->watch_rd, addr);
+    if (flags & I8080_WATCH_WRITE)
+        map_set(debug->watch_wr, addr);
+    debug->page[addr >> 8] |= (unsigned char)(flags & (I8080_WATCH_READ | I8080_WATCH_WRITE));
+}
+
+void i8080_watch_clear(struct i8080_debug* const debug, i8080_addr_t addr, int flags) {
+    unsigned i, base = (unsigned)(addr >> 8) * (256 / 8);
+    unsigned char rd = 0, wr = 0;
+    if (flags & I8080_WATCH_READ)
+        map_clear(debug->watch_rd, addr);
+    if (flags & I8080_WATCH_WRITE)
+        map_clear(debug->watch_wr, addr);
+
+    /* recompute the page's flags */
+    for (i = base; i < base + 256 / 8; ++i) {
+        rd |= debug->watch_rd[i];
+        wr |= debug->watch_wr[i];
+    }
+    debug->page[addr >> 8] = (unsigned char)(
+        (rd ? I8080_WATCH_READ : 0) | (wr ? I8080_WATCH_WRITE : 0));
 }
 
-void i8080_interrupt(struct i8080* const cpu) { cpu->int_rq = 1; }
+/* Check for a breakpoint before fetching an instruction. */
+/* A breakpoint that was just hit is skipped once, so */
+/* that execution can resume from it. */
+static int debug_fetch(struct i8080* const cpu) {
+    struct i8080_debug* const dbg = cpu->debug;
+    if (unlikely(map_test(dbg->brk, cpu->pc))) {
+        if (!(dbg->resume && dbg->resume_pc == cpu->pc)) {
+            dbg->hit_addr = cpu->pc;
+            dbg->hit_pc = cpu->pc;
+            dbg->hit_kind = 0;
+            dbg->resume = 1;
+            dbg->resume_pc = cpu->pc;
+            return i8080_EBREAK;
+        }
+    }
+    dbg->resume = 0;
+    dbg->inst_pc = cpu->pc;
+    return 0;
+}
+
+/* Returns i8080_EWATCH if the last instruction hit a watchpoint. */
+static int debug_end(struct i8080* const cpu, int ret) {
+    struct i8080_debug* const dbg = cpu->debug;
+    if (dbg->watch_hit) {
+        dbg->watch_hit = 0;
+        if (!ret) ret = i8080_EWATCH;
+    }
+    return ret;
+}
+
+void i8080_coverage_init(struct i8080_coverage* const cov) {
+    unsigned i;
+    /* no memset if freestanding */
+    for (i = 0; i < sizeof(cov->exec); ++i) {
+        cov->exec[i] = 0;
+        cov->taken[i] = 0;
+        cov->not_taken[i] = 0;
+    }
+}
+
+#define is_cond_branch(opcode) ((((opcode) & 0xc7) == 0xc0) | \
+    (((opcode) & 0xc7) == 0xc2) | (((opcode) & 0xc7) == 0xc4))
+
+/* Whether the condition of a conditional branch holds */
+/* (NZ, Z, NC, C, PO, PE, P, M in bits 3-5). */
+static unsigned cond_holds(const struct i8080* const cpu, i8080_word_t opcode) {
+    unsigned flag;
+    switch ((opcode >> 4) & 3) {
+    case 0: flag = cpu->z; break;
+    case 1: flag = cpu->cy; break;
+    case 2: flag = cpu->p; break;
+    default: flag = cpu->s; break;
+    }
+    return (flag != 0) == ((opcode >> 3) & 1);
+}
+
+#ifdef I8080_PROFILE
+static int profile_exec(struct i8080* const cpu, i8080_word_t opcode);
+#endif
+
+/* Execute the fetched opcode and, if it ran, mark coverage. */
+static int coverage_exec(struct i8080* const cpu, i8080_word_t opcode) {
+    struct i8080_coverage* const cov = cpu->coverage;
+    i8080_addr_t pc = limit_dword(cpu->pc - 1);
+    unsigned byte = pc >> 3, shift = pc & 7;
+    /* the condition is read before the instruction runs; */
+    /* opcode itself is executed as is, so out-of-range */
+    /* words still fail with i8080_EOPCODE */
+    i8080_word_t op = opcode & WORD_MAX;
+    unsigned cond = is_cond_branch(op);
+    unsigned taken = cond && cond_holds(cpu, op);
+    int ret;
+
+#ifdef I8080_PROFILE
+    if (cpu->profile)
+        ret = profile_exec(cpu, opcode);
+    else
+#endif
+    ret = i8080_exec(cpu, opcode);
+    if (ret)
+        return ret;
+
+    cov->exec[byte] |= (unsigned char)(1u << shift);
+    cov->taken[byte] |= (unsigned char)((cond & taken) << shift);
+    cov->not_taken[byte] |= (unsigned char)((cond & !taken) << shift);
+    return 0;
+}
+
+#ifdef I8080_PROFILE
+void i8080_profile_init(struct i8080_profile* const profile) {
+    unsigned long i;
+    /* no memset if freestanding */
+    for (i = 0; i < 256; ++i) {
+        profile->op_count[i] = 0;
+        profile->op_cycles[i] = 0;
+    }
+    for (i = 0; i < 65536; ++i) {
+        profile->pc_count[i] = 0;
+        profile->pc_cycles[i] = 0;
+    }
+    profile->node[0].addr = 0;
+    profile->node[0].parent = 0;
+    profile->node[0].child = 0;
+    profile->node[0].next = 0;
+    profile->node[0].count = 0;
+    profile->node[0].cycles = 0;
+    profile->nnodes = 1;
+    profile->depth = 0;
+    profile->lost_calls = 0;
+}
+
+/* CALL, Cxx (incl. undocumented CALLs) and RST. */
+#define is_call(opcode) (((opcode) & 0xc7) == 0xc4 || \
+    ((opcode) & 0xcf) == 0xcd || ((opcode) & 0xc7) == 0xc7)
+
+/* Push a frame for a call from node parent to addr. */
+static void profile_call(struct i8080_profile* const prof,
+    unsigned parent, i8080_addr_t addr, i8080_addr_t sp)
+{
+    unsigned n = prof->node[parent].child;
+    while (n && prof->node[n].addr != addr)
+        n = prof->node[n].next;
+
+    if (!n) {
+        if (prof->nnodes == I8080_PROFILE_NODES)
+            goto lost;
+        n = prof->nnodes++;
+        prof->node[n].addr = addr;
+        prof->node[n].parent = (unsigned short)parent;
+        prof->node[n].child = 0;
+        prof->node[n].next = prof->node[parent].child;
+        prof->node[n].count = 0;
+        prof->node[n].cycles = 0;
+        prof->node[parent].child = (unsigned short)n;
+    }
+    if (prof->depth == I8080_PROFILE_DEPTH)
+        goto lost;
+    prof->node[n].count++;
+    prof->stack_node[prof->depth] = (unsigned short)n;
+    prof->stack_sp[prof->depth] = sp;
+    prof->depth++;
+    return;
+lost:
+    prof->lost_calls++;
+}
+
+/* Execute the fetched opcode and count it. */
+static int profile_exec(struct i8080* const cpu, i8080_word_t opcode) {
+    struct i8080_profile* const prof = cpu->profile;
+    i8080_addr_t pc = limit_dword(cpu->pc - 1);
+    i8080_addr_t sp = cpu->sp;
+    i8080_addr_t call_sp = limit_dword(sp - 2);
+    unsigned node;
+    i8080_cycles_t start = cpu->cycles, cycles;
+    int ret;
+
+    /* unwind frames whose return address was popped, */
+    /* also by traps and interrupts since the last call */
+    while (prof->depth && sp > prof->stack_sp[prof->depth - 1])
+        prof->depth--;
+    node = prof->depth ? prof->stack_node[prof->depth - 1] : 0;
+
+    ret = i8080_exec(cpu, opcode);
+    cycles = cpu->cycles - start;
+
+    prof->op_count[opcode & WORD_MAX]++;
+    prof->op_cycles[opcode & WORD_MAX] += cycles;
+    prof->pc_count[pc]++;
+    prof->pc_cycles[pc] += cycles;
+    prof->node[node].cycles += cycles;
+
+    /* a taken call pushed a return address */
+    if (is_call(opcode) && cpu->sp == call_sp)
+        profile_call(prof, node, cpu->pc, cpu->sp);
+    return ret;
+}
+#endif
+
+#ifdef I8080_TRACE
+/* Trace ring indices. The CPU thread writes head, the consumer tail. */
+static inline unsigned long ring_load(volatile unsigned long* idx) {
+#if defined(HAS_GNU_ATOMICS)
+    return __atomic_load_n(idx, __ATOMIC_ACQUIRE);
+#else
+    /* volatile has acquire semantics on MSVC */
+    return *idx;
+#endif
+}
+
+static inline void ring_store(volatile unsigned long* idx, unsigned long val) {
+#if defined(HAS_GNU_ATOMICS)
+    __atomic_store_n(idx, val, __ATOMIC_RELEASE);
+#else
+    /* volatile has release semantics on MSVC */
+    *idx = val;
+#endif
+}
+
+void i8080_trace_init(struct i8080_trace* const trace,
+    struct i8080_trace_rec* buf, unsigned long size) 
+{
+    trace->buf = buf;
+    trace->size = size;
+    trace->head = 0;
+    trace->tail = 0;
+    trace->overwrite = 0;
+    trace->full = NULL;
+    trace->ctx = NULL;
+    trace->dropped = 0;
+}
+
+const struct i8080_trace_rec* i8080_trace_peek(struct i8080_trace* const trace, unsigned long* n) {
+    unsigned long tail = trace->tail;
+    unsigned long avail = ring_load(&trace->head) - tail;
+    unsigned long pos = tail & (trace->size - 1);
+    *n = min2(avail, trace->size - pos);
+    return &trace->buf[pos];
+}
+
+void i8080_trace_consume(struct i8080_trace* const trace, unsigned long n) {
+    ring_store(&trace->tail, trace->tail + n);
+}
+
+unsigned long i8080_trace_used(struct i8080_trace* const trace) {
+    unsigned long tail = ring_load(&trace->tail);
+    return ring_load(&trace->head) - tail;
+}
+
+/* Append the instruction whose opcode was just fetched to the trace. */
+static void trace_rec(struct i8080* const cpu, i8080_word_t op) {
+    struct i8080_trace* const trace = cpu->trace;
+    unsigned long head = trace->head;
+    struct i8080_trace_rec* rec;
+    i8080_addr_t pc = limit_dword(cpu->pc - 1);
+    i8080_word_t len;
+    i8080_word_t flags = get_flags(cpu);
+
+    if (!trace->overwrite && head - ring_load(&trace->tail) == trace->size) {
+        if (trace->full)
+            trace->full(trace->ctx, trace);
+        if (head - ring_load(&trace->tail) == trace->size) {
+            trace->dropped++;
+            return;
+        }
+    }
+    rec = &trace->buf[head & (trace->size - 1)];
+
+    len = LENGTH[op & WORD_MAX];
+    rec->pc[0] = (unsigned char)dword_lo(pc);
+    rec->pc[1] = (unsigned char)dword_hi(pc);
+    rec->sp[0] = (unsigned char)dword_lo(cpu->sp);
+    rec->sp[1] = (unsigned char)dword_hi(cpu->sp);
+    rec->op[0] = (unsigned char)op;
+    rec->op[1] = (unsigned char)(len > 1 ? cpu->mem_read(cpu, cpu->pc) : 0);
+    rec->op[2] = (unsigned char)(len > 2 ? cpu->mem_read(cpu, limit_dword(pc + 2)) : 0);
+    rec->len = (unsigned char)len;
+    rec->a = (unsigned char)cpu->a;
+    rec->flags = (unsigned char)flags;
+    rec->reserved[0] = 0;
+    rec->reserved[1] = 0;
+    rec->cycles[0] = (unsigned char)(cpu->cycles & 0xff);
+    rec->cycles[1] = (unsigned char)((cpu->cycles >> 8) & 0xff);
+    rec->cycles[2] = (unsigned char)((cpu->cycles >> 16) & 0xff);
+    rec->cycles[3] = (unsigned char)((cpu->cycles >> 24) & 0xff);
+
+    ring_store(&trace->head, head + 1);
+}
+#endif
+
+/* Latch an interrupt posted to the mailbox. */
+/* Returns nonzero if a stop was requested. */
+static int i8080_take_mbox(struct i8080* const cpu) {
+    long mbox = mbox_take(&cpu->int_mbox);
+    if (mbox & MBOX_INTR) {
+#ifdef I8080_STATS
+        stats_request(cpu);
+#endif
+        cpu->int_rq = 1;
+        cpu->int_op = (i8080_word_t)(mbox & MBOX_OPCODE);
+        cpu->int_posted = 1;
+    }
+    return (mbox & MBOX_STOP) != 0;
+}
 
 /* see CPU state transitions, Datasheet pg 7 */
 int i8080_step(struct i8080* const cpu) 
 {
+    int ret;
+
+    /* pick up interrupts posted from other threads */
+    if (unlikely(mbox_load(&cpu->int_mbox) != 0)) {
+        if (i8080_take_mbox(cpu))
+            return i8080_ESTOP;
+    }
+
     /* execute interrupt if there is one */
     if (cpu->int_ff) {
-        if (unlikely(!cpu->intr_read))
-            return i8080_EHNDLR;
-
+        i8080_word_t opcode;
+        if (cpu->int_posted) {
+            opcode = cpu->int_op;
+        } else {
+            if (unlikely(!cpu->intr_read))
+                return i8080_EHNDLR;
+            opcode = cpu->intr_read(cpu);
+        }
         cpu->int_en = 0;
         cpu->int_ff = 0;
         cpu->int_rq = 0;
-        return i8080_exec(cpu, cpu->intr_read(cpu));
+        cpu->int_posted = 0;
+        if (cpu->intr_accept)
+            cpu->intr_accept(cpu, opcode);
+        if (unlikely(cpu->debug != NULL)) {
+            cpu->debug->inst_pc = cpu->pc;
+            return debug_end(cpu, i8080_exec(cpu, opcode));
+        }
+        return i8080_exec(cpu, opcode);
     }
 
-    int ret;
     if (unlikely(cpu->halt)) {
         ret = 0;
     } else {
+        if (unlikely(cpu->debug != NULL)) {
+            ret = debug_fetch(cpu);
+            if (ret) return ret;
+        }
+
+        ret = I8080_TRAP_EXEC;
+        if (unlikely(cpu->traps != NULL) && trap_test(cpu->traps, cpu->pc))
+            ret = i8080_trap(cpu);
+
         /* normal execution */
-        ret = i8080_exec(cpu, read_word_adv(cpu));
+        if (likely(ret == I8080_TRAP_EXEC)) {
+            i8080_word_t opcode = read_word_adv(cpu);
+#ifdef I8080_TRACE
+            if (cpu->trace)
+                trace_rec(cpu, opcode);
+#endif
+            if (unlikely(cpu->coverage != NULL))
+                ret = coverage_exec(cpu, opcode);
+            else
+#ifdef I8080_PROFILE
+            if (cpu->profile)
+                ret = profile_exec(cpu, opcode);
+            else
+#endif
+            ret = i8080_exec(cpu, opcode);
+        }
+
+        if (unlikely(cpu->debug != NULL))
+            ret = debug_end(cpu, ret);
     }
 
     /* Sync incoming interrupt with end of */
     /* instruction cycle (Datasheet pg 11). */
     /* This delays execution by one instruction. */
     if (cpu->int_rq && cpu->int_en) {
+#ifdef I8080_STATS
+        stats_accept(cpu);
+#endif
         cpu->int_ff = 1;
         cpu->halt = 0;
     }
     return ret;
 }
 
-#ifndef I8080_FREESTANDING
+int i8080_run(struct i8080* const cpu, i8080_cycles_t ncycles)
+{
+    int ret;
+    i8080_cycles_t end = cpu->cycles + ncycles;
+    if (end < cpu->cycles)
+        end = (i8080_cycles_t)-1;
+
+    do {
+        ret = i8080_step(cpu);
+        if (unlikely(ret))
+            return ret;
+        if (unlikely(cpu->halt))
+            break;
+    } while (cpu->cycles < end);
+    return 0;
+}
 
 /* '?' indicates that the instruction is undocumented */
 static const char* OP_TO_STR[] = {
@@ -814,69 +1732,141 @@ static const char* OPARGS_TO_STR[] = {
     NULL, NULL,  "%04xh", NULL,    "%04xh", "%04xh", "%02xh", "7"
 };
 
-int i8080_disassemble(struct i8080* const cpu, FILE* os)
+/* Format an instruction into out. Formats in OPARGS_TO_STR */
+/* are "%02xh" or "%04xh", filled in from operand. */
+static int disasm_fmt(char* out, size_t outlen, 
+    const char* opname, const char* opargs, i8080_dword_t operand) 
 {
-    i8080_word_t opcode = read_word_adv(cpu);
-    if (opcode > WORD_MAX) {
-        return i8080_EOPCODE;
+    static const char HEX[] = "0123456789abcdef";
+    size_t n = 0;
+    const char* s;
+
+#define put_char(c) do { \
+    if (n + 1 >= outlen) return 0; \
+    out[n++] = (c); } while (0)
+
+    for (s = opname; *s; ++s)
+        put_char(*s);
+    if (opargs != NULL) {
+        /* opname in a 6-character column */
+        while (n < 6)
+            put_char(' ');
+        for (s = opargs; *s; ++s) {
+            if (*s == '%') {
+                int shift = (s[2] - '0') * 4;
+                while (shift > 0) {
+                    shift -= 4;
+                    put_char(HEX[(operand >> shift) & 0xf]);
+                }
+                s += 3;
+            } else {
+                put_char(*s);
+            }
+        }
     }
-    const char* opname = OP_TO_STR[opcode];
-    const char* opargs = OPARGS_TO_STR[opcode];
-
-    fprintf(os, "0x%04x\t", cpu->pc);
-
-    if (opargs == NULL) {
-        fputs(opname, os);
-    }
-    else {
-        // requires special formatting
-        char fmtbuf[64];
-        strcpy(fmtbuf, "%-6s");
-        strcat(fmtbuf, opargs);
-
-        switch (opcode)
-        {
-            // 3 byte instructions
-        case i8080_LXI_B: case i8080_LXI_D:
-        case i8080_LXI_H: case i8080_LXI_SP:
-        case i8080_SHLD: case i8080_LHLD:
-        case i8080_STA: case i8080_LDA:
-        case i8080_JNZ: case i8080_JZ:
-        case i8080_JNC: case i8080_JC:
-        case i8080_JPO: case i8080_JPE:
-        case i8080_JP:  case i8080_JM:
-        case i8080_JMP: case i8080_UD_JMP:
-        case i8080_CNZ: case i8080_CZ:
-        case i8080_CNC: case i8080_CC:
-        case i8080_CPO: case i8080_CPE:
-        case i8080_CP:  case i8080_CM:
-        case i8080_CALL:
-        case i8080_UD_CALL1:
-        case i8080_UD_CALL2:
-        case i8080_UD_CALL3:
-            fprintf(os, fmtbuf, opname, read_addr_adv(cpu));
-            break;
+    out[n] = '\0';
+    return 1;
 
-            // 2 byte instructions
-        case i8080_MVI_B: case i8080_MVI_C:
-        case i8080_MVI_D: case i8080_MVI_E:
-        case i8080_MVI_H: case i8080_MVI_L:
-        case i8080_MVI_M: case i8080_MVI_A:
-        case i8080_OUT: case i8080_IN:
-        case i8080_ADI: case i8080_ACI:
-        case i8080_SUI: case i8080_SBI:
-        case i8080_ANI: case i8080_XRI:
-        case i8080_ORI: case i8080_CPI:
-            fprintf(os, fmtbuf, opname, read_word_adv(cpu));
-            break;
+#undef put_char
+}
 
-            // 1 byte instructions
-        default:
-            fprintf(os, fmtbuf, opname);
+int i8080_instr_len(i8080_word_t opcode)
+{
+#if I8080_WORD_T_MAX > WORD_MAX
+    if (opcode > WORD_MAX)
+        return 0;
+#endif
+    return LENGTH[opcode];
+}
+
+int i8080_disasm(const i8080_word_t* bytes, size_t len, char* out, size_t outlen)
+{
+    i8080_word_t opcode;
+    int oplen;
+    i8080_dword_t operand = 0;
+
+    if (len == 0 || outlen == 0)
+        return 0;
+    opcode = bytes[0];
+#if I8080_WORD_T_MAX > WORD_MAX
+    if (opcode > WORD_MAX)
+        return 0;
+#endif
+    oplen = LENGTH[opcode];
+    if ((size_t)oplen > len)
+        return 0;
+    if (oplen == 2)
+        operand = bytes[1];
+    else if (oplen == 3)
+        operand = concatenate(bytes[2], bytes[1]);
+
+    if (!disasm_fmt(out, outlen, OP_TO_STR[opcode], OPARGS_TO_STR[opcode], operand))
+        return 0;
+    return oplen;
+}
+
+size_t i8080_disasm_range(const i8080_word_t* bytes, size_t len, 
+    i8080_addr_t addr, char* out, size_t outlen)
+{
+    static const char HEX[] = "0123456789abcdef";
+    size_t pos = 0, n = 0;
+
+    if (outlen == 0)
+        return 0;
+    out[0] = '\0';
+
+    /* "0x1234\t" + instruction + "\n" per line */
+    while (pos < len && outlen - n > 9) {
+        int i, oplen;
+        char* line = out + n;
+
+        line[0] = '0';
+        line[1] = 'x';
+        for (i = 0; i < 4; ++i)
+            line[2 + i] = HEX[(addr >> (12 - 4 * i)) & 0xf];
+        line[6] = '\t';
+
+        /* leave room for the newline */
+        oplen = i8080_disasm(bytes + pos, len - pos, line + 7, outlen - n - 8);
+        if (oplen == 0) {
+            line[0] = '\0';
             break;
         }
+        n += 7;
+        while (out[n] != '\0')
+            ++n;
+        out[n++] = '\n';
+        out[n] = '\0';
+
+        pos += (size_t)oplen;
+        addr = limit_dword(addr + oplen);
     }
+    return pos;
+}
+
+#ifndef I8080_FREESTANDING
+
+int i8080_disassemble(struct i8080* const cpu, FILE* os)
+{
+    i8080_word_t bytes[3];
+    char buf[32];
+    int i, oplen;
+    i8080_addr_t addr = cpu->pc;
+
+    bytes[0] = cpu->mem_read(cpu, addr);
+#if I8080_WORD_T_MAX > WORD_MAX
+    if (bytes[0] > WORD_MAX)
+        return i8080_EOPCODE;
+#endif
+    /* only read the operands there are */
+    for (i = 1; i < LENGTH[bytes[0]]; ++i)
+        bytes[i] = cpu->mem_read(cpu, limit_dword(addr + i));
+    oplen = i8080_disasm(bytes, (size_t)i, buf, sizeof(buf));
+    if (oplen == 0)
+        return i8080_EOPCODE;
 
+    fprintf(os, "0x%04x\t%s", addr, buf);
+    cpu->pc = limit_dword(addr + oplen);
     return 0;
 }
 #endif
@@ -0,0 +1,420 @@
+#if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define EMU_USING_POSIX_BIOS 1
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#define EMU_USING_WIN32_BIOS 1
+#endif
+
+#include <cstring>
+#include <climits>
+#include <string>
+
+#include "i8080/i8080.h"
+#include "bios.hpp"
+#include "emu.hpp"
+
+#define wordconcat(w1, w2) (((i8080_dword_t)(w1) << 8) | (w2))
+
+static constexpr unsigned sector_size = 128;
+static constexpr unsigned num_drives = 16;
+
+// 1-based sectors of an IBM 3740 track, skewed by 6.
+static const unsigned char XLT_3740[26] = {
+    1, 7, 13, 19, 25, 5, 11, 17, 23, 3, 9, 15, 21,
+    2, 8, 14, 20, 26, 6, 12, 18, 24, 4, 10, 16, 22
+};
+
+struct disk_format
+{
+    const char* name;
+    // Sectors per track, and the number of the first.
+    unsigned spt;
+    unsigned first_sector;
+    // Skew table, or null if sectors are in order.
+    const unsigned char* xlt;
+    // Log2 of the block size in sectors.
+    unsigned bsh;
+    // Directory entries, and the blocks they take.
+    unsigned dir_entries;
+    unsigned al0;
+    // Directory bytes checked for a changed disk.
+    unsigned cks;
+    // System tracks.
+    unsigned off;
+};
+
+// 1K blocks, 64 directory entries
+static const disk_format FMT_3740 = { "3740", 26, 1, XLT_3740, 3, 64, 0xc0, 16, 2 };
+// 2K blocks, 256 directory entries, fixed disk
+static const disk_format FMT_RAW = { "raw", 128, 0, nullptr, 4, 256, 0xf0, 0, 0 };
+
+static constexpr unsigned long size_3740 = 77ul * 26 * sector_size;
+static constexpr unsigned long raw_track_size = 128ul * sector_size;
+// CP/M 2.2 drives are at most 8M.
+static constexpr unsigned long raw_max_size = 8ul << 20;
+
+// Sizes of the tables in a drive's DPH and DPB.
+static constexpr unsigned dph_size = 16;
+static constexpr unsigned dpb_size = 16;
+
+struct disk
+{
+    std::string path;
+    const disk_format* fmt;
+    unsigned char* data;
+    unsigned long size;
+    bool readonly;
+    // Blocks on the disk, after the system tracks.
+    unsigned blocks;
+    i8080_addr_t dph;
+#if defined(EMU_USING_POSIX_BIOS)
+    int fd;
+#elif defined(EMU_USING_WIN32_BIOS)
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+static struct bios
+{
+    i8080_word_t* mem;
+    disk drives[num_drives];
+    // Selected drive, or null if none.
+    disk* sel;
+    unsigned track;
+    unsigned sector;
+    i8080_addr_t dma;
+}
+BIOS;
+
+static bool attached(const disk& d)
+{
+    return d.data != nullptr;
+}
+
+// Map the image of d.path. Returns false if it could not.
+static bool map_disk(disk& d)
+{
+#if defined(EMU_USING_POSIX_BIOS)
+    d.readonly = false;
+    d.fd = ::open(d.path.c_str(), O_RDWR);
+    if (d.fd < 0)
+    {
+        d.readonly = true;
+        d.fd = ::open(d.path.c_str(), O_RDONLY);
+    }
+    struct stat st;
+    if (d.fd < 0 || ::fstat(d.fd, &st) != 0 || st.st_size <= 0)
+    {
+        if (d.fd >= 0) ::close(d.fd);
+        return false;
+    }
+    d.size = static_cast<unsigned long>(st.st_size);
+    void* p = ::mmap(nullptr, d.size, PROT_READ | (d.readonly ? 0 : PROT_WRITE),
+        MAP_SHARED, d.fd, 0);
+    if (p == MAP_FAILED)
+    {
+        ::close(d.fd);
+        return false;
+    }
+    d.data = static_cast<unsigned char*>(p);
+    return true;
+#elif defined(EMU_USING_WIN32_BIOS)
+    d.readonly = false;
+    d.file = ::CreateFileA(d.path.c_str(), GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (d.file == INVALID_HANDLE_VALUE)
+    {
+        d.readonly = true;
+        d.file = ::CreateFileA(d.path.c_str(), GENERIC_READ,
+            FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    }
+    LARGE_INTEGER size;
+    if (d.file == INVALID_HANDLE_VALUE || !::GetFileSizeEx(d.file, &size) ||
+        size.QuadPart <= 0 || size.QuadPart > LONG_MAX)
+    {
+        if (d.file != INVALID_HANDLE_VALUE) ::CloseHandle(d.file);
+        return false;
+    }
+    d.size = static_cast<unsigned long>(size.QuadPart);
+    d.mapping = ::CreateFileMappingA(d.file, NULL,
+        d.readonly ? PAGE_READONLY : PAGE_READWRITE, 0, 0, NULL);
+    void* p = d.mapping ? ::MapViewOfFile(d.mapping,
+        d.readonly ? FILE_MAP_READ : FILE_MAP_WRITE, 0, 0, 0) : NULL;
+    if (!p)
+    {
+        if (d.mapping) ::CloseHandle(d.mapping);
+        ::CloseHandle(d.file);
+        return false;
+    }
+    d.data = static_cast<unsigned char*>(p);
+    return true;
+#else
+    (void)d;
+    return false;
+#endif
+}
+
+// Flush and unmap d. Returns false if it could not be written.
+static bool unmap_disk(disk& d)
+{
+    bool ok = true;
+#if defined(EMU_USING_POSIX_BIOS)
+    if (!d.readonly && ::msync(d.data, d.size, MS_SYNC) != 0)
+        ok = false;
+    ::munmap(d.data, d.size);
+    ::close(d.fd);
+#elif defined(EMU_USING_WIN32_BIOS)
+    if (!d.readonly && (!::FlushViewOfFile(d.data, 0) || !::FlushFileBuffers(d.file)))
+        ok = false;
+    ::UnmapViewOfFile(d.data);
+    ::CloseHandle(d.mapping);
+    ::CloseHandle(d.file);
+#endif
+    d.data = nullptr;
+    return ok;
+}
+
+bool bios_attach(unsigned drive, const char* path, const char* format)
+{
+    disk& d = BIOS.drives[drive];
+    if (attached(d) && !unmap_disk(d))
+        emu_printerr("Could not write %s", d.path.c_str());
+
+    d.path = path;
+    if (!map_disk(d)) {
+#if defined(EMU_USING_POSIX_BIOS) || defined(EMU_USING_WIN32_BIOS)
+        emu_printerr("Could not map %s", path);
+#else
+        emu_printerr("Disk images are not supported on this platform");
+#endif
+        return false;
+    }
+
+    if (std::strcmp(format, "3740") == 0 ||
+        (!*format && d.size == size_3740))
+    {
+        d.fmt = &FMT_3740;
+        if (d.size != size_3740) {
+            emu_printerr("%s is not an IBM 3740 image (%lu bytes)", path, size_3740);
+            unmap_disk(d);
+            return false;
+        }
+    }
+    else if (!*format || std::strcmp(format, "raw") == 0)
+    {
+        d.fmt = &FMT_RAW;
+        if (d.size % raw_track_size != 0 || d.size < 4 * raw_track_size ||
+            d.size > raw_max_size)
+        {
+            emu_printerr("%s is not a raw image (a multiple of 16K, 64K to 8M)", path);
+            unmap_disk(d);
+            return false;
+        }
+    }
+    else {
+        emu_printerr("Unknown disk format %s", format);
+        unmap_disk(d);
+        return false;
+    }
+
+    const disk_format& f = *d.fmt;
+    unsigned long data_size = d.size - f.off * f.spt * sector_size;
+    d.blocks = unsigned(data_size / (sector_size << f.bsh));
+    return true;
+}
+
+// Bytes of the allocation vector of d.
+static unsigned alv_size(const disk& d)
+{
+    return (d.blocks + 7) / 8;
+}
+
+unsigned bios_tables_size(void)
+{
+    unsigned size = 0;
+    bool any_xlt = false;
+    for (const disk& d : BIOS.drives)
+    {
+        if (!attached(d)) continue;
+        size += dph_size + dpb_size + d.fmt->cks + alv_size(d);
+        any_xlt = any_xlt || d.fmt->xlt;
+    }
+    if (size == 0)
+        return 0;
+    return sector_size + (any_xlt ? sizeof XLT_3740 : 0) + size;
+}
+
+static void put16(i8080_addr_t addr, unsigned val)
+{
+    BIOS.mem[addr] = i8080_word_t(val & 0xff);
+    BIOS.mem[addr + 1] = i8080_word_t((val >> 8) & 0xff);
+}
+
+void bios_init(i8080_word_t* mem, i8080_addr_t addr)
+{
+    BIOS.mem = mem;
+    BIOS.sel = nullptr;
+    BIOS.track = 0;
+    BIOS.sector = 0;
+    BIOS.dma = 0x80;
+    if (bios_tables_size() == 0)
+        return;
+
+    // shared by all drives
+    i8080_addr_t dirbuf = addr;
+    addr += sector_size;
+    i8080_addr_t xlt = 0;
+
+    for (disk& d : BIOS.drives)
+    {
+        if (!attached(d)) continue;
+        const disk_format& f = *d.fmt;
+        if (f.xlt && !xlt)
+        {
+            xlt = addr;
+            for (unsigned i = 0; i < sizeof XLT_3740; ++i)
+                mem[addr++] = XLT_3740[i];
+        }
+        i8080_addr_t dph = addr, dpb = dph + dph_size;
+        i8080_addr_t csv = dpb + dpb_size, alv = csv + f.cks;
+        addr = i8080_addr_t(alv + alv_size(d));
+
+        put16(dph, f.xlt ? xlt : 0);
+        put16(dph + 2, 0);  // BDOS scratch
+        put16(dph + 4, 0);
+        put16(dph + 6, 0);
+        put16(dph + 8, dirbuf);
+        put16(dph + 10, dpb);
+        put16(dph + 12, csv);
+        put16(dph + 14, alv);
+
+        unsigned dsm = d.blocks - 1;
+        put16(dpb, f.spt);
+        mem[dpb + 2] = i8080_word_t(f.bsh);
+        mem[dpb + 3] = i8080_word_t((1u << f.bsh) - 1);
+        // EXM: 16K extents, of 8-bit block numbers if they fit
+        unsigned exm = (1u << (f.bsh - 3)) / (dsm < 256 ? 1 : 2) - 1;
+        mem[dpb + 4] = i8080_word_t(exm);
+        put16(dpb + 5, dsm);
+        put16(dpb + 7, f.dir_entries - 1);
+        mem[dpb + 9] = i8080_word_t(f.al0);
+        mem[dpb + 10] = 0;
+        put16(dpb + 11, f.cks);
+        put16(dpb + 13, f.off);
+        mem[dpb + 15] = 0;
+
+        d.dph = dph;
+    }
+}
+
+// Offset of the sector to read or write, or -1 if out of range.
+static long sector_offset(void)
+{
+    const disk& d = *BIOS.sel;
+    const disk_format& f = *d.fmt;
+    if (BIOS.sector < f.first_sector || BIOS.sector - f.first_sector >= f.spt)
+        return -1;
+    unsigned long off = (unsigned long)(BIOS.track * f.spt +
+        (BIOS.sector - f.first_sector)) * sector_size;
+    if (off + sector_size > d.size)
+        return -1;
+    return long(off);
+}
+
+static int read_sector(void)
+{
+    long off = BIOS.sel ? sector_offset() : -1;
+    if (off < 0) return 1;
+    const unsigned char* p = BIOS.sel->data + off;
+    for (unsigned i = 0; i < sector_size; ++i)
+        BIOS.mem[i8080_addr_t(BIOS.dma + i)] = p[i];
+    return 0;
+}
+
+static int write_sector(void)
+{
+    long off = BIOS.sel && !BIOS.sel->readonly ? sector_offset() : -1;
+    if (off < 0) return 1;
+    unsigned char* p = BIOS.sel->data + off;
+    for (unsigned i = 0; i < sector_size; ++i)
+        p[i] = static_cast<unsigned char>(BIOS.mem[i8080_addr_t(BIOS.dma + i)]);
+    return 0;
+}
+
+static void ret16(i8080* cpu, unsigned val)
+{
+    cpu->h = i8080_word_t((val >> 8) & 0xff);
+    cpu->l = i8080_word_t(val & 0xff);
+}
+
+void bios_disk_call(int fn, i8080* cpu)
+{
+    unsigned bc = wordconcat(cpu->b, cpu->c);
+    switch (fn)
+    {
+    case BIOS_HOME:
+        BIOS.track = 0;
+        break;
+
+    case BIOS_SELDSK:
+    {
+        disk* d = cpu->c < num_drives ? &BIOS.drives[cpu->c] : nullptr;
+        if (d && attached(*d)) {
+            BIOS.sel = d;
+            ret16(cpu, d->dph);
+        }
+        else ret16(cpu, 0);
+        break;
+    }
+    case BIOS_SETTRK: BIOS.track = bc; break;
+    case BIOS_SETSEC: BIOS.sector = bc; break;
+    case BIOS_SETDMA: BIOS.dma = i8080_addr_t(bc); break;
+
+    case BIOS_READ: cpu->a = i8080_word_t(read_sector()); break;
+    case BIOS_WRITE: cpu->a = i8080_word_t(write_sector()); break;
+
+    case BIOS_SECTRAN:
+    {
+        i8080_addr_t xlt = i8080_addr_t(wordconcat(cpu->d, cpu->e));
+        ret16(cpu, xlt ? unsigned(BIOS.mem[i8080_addr_t(xlt + bc)]) : bc);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+bool bios_read_system(i8080_addr_t addr, unsigned n)
+{
+    const disk& d = BIOS.drives[0];
+    if (!attached(d))
+        return false;
+    // after the cold start loader in the first sector
+    unsigned long start = sector_size, size = (unsigned long)n * sector_size;
+    unsigned long system = (unsigned long)d.fmt->off * d.fmt->spt * sector_size;
+    if (start + size > system || addr + size > 65536ul)
+        return false;
+    for (unsigned long i = 0; i < size; ++i)
+        BIOS.mem[addr + i] = d.data[start + i];
+    return true;
+}
+
+bool bios_end(void)
+{
+    bool ok = true;
+    for (disk& d : BIOS.drives)
+    {
+        if (attached(d) && !unmap_disk(d)) {
+            emu_printerr("Could not write %s", d.path.c_str());
+            ok = false;
+        }
+    }
+    BIOS.sel = nullptr;
+    return ok;
+}
@@ -0,0 +1,50 @@
+#ifndef BIOS_HPP
+#define BIOS_HPP
+
+#include "i8080/i8080.h"
+
+// CP/M 2.2 BIOS disk entry points, on disk image files mapped
+// into memory. Sectors are copied straight between the mapping
+// and the 8080's memory; nothing is read into the heap.
+//
+// Images are IBM 3740 (8" single density: 77 tracks of 26
+// 128-byte sectors, 2 system tracks, sectors skewed by 6) or
+// raw (16K tracks of 128 0-based sectors, 2K blocks, no system
+// tracks), told apart by size if not given.
+
+// BIOS entry points, in jump table order.
+enum bios_fn
+{
+    BIOS_BOOT, BIOS_WBOOT, BIOS_CONST, BIOS_CONIN, BIOS_CONOUT,
+    BIOS_LIST, BIOS_PUNCH, BIOS_READER, BIOS_HOME, BIOS_SELDSK,
+    BIOS_SETTRK, BIOS_SETSEC, BIOS_SETDMA, BIOS_READ, BIOS_WRITE,
+    BIOS_LISTST, BIOS_SECTRAN,
+    BIOS_NUM_FNS
+};
+
+// Map an image as drive (0 for A:). format is "3740", "raw",
+// or empty to go by the image's size. Images that cannot be
+// written are attached read-only.
+// Returns true on success.
+bool bios_attach(unsigned drive, const char* path, const char* format);
+
+// Bytes of disk tables for the attached drives.
+unsigned bios_tables_size(void);
+
+// Set up for a program, with mem as the 8080's memory.
+// Writes the disk tables at addr.
+void bios_init(i8080_word_t* mem, i8080_addr_t addr);
+
+// Do disk entry point fn (BIOS_HOME to BIOS_SECTRAN, except
+// BIOS_LISTST) and set its return registers.
+void bios_disk_call(int fn, i8080* cpu);
+
+// Read the first n sectors of drive A:'s system tracks to addr.
+// Returns false if there is no drive A: or they are not there.
+bool bios_read_system(i8080_addr_t addr, unsigned n);
+
+// Flush and unmap all images.
+// Returns true if all were written.
+bool bios_end(void);
+
+#endif
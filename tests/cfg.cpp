@@ -0,0 +1,543 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "i8080/i8080.h"
+#include "i8080/i8080_opcodes.h"
+#include "cfg.hpp"
+#include "emu.hpp"
+
+namespace {
+
+enum op_class
+{
+    OP_OTHER,
+    OP_JMP,
+    OP_JCC,
+    OP_CALL,
+    OP_CCC,
+    OP_RST,
+    OP_RET,
+    OP_RCC,
+    OP_PCHL
+};
+
+}
+
+static op_class classify(i8080_word_t op)
+{
+    switch (op)
+    {
+    case i8080_JMP: case i8080_UD_JMP:
+        return OP_JMP;
+    case i8080_CALL: case i8080_UD_CALL1:
+    case i8080_UD_CALL2: case i8080_UD_CALL3:
+        return OP_CALL;
+    case i8080_RET: case i8080_UD_RET:
+        return OP_RET;
+    case i8080_PCHL:
+        return OP_PCHL;
+    }
+    // 11ccc010, 11ccc100, 11ccc000, 11nnn111
+    switch (op & 0xc7)
+    {
+    case 0xc2: return OP_JCC;
+    case 0xc4: return OP_CCC;
+    case 0xc0: return OP_RCC;
+    case 0xc7: return OP_RST;
+    }
+    return OP_OTHER;
+}
+
+// Instructions whose operand is usually an address.
+static bool is_data_ref(i8080_word_t op)
+{
+    switch (op)
+    {
+    case i8080_LXI_B: case i8080_LXI_D:
+    case i8080_LXI_H: case i8080_LXI_SP:
+    case i8080_SHLD: case i8080_LHLD:
+    case i8080_STA: case i8080_LDA:
+        return true;
+    }
+    return false;
+}
+
+// Target of a control transfer.
+static unsigned branch_target(const cfg_image& image, unsigned addr, op_class c)
+{
+    if (c == OP_RST)
+        return image.at(addr) & 0x38;
+    return image.at(addr + 1) | (image.at(addr + 2) << 8);
+}
+
+bool cfg_image_load(cfg_image& image, const char* path, i8080_addr_t base)
+{
+    std::FILE* fs = std::fopen(path, "rb");
+    if (!fs) {
+        emu_printerr("Could not open %s", path);
+        return false;
+    }
+
+    image.base = base;
+    image.bytes.clear();
+    int c;
+    while ((c = std::fgetc(fs)) != EOF && image.bytes.size() < 0x10000u - base)
+        image.bytes.push_back(i8080_word_t(c));
+
+    bool ok = !std::ferror(fs);
+    bool fits = c == EOF || std::fgetc(fs) == EOF;
+    std::fclose(fs);
+    if (!ok)
+        emu_printerr("Could not read %s", path);
+    else if (!fits)
+        emu_printerr("%s is too large.", path);
+    return ok && fits;
+}
+
+std::vector<i8080_addr_t> cfg_entries(const cfg_image& image)
+{
+    std::vector<i8080_addr_t> entries{ image.base };
+    for (unsigned v = 0x08; v <= 0x38; v += 8)
+        if (image.contains(v))
+            entries.push_back(i8080_addr_t(v));
+    return entries;
+}
+
+void cfg_build(cfg& g, const std::vector<i8080_addr_t>& entries)
+{
+    const cfg_image& image = g.image;
+    std::vector<unsigned char>& flags = g.flags;
+    flags.assign(0x10000, 0);
+    g.entries.clear();
+    g.blocks.clear();
+
+    std::vector<unsigned> work;
+    auto branch_to = [&](unsigned addr, unsigned char flag) {
+        flags[addr] |= flag | CFG_LEADER;
+        if (image.contains(addr))
+            work.push_back(addr);
+    };
+
+    for (auto addr : entries)
+    {
+        if (!image.contains(addr)) continue;
+        g.entries.push_back(addr);
+        branch_to(addr, CFG_ENTRY);
+    }
+
+    // decode each path until it ends or joins decoded code
+    while (!work.empty())
+    {
+        unsigned addr = work.back();
+        work.pop_back();
+
+        while (image.contains(addr) && !(flags[addr] & (CFG_INSN | CFG_OPERAND)))
+        {
+            i8080_word_t op = image.at(addr);
+            unsigned len = i8080_instr_len(op);
+            if (len == 0 || !image.contains(addr + len - 1))
+                break;
+
+            bool overlaps = false;
+            for (unsigned i = 1; i < len; ++i)
+                overlaps = overlaps || (flags[addr + i] & (CFG_INSN | CFG_OPERAND));
+            if (overlaps)
+                break;
+
+            flags[addr] |= CFG_INSN;
+            for (unsigned i = 1; i < len; ++i)
+                flags[addr + i] |= CFG_OPERAND;
+
+            op_class c = classify(op);
+            unsigned next = addr + len;
+            switch (c)
+            {
+            case OP_JMP: case OP_JCC:
+                branch_to(branch_target(image, addr, c), CFG_JUMP_TARGET);
+                break;
+            case OP_CALL: case OP_CCC: case OP_RST:
+                branch_to(branch_target(image, addr, c), CFG_CALL_TARGET);
+                break;
+            case OP_OTHER:
+                if (is_data_ref(op))
+                {
+                    unsigned ref = image.at(addr + 1) | (image.at(addr + 2) << 8);
+                    if (image.contains(ref))
+                        flags[ref] |= CFG_DATA_REF;
+                }
+                break;
+            default:
+                break;
+            }
+
+            if (c == OP_JMP || c == OP_RET || c == OP_PCHL)
+                break;
+            if (c != OP_OTHER && next < 0x10000)
+                flags[next] |= CFG_LEADER;
+            addr = next;
+        }
+    }
+
+    // references into the middle of instructions are
+    // written relative to the instruction
+    unsigned end = image.base + unsigned(image.bytes.size());
+    for (unsigned a = image.base; a < end; ++a)
+    {
+        if ((flags[a] & CFG_LABEL) && (flags[a] & CFG_OPERAND))
+        {
+            unsigned s = a;
+            while (s > image.base && !(flags[s] & CFG_INSN))
+                --s;
+            flags[s] |= CFG_DATA_REF;
+        }
+    }
+
+    // split into basic blocks
+    int cur = -1;
+    auto close = [&](cfg_exit exit) {
+        g.blocks[cur].exit = exit;
+        cur = -1;
+    };
+    for (unsigned a = image.base; a < end; )
+    {
+        if (!(flags[a] & CFG_INSN))
+        {
+            if (cur >= 0) close(CFG_EXIT_STOP);
+            ++a;
+            continue;
+        }
+        if (cur >= 0 && (flags[a] & CFG_LEADER))
+        {
+            g.blocks[cur].succ.push_back({ i8080_addr_t(a), CFG_FALL, false });
+            close(CFG_EXIT_FALL);
+        }
+        if (cur < 0)
+        {
+            cfg_block b;
+            b.start = i8080_addr_t(a);
+            b.size = 0;
+            b.ninsns = 0;
+            b.exit = CFG_EXIT_STOP;
+            g.blocks.push_back(b);
+            cur = int(g.blocks.size() - 1);
+        }
+
+        i8080_word_t op = image.at(a);
+        unsigned len = i8080_instr_len(op);
+        cfg_block& b = g.blocks[cur];
+        b.size += len;
+        b.ninsns++;
+
+        op_class c = classify(op);
+        unsigned next = a + len;
+        bool falls = next < end && (flags[next] & CFG_INSN);
+        auto edge = [&](cfg_edge_kind kind) {
+            unsigned to = branch_target(image, a, c);
+            b.succ.push_back({ i8080_addr_t(to), kind, !image.contains(to) });
+        };
+        auto fall = [&]() {
+            if (falls)
+                b.succ.push_back({ i8080_addr_t(next), CFG_FALL, false });
+            close(falls ? CFG_EXIT_FALL : CFG_EXIT_STOP);
+        };
+
+        switch (c)
+        {
+        case OP_JMP: edge(CFG_JUMP); close(CFG_EXIT_JUMP); break;
+        case OP_JCC: edge(CFG_BRANCH); fall(); break;
+        case OP_CALL: case OP_CCC: case OP_RST: edge(CFG_CALL); fall(); break;
+        case OP_RET: close(CFG_EXIT_RET); break;
+        case OP_RCC: fall(); break;
+        case OP_PCHL: close(CFG_EXIT_INDIRECT); break;
+        case OP_OTHER: break;
+        }
+        a = next;
+    }
+    if (cur >= 0)
+        close(CFG_EXIT_STOP);
+}
+
+int cfg_block_at(const cfg& g, i8080_addr_t addr)
+{
+    auto it = std::upper_bound(g.blocks.begin(), g.blocks.end(), addr,
+        [](i8080_addr_t a, const cfg_block& b) { return a < b.start; });
+    if (it == g.blocks.begin())
+        return -1;
+    --it;
+    if (addr >= it->start + it->size)
+        return -1;
+    return int(it - g.blocks.begin());
+}
+
+// Exact symbol at addr, or nullptr.
+static const std::string* symbol_at(const symtab& syms, unsigned addr)
+{
+    auto it = std::lower_bound(syms.syms.begin(), syms.syms.end(), addr,
+        [](const symtab::symbol& s, unsigned a) { return s.addr < a; });
+    if (it == syms.syms.end() || it->addr != addr)
+        return nullptr;
+    return &it->name;
+}
+
+static std::string label_name(const symtab& syms, unsigned addr)
+{
+    if (auto name = symbol_at(syms, addr))
+        return *name;
+    char buf[8];
+    std::snprintf(buf, sizeof(buf), "L%04x", addr);
+    return buf;
+}
+
+// Hex constant for an assembler, e.g. 0ffh.
+static std::string asm_hex(unsigned val, int digits)
+{
+    char buf[16];
+    std::snprintf(buf, sizeof(buf), "%0*xh", digits, val);
+    std::string s = buf;
+    if (s[0] >= 'a')
+        s.insert(0, "0");
+    return s;
+}
+
+static bool has_label(const cfg& g, unsigned addr)
+{
+    return (g.flags[addr] & CFG_LABEL) && !(g.flags[addr] & CFG_OPERAND);
+}
+
+// An address operand: a label, an offset from a label,
+// or a constant if outside the image.
+static std::string address_ref(const cfg& g, const symtab& syms, unsigned addr)
+{
+    if (g.image.contains(addr))
+    {
+        if (has_label(g, addr))
+            return label_name(syms, addr);
+        if (g.flags[addr] & CFG_OPERAND)
+        {
+            unsigned s = addr;
+            while (!(g.flags[s] & CFG_INSN))
+                --s;
+            return label_name(syms, s) + "+" + std::to_string(addr - s);
+        }
+    }
+    return asm_hex(addr, 4);
+}
+
+static void write_data(std::FILE* fs, const cfg& g, const symtab& syms,
+    unsigned addr, unsigned end)
+{
+    while (addr < end)
+    {
+        if (has_label(g, addr))
+            std::fprintf(fs, "%s:\n", label_name(syms, addr).c_str());
+
+        std::string vals, text;
+        unsigned n = 0;
+        do {
+            i8080_word_t w = g.image.at(addr);
+            if (n) vals += ",";
+            vals += asm_hex(w, 2);
+            text += (w >= 0x20 && w < 0x7f) ? char(w) : '.';
+            ++addr, ++n;
+        } while (n < 8 && addr < end && !has_label(g, addr));
+
+        std::fprintf(fs, "\tdb\t%-40s; %s\n", vals.c_str(), text.c_str());
+    }
+}
+
+static void write_insn(std::FILE* fs, const cfg& g, const symtab& syms, unsigned addr)
+{
+    i8080_word_t bytes[3] = { g.image.at(addr), g.image.at(addr + 1), g.image.at(addr + 2) };
+    char text[32];
+    int len = i8080_disasm(bytes, 3, text, sizeof(text));
+
+    // undocumented opcodes have no mnemonic
+    if (text[0] == '?')
+    {
+        std::string vals;
+        for (int i = 0; i < len; ++i)
+            vals += (i ? "," : "") + asm_hex(bytes[i], 2);
+        std::fprintf(fs, "\tdb\t%-40s; %s\n", vals.c_str(), text + 1);
+        return;
+    }
+
+    std::string s = text;
+    auto space = s.find(' ');
+    if (space == std::string::npos) {
+        std::fprintf(fs, "\t%s\n", s.c_str());
+        return;
+    }
+    std::string mnemonic = s.substr(0, space);
+    std::string args = s.substr(s.find_first_not_of(' ', space));
+
+    // the operand, if any, is the last token
+    if (len > 1)
+    {
+        auto last = args.rfind(' ');
+        args.erase(last == std::string::npos ? 0 : last + 1);
+        args += (len == 3) ?
+            address_ref(g, syms, bytes[1] | (bytes[2] << 8)) :
+            asm_hex(bytes[1], 2);
+    }
+    std::fprintf(fs, "\t%s\t%s\n", mnemonic.c_str(), args.c_str());
+}
+
+static bool close_output(std::FILE* fs, const char* path)
+{
+    bool ok = !std::ferror(fs);
+    if (std::fclose(fs) != 0)
+        ok = false;
+    if (!ok)
+        emu_printerr("Could not write %s", path);
+    return ok;
+}
+
+bool cfg_write_listing(const char* path, const cfg& g, const symtab& syms)
+{
+    std::FILE* fs = std::fopen(path, "w");
+    if (!fs) {
+        emu_printerr("Could not open %s", path);
+        return false;
+    }
+
+    const cfg_image& image = g.image;
+    unsigned end = image.base + unsigned(image.bytes.size());
+    std::fprintf(fs, "\torg\t%s\n", asm_hex(image.base, 4).c_str());
+
+    // data and subroutines are set off by blank lines
+    bool blank = false;
+    auto separate = [&]() {
+        if (!blank) std::fputc('\n', fs);
+        blank = true;
+    };
+    for (unsigned a = image.base; a < end; )
+    {
+        if (!(g.flags[a] & CFG_INSN))
+        {
+            unsigned data_end = a;
+            while (data_end < end && !(g.flags[data_end] & CFG_INSN))
+                ++data_end;
+            separate();
+            write_data(fs, g, syms, a, data_end);
+            blank = false;
+            separate();
+            a = data_end;
+            continue;
+        }
+
+        if (has_label(g, a))
+        {
+            if (g.flags[a] & (CFG_ENTRY | CFG_CALL_TARGET))
+                separate();
+            std::fprintf(fs, "%s:\n", label_name(syms, a).c_str());
+        }
+        write_insn(fs, g, syms, a);
+        blank = false;
+        a += i8080_instr_len(image.at(a));
+    }
+
+    std::fputs("\tend\n", fs);
+    return close_output(fs, path);
+}
+
+static const char* const EDGE_NAMES[] = { "fall", "jump", "branch", "call" };
+static const char* const EXIT_NAMES[] = { "fall", "jump", "ret", "indirect", "stop" };
+
+bool cfg_write_dot(const char* path, const cfg& g, const symtab& syms)
+{
+    std::FILE* fs = std::fopen(path, "w");
+    if (!fs) {
+        emu_printerr("Could not open %s", path);
+        return false;
+    }
+
+    std::fputs("digraph cfg {\n"
+        "\tnode [shape=box, fontname=\"monospace\"];\n", fs);
+    std::vector<bool> external(0x10000);
+    for (const auto& b : g.blocks)
+    {
+        std::fprintf(fs, "\t\"%04x\" [label=\"%s\\n%04x-%04x, %u instr\"];\n",
+            b.start, label_name(syms, b.start).c_str(),
+            b.start, b.start + b.size - 1, b.ninsns);
+        for (const auto& e : b.succ)
+        {
+            static const char* const STYLES[] = {
+                "style=dashed", "", "color=blue", "style=dotted" };
+            std::fprintf(fs, "\t\"%04x\" -> \"%04x\" [label=\"%s\"%s%s];\n",
+                b.start, e.to, EDGE_NAMES[e.kind],
+                *STYLES[e.kind] ? ", " : "", STYLES[e.kind]);
+            if (e.external)
+                external[e.to] = true;
+        }
+    }
+    for (unsigned a = 0; a < 0x10000; ++a)
+        if (external[a])
+            std::fprintf(fs, "\t\"%04x\" [label=\"%04x\", shape=ellipse];\n", a, a);
+    std::fputs("}\n", fs);
+    return close_output(fs, path);
+}
+
+static std::string json_string(const std::string& s)
+{
+    std::string out = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if (static_cast<unsigned char>(c) < 0x20)
+            continue;
+        out += c;
+    }
+    return out + "\"";
+}
+
+bool cfg_write_json(const char* path, const cfg& g, const symtab& syms)
+{
+    std::FILE* fs = std::fopen(path, "w");
+    if (!fs) {
+        emu_printerr("Could not open %s", path);
+        return false;
+    }
+
+    const cfg_image& image = g.image;
+    std::fprintf(fs, "{\n  \"base\": %u,\n  \"size\": %u,\n  \"entries\": [",
+        image.base, unsigned(image.bytes.size()));
+    for (std::size_t i = 0; i < g.entries.size(); ++i)
+        std::fprintf(fs, "%s%u", i ? ", " : "", g.entries[i]);
+    std::fputs("],\n  \"blocks\": [", fs);
+
+    for (std::size_t i = 0; i < g.blocks.size(); ++i)
+    {
+        const cfg_block& b = g.blocks[i];
+        std::fprintf(fs, "%s\n    {\"start\": %u, \"size\": %u, \"insns\": %u, "
+            "\"label\": %s, \"exit\": \"%s\", \"succ\": [",
+            i ? "," : "", b.start, b.size, b.ninsns,
+            json_string(label_name(syms, b.start)).c_str(), EXIT_NAMES[b.exit]);
+        for (std::size_t j = 0; j < b.succ.size(); ++j)
+        {
+            const cfg_edge& e = b.succ[j];
+            std::fprintf(fs, "%s{\"to\": %u, \"kind\": \"%s\"%s}", j ? ", " : "",
+                e.to, EDGE_NAMES[e.kind], e.external ? ", \"external\": true" : "");
+        }
+        std::fputs("]}", fs);
+    }
+    std::fputs("\n  ],\n  \"data\": [", fs);
+
+    // unreached ranges
+    unsigned end = image.base + unsigned(image.bytes.size());
+    bool first = true;
+    for (unsigned a = image.base; a < end; )
+    {
+        if (g.flags[a] & (CFG_INSN | CFG_OPERAND)) { ++a; continue; }
+        unsigned start = a;
+        while (a < end && !(g.flags[a] & (CFG_INSN | CFG_OPERAND)))
+            ++a;
+        std::fprintf(fs, "%s{\"start\": %u, \"size\": %u}", first ? "" : ", ", start, a - start);
+        first = false;
+    }
+    std::fputs("]\n}\n", fs);
+    return close_output(fs, path);
+}
@@ -0,0 +1,136 @@
+#ifndef CFG_HPP
+#define CFG_HPP
+
+#include <vector>
+#include "i8080/i8080.h"
+#include "symbols.hpp"
+
+// Control-flow graph of a program image, recovered by recursive
+// descent: decoding starts at the entry points and follows
+// jumps, calls and returns, so data embedded in code is not
+// mistaken for instructions. Bytes never reached are data.
+
+// A program image: bytes loaded at base.
+struct cfg_image
+{
+    i8080_addr_t base;
+    std::vector<i8080_word_t> bytes;
+
+    bool contains(unsigned addr) const
+    {
+        return addr >= base && addr - base < bytes.size();
+    }
+    i8080_word_t at(unsigned addr) const
+    {
+        return contains(addr) ? bytes[addr - base] : 0;
+    }
+};
+
+// Per-byte flags, see cfg::flags.
+enum
+{
+    // First byte of an instruction.
+    CFG_INSN = 0x01,
+    // Operand byte of an instruction.
+    CFG_OPERAND = 0x02,
+    // Entry point.
+    CFG_ENTRY = 0x04,
+    // Target of a jump.
+    CFG_JUMP_TARGET = 0x08,
+    // Target of a call or RST.
+    CFG_CALL_TARGET = 0x10,
+    // Address operand of a load, store or LXI.
+    CFG_DATA_REF = 0x20,
+    // Starts a basic block.
+    CFG_LEADER = 0x40,
+
+    CFG_LABEL = CFG_ENTRY | CFG_JUMP_TARGET | CFG_CALL_TARGET | CFG_DATA_REF
+};
+
+enum cfg_edge_kind
+{
+    // Falls through to the next block.
+    CFG_FALL,
+    // Unconditional jump.
+    CFG_JUMP,
+    // Conditional jump, taken.
+    CFG_BRANCH,
+    // Call or RST. The block also falls through.
+    CFG_CALL
+};
+
+struct cfg_edge
+{
+    i8080_addr_t to;
+    cfg_edge_kind kind;
+    // Target is outside the image, e.g. BDOS at 0x0005.
+    bool external;
+};
+
+// How a block ends.
+enum cfg_exit
+{
+    // Falls into the next block, possibly after a call
+    // or conditional jump or return.
+    CFG_EXIT_FALL,
+    CFG_EXIT_JUMP,
+    CFG_EXIT_RET,
+    // PCHL, target unknown.
+    CFG_EXIT_INDIRECT,
+    // Ran into data, the end of the image, or the
+    // middle of another instruction.
+    CFG_EXIT_STOP
+};
+
+struct cfg_block
+{
+    i8080_addr_t start;
+    // Bytes in the block.
+    unsigned size;
+    unsigned ninsns;
+    cfg_exit exit;
+    std::vector<cfg_edge> succ;
+};
+
+struct cfg
+{
+    cfg_image image;
+    std::vector<i8080_addr_t> entries;
+    // Flags of each address, indexed by address.
+    std::vector<unsigned char> flags;
+    // Sorted by start address.
+    std::vector<cfg_block> blocks;
+};
+
+// Load a binary file at base.
+// Returns true on success.
+bool cfg_image_load(cfg_image& image, const char* path, i8080_addr_t base);
+
+// The usual entry points of image: its load address,
+// and the RST vectors if it covers them.
+std::vector<i8080_addr_t> cfg_entries(const cfg_image& image);
+
+// Build the graph of g.image from entries. Entries
+// outside the image are ignored.
+void cfg_build(cfg& g, const std::vector<i8080_addr_t>& entries);
+
+// Index of the block containing addr, or -1 if addr is not code.
+int cfg_block_at(const cfg& g, i8080_addr_t addr);
+
+// Write a listing of the image that an 8080 assembler can
+// reassemble: code with labels at branch targets and data
+// references, and unreached bytes as DB. Labels are taken
+// from syms where possible.
+// Returns true on success.
+bool cfg_write_listing(const char* path, const cfg& g, const symtab& syms);
+
+// Write the graph in Graphviz DOT format.
+// Returns true on success.
+bool cfg_write_dot(const char* path, const cfg& g, const symtab& syms);
+
+// Write the graph as JSON: entries, blocks with their
+// successors, and data ranges.
+// Returns true on success.
+bool cfg_write_json(const char* path, const cfg& g, const symtab& syms);
+
+#endif
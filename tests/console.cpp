@@ -0,0 +1,457 @@
+#if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#define EMU_USING_POSIX_CONSOLE 1
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <io.h>
+#define EMU_USING_WIN32_CONSOLE 1
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <csignal>
+#include <cerrno>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "i8080/i8080.h"
+#include "console.hpp"
+#include "emu.hpp"
+
+static constexpr std::size_t bufsize = 1 << 16;
+
+static struct console
+{
+    char buf[bufsize];
+    std::size_t n;
+    // Flush at newlines.
+    bool tty;
+}
+CONSOLE;
+
+// Bytes of stdin read ahead.
+static constexpr std::size_t ring_size = 4096;
+// This many status checks in a row, each this few cycles after
+// the last, are taken as a loop waiting for input.
+static constexpr unsigned busy_polls = 16;
+static constexpr i8080_cycles_t busy_poll_cycles = 256;
+// Longest wait for input at a time, so interrupts are still taken.
+static constexpr auto input_wait = std::chrono::milliseconds(10);
+
+static struct input
+{
+    // Input file, or null for stdin.
+    std::FILE* fs;
+    // Filled by the reader thread from stdin. head and
+    // tail count all bytes ever written and read.
+    unsigned char ring[ring_size];
+    std::atomic<std::size_t> head;
+    std::atomic<std::size_t> tail;
+    std::atomic<bool> eof;
+    std::atomic<bool> stopping;
+    std::thread reader;
+    bool reading;
+    // Set while the CPU's thread waits for input.
+    std::atomic<bool> waiting;
+    std::mutex lock;
+    std::condition_variable arrived;
+    // The last byte was CR, so an LF after it is dropped.
+    bool after_cr;
+    i8080_cycles_t last_poll;
+    unsigned close_polls;
+    bool raw;
+#if defined(EMU_USING_POSIX_CONSOLE)
+    struct termios saved;
+#elif defined(EMU_USING_WIN32_CONSOLE)
+    DWORD saved;
+#endif
+}
+INPUT;
+
+// VS C4127
+static constexpr bool word_t_is_byte(void)
+{
+    return sizeof(i8080_word_t) == 1;
+}
+
+static bool stdout_is_tty(void)
+{
+#if defined(EMU_USING_POSIX_CONSOLE)
+    return ::isatty(::fileno(stdout)) != 0;
+#elif defined(EMU_USING_WIN32_CONSOLE)
+    return ::_isatty(::_fileno(stdout)) != 0;
+#else
+    return true;
+#endif
+}
+
+bool console_init(const char* input)
+{
+    console_flush();
+    CONSOLE.tty = stdout_is_tty();
+
+    if (INPUT.fs)
+        std::fclose(INPUT.fs);
+    INPUT.fs = nullptr;
+    if (input && !(INPUT.fs = std::fopen(input, "rb"))) {
+        emu_printerr("Could not open %s", input);
+        return false;
+    }
+    INPUT.after_cr = false;
+    INPUT.close_polls = 0;
+    return true;
+}
+
+void console_flush(void)
+{
+    if (CONSOLE.n == 0) return;
+    // through stdio, to stay in order with other output
+    std::fwrite(CONSOLE.buf, 1, CONSOLE.n, stdout);
+    std::fflush(stdout);
+    CONSOLE.n = 0;
+}
+
+void console_putc(int c)
+{
+    if (CONSOLE.n == bufsize)
+        console_flush();
+    CONSOLE.buf[CONSOLE.n++] = char(c);
+    if (c == '\n' && CONSOLE.tty)
+        console_flush();
+}
+
+void console_write(const char* s, std::size_t n)
+{
+    const char* nl = CONSOLE.tty ? static_cast<const char*>(std::memchr(s, '\n', n)) : nullptr;
+    while (n != 0)
+    {
+        if (CONSOLE.n == bufsize)
+            console_flush();
+        std::size_t len = bufsize - CONSOLE.n < n ? bufsize - CONSOLE.n : n;
+        std::memcpy(CONSOLE.buf + CONSOLE.n, s, len);
+        CONSOLE.n += len;
+        s += len;
+        n -= len;
+    }
+    if (nl)
+        console_flush();
+}
+
+void console_puts(const i8080_word_t* mem, i8080_addr_t addr, i8080_word_t term)
+{
+    if (!word_t_is_byte())
+    {
+        i8080_word_t c;
+        i8080_addr_t stop = addr;
+        while ((c = mem[addr]) != term)
+        {
+            console_putc(c);
+            addr = i8080_addr_t((addr + 1) & 0xffff);
+            if (addr == stop) break;
+        }
+        return;
+    }
+    // the rest of memory, then from 0 back to the start
+    const char* start = reinterpret_cast<const char*>(mem) + addr;
+    std::size_t left = 65536u - addr;
+    const void* end = std::memchr(start, term, left);
+    if (end || addr == 0)
+    {
+        console_write(start, end ? static_cast<const char*>(end) - start : left);
+        return;
+    }
+    console_write(start, left);
+    start = reinterpret_cast<const char*>(mem);
+    end = std::memchr(start, term, addr);
+    console_write(start, end ? static_cast<const char*>(end) - start : addr);
+}
+
+#if defined(EMU_USING_POSIX_CONSOLE)
+// Signals whose default action is to end the process.
+static const int fatal_signals[] = { SIGINT, SIGTERM, SIGHUP, SIGQUIT };
+
+static void restore_terminal(int sig)
+{
+    ::tcsetattr(0, TCSANOW, &INPUT.saved);
+    std::signal(sig, SIG_DFL);
+    std::raise(sig);
+}
+#endif
+
+// Put a terminal on stdin in raw mode, or back.
+static void raw_mode(bool on)
+{
+#if defined(EMU_USING_POSIX_CONSOLE)
+    if (on)
+    {
+        if (!::isatty(0) || ::tcgetattr(0, &INPUT.saved) != 0)
+            return;
+        // a byte at a time, unechoed, Enter as CR; Ctrl+C still interrupts
+        struct termios raw = INPUT.saved;
+        raw.c_lflag &= ~tcflag_t(ICANON | ECHO);
+        raw.c_iflag &= ~tcflag_t(ICRNL | IXON);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        if (::tcsetattr(0, TCSANOW, &raw) != 0)
+            return;
+        INPUT.raw = true;
+        // don't leave the terminal raw if killed
+        for (int sig : fatal_signals)
+        {
+            auto old = std::signal(sig, restore_terminal);
+            if (old != SIG_DFL)
+                std::signal(sig, old);
+        }
+    }
+    else if (INPUT.raw)
+    {
+        for (int sig : fatal_signals)
+        {
+            auto old = std::signal(sig, SIG_DFL);
+            if (old != restore_terminal)
+                std::signal(sig, old);
+        }
+        ::tcsetattr(0, TCSANOW, &INPUT.saved);
+        INPUT.raw = false;
+    }
+#elif defined(EMU_USING_WIN32_CONSOLE)
+    HANDLE in = ::GetStdHandle(STD_INPUT_HANDLE);
+    if (on)
+    {
+        if (!::GetConsoleMode(in, &INPUT.saved))
+            return;
+        DWORD raw = INPUT.saved & ~DWORD(ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT);
+        INPUT.raw = ::SetConsoleMode(in, raw) != 0;
+    }
+    else if (INPUT.raw)
+    {
+        ::SetConsoleMode(in, INPUT.saved);
+        INPUT.raw = false;
+    }
+#else
+    (void)on;
+#endif
+}
+
+static std::size_t available(void)
+{
+    return INPUT.head.load() - INPUT.tail.load(std::memory_order_relaxed);
+}
+
+static bool input_done(void)
+{
+    return available() == 0 && INPUT.eof.load();
+}
+
+static void notify(void)
+{
+    if (INPUT.waiting.load())
+    {
+        std::lock_guard<std::mutex> guard(INPUT.lock);
+        INPUT.arrived.notify_one();
+    }
+}
+
+// Reads stdin into the ring until the end of input
+// or console_end().
+static void input_reader(void)
+{
+    unsigned char buf[256];
+    while (!INPUT.stopping.load(std::memory_order_acquire))
+    {
+        std::size_t head = INPUT.head.load(std::memory_order_relaxed);
+        std::size_t space = ring_size - (head - INPUT.tail.load(std::memory_order_acquire));
+        if (space == 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        std::size_t want = space < sizeof buf ? space : sizeof buf;
+#if defined(EMU_USING_POSIX_CONSOLE)
+        // wake up now and then to see if stopping
+        struct pollfd pfd = { 0, POLLIN, 0 };
+        int r = ::poll(&pfd, 1, 50);
+        if (r == 0 || (r < 0 && errno == EINTR))
+            continue;
+        ::ssize_t n = r < 0 ? -1 : ::read(0, buf, want);
+        if (n < 0 && errno == EINTR)
+            continue;
+#else
+        // no way to stop early, see stop_reader()
+        int c = std::fgetc(stdin);
+        long n = c == EOF ? 0 : 1;
+        buf[0] = static_cast<unsigned char>(c);
+        (void)want;
+#endif
+        if (n <= 0)
+        {
+            INPUT.eof.store(true);
+            notify();
+            break;
+        }
+        for (std::size_t i = 0; i < std::size_t(n); ++i)
+            INPUT.ring[(head + i) % ring_size] = buf[i];
+        INPUT.head.store(head + std::size_t(n));
+        notify();
+    }
+}
+
+static void start_reader(void)
+{
+    if (INPUT.reading || INPUT.eof.load())
+        return;
+    raw_mode(true);
+    INPUT.stopping.store(false);
+    INPUT.reader = std::thread(input_reader);
+    INPUT.reading = true;
+}
+
+static void stop_reader(void)
+{
+#if defined(EMU_USING_POSIX_CONSOLE)
+    if (INPUT.reading)
+    {
+        INPUT.stopping.store(true, std::memory_order_release);
+        INPUT.reader.join();
+        INPUT.reading = false;
+    }
+#else
+    // stays blocked reading stdin, for the next program
+    if (INPUT.reader.joinable())
+        INPUT.reader.detach();
+#endif
+    raw_mode(false);
+}
+
+// Wait up to input_wait for stdin.
+static void wait_input(void)
+{
+    std::unique_lock<std::mutex> guard(INPUT.lock);
+    INPUT.waiting.store(true);
+    INPUT.arrived.wait_for(guard, input_wait,
+        [] { return available() != 0 || INPUT.eof.load(); });
+    INPUT.waiting.store(false);
+}
+
+bool console_ready(i8080_cycles_t now)
+{
+    // a read gets a byte or ends the program
+    if (INPUT.fs)
+        return true;
+    start_reader();
+    if (available() != 0 || input_done())
+    {
+        INPUT.close_polls = 0;
+        return true;
+    }
+
+    if (now - INPUT.last_poll < busy_poll_cycles)
+    {
+        if (++INPUT.close_polls >= busy_polls)
+        {
+            console_flush();
+            wait_input();
+        }
+    }
+    else INPUT.close_polls = 0;
+    INPUT.last_poll = now;
+
+    bool ready = available() != 0 || input_done();
+    if (!ready && CONSOLE.tty)
+        console_flush();
+    return ready;
+}
+
+int console_getc(void)
+{
+    for (;;)
+    {
+        int c;
+        if (INPUT.fs)
+        {
+            if (CONSOLE.tty)
+                console_flush();
+            c = std::fgetc(INPUT.fs);
+        }
+        else
+        {
+            start_reader();
+            if (CONSOLE.tty || available() == 0)
+                console_flush();
+            while (available() == 0 && !INPUT.eof.load())
+                wait_input();
+            if (available() == 0)
+                return -1;
+            std::size_t tail = INPUT.tail.load(std::memory_order_relaxed);
+            c = INPUT.ring[tail % ring_size];
+            INPUT.tail.store(tail + 1, std::memory_order_release);
+        }
+        if (c == EOF)
+            return -1;
+
+        // host newlines are CR, as from a CP/M keyboard
+        bool lf_after_cr = c == '\n' && INPUT.after_cr;
+        INPUT.after_cr = c == '\r';
+        if (!lf_after_cr)
+            return c == '\n' ? '\r' : c;
+    }
+}
+
+// Echo c, with control characters as ^C.
+static void echo(int c)
+{
+    if (c < 0x20 && c != '\t')
+    {
+        console_putc('^');
+        c += '@';
+    }
+    console_putc(c);
+}
+
+bool console_readline(i8080_word_t* mem, i8080_addr_t addr)
+{
+    unsigned max = mem[addr], n = 0;
+    while (n < max)
+    {
+        int c = console_getc();
+        if (c < 0)
+            return false;
+        if (c == '\r' || c == '\n')
+            break;
+        if (c == 0x08 || c == 0x7f)  // backspace, rubout
+        {
+            if (n == 0) continue;
+            // the line may wrap around the end of memory
+            i8080_word_t last = mem[i8080_addr_t(addr + 2 + --n)];
+            bool ctrl = last < 0x20 && last != '\t';
+            console_write(ctrl ? "\b\b  \b\b" : "\b \b", ctrl ? 6 : 3);
+        }
+        else if (c == 0x18 || c == 0x15)  // Ctrl+X, Ctrl+U: erase line
+        {
+            for (; n != 0; --n)
+                console_write("\b \b", 3);
+        }
+        else if (c == 0x03 && n == 0)  // Ctrl+C: warm boot
+            return false;
+        else
+        {
+            echo(c);
+            mem[i8080_addr_t(addr + 2 + n++)] = i8080_word_t(c);
+        }
+    }
+    mem[i8080_addr_t(addr + 1)] = i8080_word_t(n);
+    console_putc('\r');
+    return true;
+}
+
+void console_end(void)
+{
+    console_flush();
+    stop_reader();
+}
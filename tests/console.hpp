@@ -0,0 +1,53 @@
+#ifndef CONSOLE_HPP
+#define CONSOLE_HPP
+
+#include <cstddef>
+#include "i8080/i8080.h"
+
+// Console output of CP/M programs, gathered in a large buffer
+// instead of going through stdio a character at a time. The
+// buffer is written out when full, at console input and at
+// console_end(), and also at each newline if stdout is a
+// terminal. Otherwise it is only written in whole buffers.
+//
+// Console input comes from a file, or from stdin. stdin is
+// read ahead by a thread, from the first time the program
+// asks, so checking for input never blocks; a terminal is put
+// in raw mode meanwhile. Host newlines are read as CR. Once
+// input runs out, reads return -1 and the program should end.
+
+// Set up for a program. Input is read from the file input,
+// or stdin if null.
+// Returns true on success.
+bool console_init(const char* input);
+
+void console_putc(int c);
+void console_write(const char* s, std::size_t n);
+
+// Write the string at addr in mem up to (not including) term,
+// e.g. for BDOS 9. Wraps around the end of memory.
+void console_puts(const i8080_word_t* mem, i8080_addr_t addr, i8080_word_t term);
+
+// Write out what is buffered.
+void console_flush(void);
+
+// Whether console_getc() would not wait. True once input
+// runs out. Checks that come in quick succession, as from a
+// loop waiting for a key, wait briefly for input instead of
+// returning at once. now is the CPU's cycle count.
+bool console_ready(i8080_cycles_t now);
+
+// Read a character, waiting for one.
+// Returns -1 at the end of input.
+int console_getc(void);
+
+// Read a line, with echo and editing, into the BDOS 10 buffer
+// at addr in mem.
+// Returns false at the end of input or on Ctrl+C.
+bool console_readline(i8080_word_t* mem, i8080_addr_t addr);
+
+// Flush, stop reading stdin and restore the terminal.
+// Call when the program ends.
+void console_end(void);
+
+#endif
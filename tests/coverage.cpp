@@ -0,0 +1,214 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "i8080/i8080.h"
+#include "coverage.hpp"
+#include "emu.hpp"
+
+namespace {
+
+struct tally
+{
+    unsigned insns;
+    unsigned insns_hit;
+    // Two directions per conditional branch.
+    unsigned branches;
+    unsigned branches_hit;
+};
+
+// Code between two symbols.
+struct region
+{
+    std::string name;
+    i8080_addr_t start;
+    tally t;
+};
+
+}
+
+static bool bit(const unsigned char* map, unsigned addr)
+{
+    return (map[addr >> 3] >> (addr & 7)) & 1;
+}
+
+static bool is_cond_branch(i8080_word_t op)
+{
+    return (op & 0xc7) == 0xc0 || (op & 0xc7) == 0xc2 || (op & 0xc7) == 0xc4;
+}
+
+static void count(tally& t, const i8080_coverage* cov, const cfg& g, unsigned addr)
+{
+    t.insns++;
+    t.insns_hit += bit(cov->exec, addr);
+    if (is_cond_branch(g.image.at(addr)))
+    {
+        t.branches += 2;
+        t.branches_hit += bit(cov->taken, addr) + bit(cov->not_taken, addr);
+    }
+}
+
+// Split the code into regions starting at each symbol.
+static std::vector<region> regions(const i8080_coverage* cov, const cfg& g, const symtab& syms)
+{
+    std::vector<region> regs;
+    regs.push_back({ "(no symbol)", 0, {} });
+    for (const auto& s : syms.syms)
+        regs.push_back({ s.name, s.addr, {} });
+
+    const cfg_image& image = g.image;
+    std::size_t r = 0;
+    for (unsigned a = image.base; a < image.base + image.bytes.size(); ++a)
+    {
+        if (!(g.flags[a] & CFG_INSN)) continue;
+        while (r + 1 < regs.size() && regs[r + 1].start <= a)
+            ++r;
+        count(regs[r].t, cov, g, a);
+    }
+
+    regs.erase(std::remove_if(regs.begin(), regs.end(),
+        [](const region& reg) { return reg.t.insns == 0; }), regs.end());
+    return regs;
+}
+
+static double percent(unsigned n, unsigned total)
+{
+    return total ? 100.0 * n / total : 0.0;
+}
+
+static bool close_report(std::FILE* fs, const char* path)
+{
+    bool ok = !std::ferror(fs);
+    if (std::fclose(fs) != 0)
+        ok = false;
+    if (!ok)
+        emu_printerr("Could not write %s", path);
+    return ok;
+}
+
+void coverage_graph(cfg& g, const i8080_coverage* cov,
+    const std::vector<i8080_addr_t>& entries)
+{
+    // executed addresses last, so they are decoded first
+    std::vector<i8080_addr_t> all = entries;
+    const cfg_image& image = g.image;
+    for (unsigned a = image.base; a < image.base + image.bytes.size(); ++a)
+        if (bit(cov->exec, a))
+            all.push_back(i8080_addr_t(a));
+    cfg_build(g, all);
+}
+
+bool coverage_write(const char* path, const i8080_coverage* cov,
+    const cfg& g, const symtab& syms, const char* progname)
+{
+    std::FILE* fs = std::fopen(path, "w");
+    if (!fs) {
+        emu_printerr("Could not open %s", path);
+        return false;
+    }
+
+    auto regs = regions(cov, g, syms);
+    tally total = {};
+    for (const auto& reg : regs)
+    {
+        total.insns += reg.t.insns;
+        total.insns_hit += reg.t.insns_hit;
+        total.branches += reg.t.branches;
+        total.branches_hit += reg.t.branches_hit;
+    }
+
+    std::fprintf(fs, "Coverage of %s\n", progname);
+    std::fprintf(fs, "Instructions: %u/%u (%.2f%%)\n", total.insns_hit, total.insns,
+        percent(total.insns_hit, total.insns));
+    std::fprintf(fs, "Branch directions: %u/%u (%.2f%%)\n\n", total.branches_hit, total.branches,
+        percent(total.branches_hit, total.branches));
+
+    if (!syms.syms.empty())
+    {
+        std::fprintf(fs, "%-24s %17s %17s\n", "Symbol", "Instructions", "Branches");
+        for (const auto& reg : regs)
+        {
+            std::fprintf(fs, "%-24s %6u/%-5u %4.0f%% %6u/%-5u %4.0f%%\n", reg.name.c_str(),
+                reg.t.insns_hit, reg.t.insns, percent(reg.t.insns_hit, reg.t.insns),
+                reg.t.branches_hit, reg.t.branches, percent(reg.t.branches_hit, reg.t.branches));
+        }
+        std::fputc('\n', fs);
+    }
+
+    // Ran: * or -. Branches: T taken, N not taken.
+    std::fprintf(fs, "%-8s %-4s %-4s %-20s %s\n", "Address", "Ran", "Br", "Instruction", "Symbol");
+    const cfg_image& image = g.image;
+    for (unsigned a = image.base; a < image.base + image.bytes.size(); ++a)
+    {
+        if (!(g.flags[a] & CFG_INSN)) continue;
+
+        i8080_word_t bytes[3] = { image.at(a), image.at(a + 1), image.at(a + 2) };
+        char text[32];
+        if (!i8080_disasm(bytes, 3, text, sizeof(text)))
+            text[0] = '\0';
+
+        std::string br;
+        if (is_cond_branch(bytes[0]))
+        {
+            br += bit(cov->taken, a) ? "T" : "";
+            br += bit(cov->not_taken, a) ? "N" : "";
+            if (br.empty()) br = "--";
+        }
+        std::fprintf(fs, "0x%04x   %-4s %-4s %-20s %s\n", a, bit(cov->exec, a) ? "*" : "-",
+            br.c_str(), text, syms.syms.empty() ? "" : symtab_name(syms, i8080_addr_t(a)).c_str());
+    }
+
+    return close_report(fs, path);
+}
+
+bool coverage_write_lcov(const char* path, const i8080_coverage* cov,
+    const cfg& g, const symtab& syms, const char* progname)
+{
+    std::FILE* fs = std::fopen(path, "w");
+    if (!fs) {
+        emu_printerr("Could not open %s", path);
+        return false;
+    }
+
+    std::fprintf(fs, "TN:\nSF:%s\n", progname);
+
+    auto regs = regions(cov, g, syms);
+    unsigned fns = 0, fns_hit = 0;
+    if (!syms.syms.empty())
+    {
+        for (const auto& reg : regs)
+            std::fprintf(fs, "FN:%u,%s\n", reg.start, reg.name.c_str());
+        for (const auto& reg : regs)
+        {
+            std::fprintf(fs, "FNDA:%u,%s\n", reg.t.insns_hit ? 1 : 0, reg.name.c_str());
+            fns++;
+            fns_hit += reg.t.insns_hit != 0;
+        }
+        std::fprintf(fs, "FNF:%u\nFNH:%u\n", fns, fns_hit);
+    }
+
+    const cfg_image& image = g.image;
+    unsigned end = image.base + unsigned(image.bytes.size());
+    tally total = {};
+    for (unsigned a = image.base; a < end; ++a)
+    {
+        if (!(g.flags[a] & CFG_INSN) || !is_cond_branch(image.at(a))) continue;
+        // lcov writes '-' for branches whose line never ran
+        if (bit(cov->exec, a))
+            std::fprintf(fs, "BRDA:%u,0,0,%d\nBRDA:%u,0,1,%d\n",
+                a, bit(cov->taken, a), a, bit(cov->not_taken, a));
+        else
+            std::fprintf(fs, "BRDA:%u,0,0,-\nBRDA:%u,0,1,-\n", a, a);
+    }
+    for (unsigned a = image.base; a < end; ++a)
+    {
+        if (!(g.flags[a] & CFG_INSN)) continue;
+        count(total, cov, g, a);
+        std::fprintf(fs, "DA:%u,%d\n", a, bit(cov->exec, a));
+    }
+    std::fprintf(fs, "BRF:%u\nBRH:%u\nLF:%u\nLH:%u\nend_of_record\n",
+        total.branches, total.branches_hit, total.insns, total.insns_hit);
+
+    return close_report(fs, path);
+}
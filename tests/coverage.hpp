@@ -0,0 +1,30 @@
+#ifndef COVERAGE_HPP
+#define COVERAGE_HPP
+
+#include "i8080/i8080.h"
+#include "symbols.hpp"
+#include "cfg.hpp"
+
+// Coverage reports. Code is found by disassembling the program
+// image (see cfg.hpp) from its entry points and from every
+// address executed, so code that never ran is reported too.
+// Addresses outside the image are not reported.
+
+// Build g from g.image, cov and entries.
+void coverage_graph(cfg& g, const i8080_coverage* cov,
+    const std::vector<i8080_addr_t>& entries);
+
+// Write a summary, per symbol if syms is not empty, then
+// every instruction with whether it ran and which ways
+// its conditional branch went.
+// Returns true on success.
+bool coverage_write(const char* path, const i8080_coverage* cov,
+    const cfg& g, const symtab& syms, const char* progname);
+
+// Write an lcov tracefile for progname, with addresses as
+// line numbers and symbols as functions.
+// Returns true on success.
+bool coverage_write_lcov(const char* path, const i8080_coverage* cov,
+    const cfg& g, const symtab& syms, const char* progname);
+
+#endif
@@ -0,0 +1,818 @@
+#if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#include <dirent.h>
+#include <sys/stat.h>
+#define EMU_USING_POSIX_CPMFS 1
+#elif defined(_WIN32)
+#include <io.h>
+#define EMU_USING_WIN32_CPMFS 1
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "i8080/i8080.h"
+#include "cpmfs.hpp"
+#include "emu.hpp"
+
+#define wordconcat(w1, w2) (((i8080_dword_t)(w1) << 8) | (w2))
+
+// FCB fields.
+enum { FCB_DR = 0, FCB_NAME = 1, FCB_EX = 12, FCB_S1 = 13, FCB_S2 = 14,
+    FCB_RC = 15, FCB_AL = 16, FCB_CR = 32, FCB_R0 = 33 };
+
+static constexpr unsigned record_size = 128;
+// Records per extent, i.e. 16K extents.
+static constexpr unsigned extent_records = 128;
+static constexpr unsigned num_drives = 16;
+// Open host files kept at once.
+static constexpr std::size_t max_open = 16;
+static constexpr std::size_t file_bufsize = 65536;
+
+// A 256K disk of 1K blocks, for programs that ask for the
+// disk parameters. The allocation vector follows the DPB.
+static constexpr unsigned alloc_offset = 16;
+static const unsigned char DPB[] = {
+    32, 0,      // SPT: 128-byte records per track
+    3, 7, 0,    // BSH, BLM, EXM: 1K blocks
+    255, 0,     // DSM: blocks - 1
+    63, 0,      // DRM: directory entries - 1
+    0xc0, 0,    // AL0, AL1: directory blocks
+    0, 0,       // CKS
+    0, 0        // OFF: reserved tracks
+};
+
+struct cpm_file
+{
+    std::string path;
+    std::FILE* fs;
+    unsigned long size;
+    // Position of fs, or -1 if unknown.
+    long pos;
+    // Last access was a write; a seek must come before a read.
+    bool writing;
+    bool readonly;
+    unsigned long long used;
+};
+
+// A directory entry found by a search.
+struct cpm_entry
+{
+    char name[11];
+    unsigned extent;
+    unsigned rc;
+};
+
+static struct cpmfs
+{
+    i8080_word_t* mem;
+    std::string dir;
+    i8080_addr_t dma;
+    i8080_addr_t dpb;
+    unsigned drive;
+    unsigned user;
+    // Open files, by drive and FCB name.
+    std::unordered_map<std::string, cpm_file> files;
+    // Most recent file, as most calls are for the same one.
+    std::string last_key;
+    cpm_file* last;
+    unsigned long long tick;
+    std::vector<cpm_entry> found;
+    std::size_t next_found;
+}
+CPMFS;
+
+// Host directory of a drive.
+static std::string drive_dir(unsigned drive)
+{
+    if (drive == 0)
+        return CPMFS.dir;
+    return CPMFS.dir + "/" + char('a' + drive);
+}
+
+static bool dir_exists(const std::string& path)
+{
+#if defined(EMU_USING_POSIX_CPMFS)
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+#elif defined(EMU_USING_WIN32_CPMFS)
+    return ::_access(path.c_str(), 0) == 0;
+#else
+    return !path.empty();
+#endif
+}
+
+// Names of the regular files in a directory.
+static std::vector<std::string> list_dir(const std::string& path)
+{
+    std::vector<std::string> names;
+#if defined(EMU_USING_POSIX_CPMFS)
+    DIR* d = ::opendir(path.c_str());
+    if (!d) return names;
+    while (const dirent* ent = ::readdir(d))
+    {
+        struct stat st;
+        std::string name = ent->d_name;
+        if (::stat((path + "/" + name).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            names.push_back(name);
+    }
+    ::closedir(d);
+#elif defined(EMU_USING_WIN32_CPMFS)
+    ::_finddata_t fd;
+    intptr_t h = ::_findfirst((path + "/*").c_str(), &fd);
+    if (h == -1) return names;
+    do {
+        if (!(fd.attrib & _A_SUBDIR))
+            names.push_back(fd.name);
+    } while (::_findnext(h, &fd) == 0);
+    ::_findclose(h);
+#else
+    (void)path;
+#endif
+    return names;
+}
+
+// Convert a host file name to an FCB name, blank padded.
+// Returns false if it is not a valid 8.3 name.
+static bool to_fcb_name(const std::string& host, char (&name)[11])
+{
+    auto dot = host.rfind('.');
+    std::string base = host.substr(0, dot);
+    std::string ext = dot == std::string::npos ? "" : host.substr(dot + 1);
+    if (base.empty() || base.size() > 8 || ext.size() > 3)
+        return false;
+
+    std::memset(name, ' ', sizeof name);
+    for (std::size_t i = 0; i < base.size() + ext.size(); ++i)
+    {
+        char c = i < base.size() ? base[i] : ext[i - base.size()];
+        if (c <= ' ' || c >= 0x7f || std::strchr("<>.,;:=?*[]%|()/\\", c))
+            return false;
+        name[i < base.size() ? i : 8 + i - base.size()] =
+            char(std::toupper(static_cast<unsigned char>(c)));
+    }
+    return true;
+}
+
+// Host file name for an FCB name.
+// Returns false if the name has characters to_fcb_name() would
+// not take, which could otherwise reach outside the directory.
+static bool to_host_name(const char* name, std::string& host)
+{
+    host.clear();
+    for (int i = 0; i < 8 && name[i] != ' '; ++i)
+        host += name[i];
+    if (name[8] != ' ')
+    {
+        host += '.';
+        for (int i = 8; i < 11 && name[i] != ' '; ++i)
+            host += name[i];
+    }
+    char check[11];
+    return to_fcb_name(host, check) && std::memcmp(check, name, sizeof check) == 0;
+}
+
+// Byte off of the FCB at addr. Wraps around the end of memory.
+static i8080_word_t& fcb_byte(i8080_addr_t addr, unsigned off)
+{
+    return CPMFS.mem[i8080_addr_t(addr + off)];
+}
+
+// FCB name at addr, without attribute bits.
+static void fcb_name(i8080_addr_t addr, char (&name)[11])
+{
+    for (int i = 0; i < 11; ++i)
+        name[i] = char(std::toupper(fcb_byte(addr, FCB_NAME + i) & 0x7f));
+}
+
+// Drive of the FCB at addr.
+static unsigned fcb_drive(i8080_addr_t addr)
+{
+    unsigned dr = fcb_byte(addr, FCB_DR);
+    return (dr == 0 || dr == '?' || dr > num_drives) ? CPMFS.drive : dr - 1;
+}
+
+static bool name_matches(const char* pattern, const char* name)
+{
+    for (int i = 0; i < 11; ++i)
+        if (pattern[i] != '?' && pattern[i] != name[i])
+            return false;
+    return true;
+}
+
+// Host files on drive matching an FCB name, which may have wildcards.
+static std::vector<std::pair<std::string, std::string>> find_files(unsigned drive,
+    const char* pattern)
+{
+    std::vector<std::pair<std::string, std::string>> found;
+    std::string dir = drive_dir(drive);
+    for (const auto& host : list_dir(dir))
+    {
+        char name[11];
+        if (to_fcb_name(host, name) && name_matches(pattern, name))
+            found.push_back(std::make_pair(std::string(name, 11), dir + "/" + host));
+    }
+    return found;
+}
+
+static std::string file_key(unsigned drive, const char* name)
+{
+    return char('A' + drive) + std::string(name, 11);
+}
+
+static bool close_file(cpm_file& f)
+{
+    if (std::fclose(f.fs) != 0) {
+        emu_printerr("Could not write %s", f.path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Close a cached file, if it is open.
+static void forget(const std::string& key)
+{
+    auto it = CPMFS.files.find(key);
+    if (it == CPMFS.files.end())
+        return;
+    if (CPMFS.last == &it->second)
+        CPMFS.last = nullptr;
+    close_file(it->second);
+    CPMFS.files.erase(it);
+}
+
+// Open a host file and cache it under key.
+static cpm_file* open_file(const std::string& key, const std::string& path, bool create)
+{
+    // its buffered writes must not land after a truncation
+    forget(key);
+
+    cpm_file f;
+    f.path = path;
+    f.readonly = false;
+    f.fs = std::fopen(path.c_str(), create ? "w+b" : "r+b");
+    if (!f.fs && !create)
+    {
+        f.fs = std::fopen(path.c_str(), "rb");
+        f.readonly = true;
+    }
+    if (!f.fs)
+        return nullptr;
+    std::setvbuf(f.fs, nullptr, _IOFBF, file_bufsize);
+
+    std::fseek(f.fs, 0, SEEK_END);
+    long size = std::ftell(f.fs);
+    f.size = size < 0 ? 0 : (unsigned long)size;
+    f.pos = -1;
+    f.writing = false;
+
+    if (CPMFS.files.size() >= max_open)
+    {
+        // least recently used
+        auto lru = CPMFS.files.begin();
+        for (auto it = CPMFS.files.begin(); it != CPMFS.files.end(); ++it)
+            if (it->second.used < lru->second.used)
+                lru = it;
+        forget(lru->first);
+    }
+    cpm_file& ret = CPMFS.files[key] = f;
+    ret.used = ++CPMFS.tick;
+    CPMFS.last_key = key;
+    CPMFS.last = &ret;
+    return &ret;
+}
+
+// File of the FCB at addr, opened if not cached.
+// Returns nullptr if there is no such file.
+static cpm_file* get_file(i8080_addr_t addr)
+{
+    char name[11];
+    fcb_name(addr, name);
+    unsigned drive = fcb_drive(addr);
+
+    if (CPMFS.last && CPMFS.last_key[0] == char('A' + drive) &&
+        CPMFS.last_key.compare(1, 11, name, 11) == 0)
+    {
+        CPMFS.last->used = ++CPMFS.tick;
+        return CPMFS.last;
+    }
+    std::string key = file_key(drive, name);
+    auto it = CPMFS.files.find(key);
+    if (it != CPMFS.files.end())
+    {
+        CPMFS.last_key = key;
+        CPMFS.last = &it->second;
+        CPMFS.last->used = ++CPMFS.tick;
+        return CPMFS.last;
+    }
+
+    auto found = find_files(drive, name);
+    if (found.empty())
+        return nullptr;
+    return open_file(file_key(drive, found[0].first.c_str()), found[0].second, false);
+}
+
+static unsigned long file_records(const cpm_file* f)
+{
+    return (f->size + record_size - 1) / record_size;
+}
+
+// Sequential position of the FCB at addr, in records.
+static unsigned long seq_record(i8080_addr_t addr)
+{
+    return ((unsigned long)(fcb_byte(addr, FCB_S2) & 0x3f) * 32 +
+        (fcb_byte(addr, FCB_EX) & 0x1f)) * extent_records + fcb_byte(addr, FCB_CR);
+}
+
+// Move the FCB at addr to record rec, and set its record
+// count for the extent it is now in.
+static void set_seq_record(i8080_addr_t addr, const cpm_file* f, unsigned long rec)
+{
+    unsigned long extent = rec / extent_records;
+    fcb_byte(addr, FCB_CR) = i8080_word_t(rec % extent_records);
+    fcb_byte(addr, FCB_EX) = i8080_word_t(extent % 32);
+    fcb_byte(addr, FCB_S2) = i8080_word_t(extent / 32);
+
+    unsigned long first = extent * extent_records;
+    unsigned long nrecs = file_records(f);
+    unsigned long rc = nrecs > first ? nrecs - first : 0;
+    fcb_byte(addr, FCB_RC) = i8080_word_t(rc > extent_records ? extent_records : rc);
+}
+
+static unsigned long random_record(i8080_addr_t addr)
+{
+    return fcb_byte(addr, FCB_R0) | ((unsigned long)fcb_byte(addr, FCB_R0 + 1) << 8) |
+        ((unsigned long)fcb_byte(addr, FCB_R0 + 2) << 16);
+}
+
+static void set_random_record(i8080_addr_t addr, unsigned long rec)
+{
+    fcb_byte(addr, FCB_R0) = i8080_word_t(rec & 0xff);
+    fcb_byte(addr, FCB_R0 + 1) = i8080_word_t((rec >> 8) & 0xff);
+    fcb_byte(addr, FCB_R0 + 2) = i8080_word_t((rec >> 16) & 0xff);
+}
+
+static bool seek(cpm_file* f, unsigned long offset, bool writing)
+{
+    // switching between reading and writing needs a seek too
+    if (f->pos == long(offset) && f->writing == writing)
+        return true;
+    if (std::fseek(f->fs, long(offset), SEEK_SET) != 0)
+    {
+        f->pos = -1;
+        return false;
+    }
+    f->pos = long(offset);
+    f->writing = writing;
+    return true;
+}
+
+// VS C4127
+static constexpr bool word_t_is_byte(void)
+{
+    return sizeof(i8080_word_t) == 1;
+}
+
+// Can records go straight between the file and the DMA buffer?
+static bool dma_direct(void)
+{
+    return word_t_is_byte() && CPMFS.dma <= 0x10000u - record_size;
+}
+
+// Read record rec to the DMA buffer.
+// Returns 0, or 1 at the end of the file.
+static int read_record(cpm_file* f, unsigned long rec)
+{
+    unsigned long offset = rec * record_size;
+    if (offset >= f->size || !seek(f, offset, false))
+        return 1;
+
+    i8080_word_t buf[record_size];
+    i8080_word_t* dst = dma_direct() ? &CPMFS.mem[CPMFS.dma] : buf;
+    std::size_t n;
+    if (word_t_is_byte())
+        n = std::fread(dst, 1, record_size, f->fs);
+    else {
+        int c;
+        for (n = 0; n < record_size && (c = std::fgetc(f->fs)) != EOF; ++n)
+            dst[n] = i8080_word_t(c);
+    }
+    f->pos += long(n);
+    if (n == 0)
+        return 1;
+
+    // text files end at ^Z
+    for (std::size_t i = n; i < record_size; ++i)
+        dst[i] = 0x1a;
+    if (dst == buf)
+        for (unsigned i = 0; i < record_size; ++i)
+            CPMFS.mem[i8080_addr_t(CPMFS.dma + i)] = buf[i];
+    return 0;
+}
+
+// Write the DMA buffer to record rec.
+// Returns 0, or 2 if the disk (or file) is full or read-only.
+static int write_record(cpm_file* f, unsigned long rec)
+{
+    unsigned long offset = rec * record_size;
+    if (f->readonly || !seek(f, offset, true))
+        return 2;
+
+    i8080_word_t buf[record_size];
+    const i8080_word_t* src = &CPMFS.mem[CPMFS.dma];
+    if (!dma_direct())
+    {
+        for (unsigned i = 0; i < record_size; ++i)
+            buf[i] = CPMFS.mem[i8080_addr_t(CPMFS.dma + i)];
+        src = buf;
+    }
+    std::size_t n;
+    if (word_t_is_byte())
+        n = std::fwrite(src, 1, record_size, f->fs);
+    else
+        for (n = 0; n < record_size && std::fputc(src[n], f->fs) != EOF; ++n);
+    f->pos += long(n);
+    if (n != record_size)
+    {
+        emu_printerr("Could not write %s", f->path.c_str());
+        return 2;
+    }
+    if (offset + record_size > f->size)
+        f->size = offset + record_size;
+    return 0;
+}
+
+// Write a search result to the DMA buffer.
+static void put_entry(const cpm_entry& e)
+{
+    i8080_word_t* mem = CPMFS.mem;
+    i8080_addr_t at = CPMFS.dma;
+    for (unsigned i = 0; i < 32; ++i)
+        mem[i8080_addr_t(at + i)] = 0;
+    mem[at] = i8080_word_t(CPMFS.user);
+    for (unsigned i = 0; i < 11; ++i)
+        mem[i8080_addr_t(at + FCB_NAME + i)] = i8080_word_t(e.name[i]);
+    mem[i8080_addr_t(at + FCB_EX)] = i8080_word_t(e.extent % 32);
+    mem[i8080_addr_t(at + FCB_S2)] = i8080_word_t(e.extent / 32);
+    mem[i8080_addr_t(at + FCB_RC)] = i8080_word_t(e.rc);
+    // nonzero blocks, for programs that count them
+    for (unsigned i = 0; i < (e.rc + 7) / 8; ++i)
+        mem[i8080_addr_t(at + FCB_AL + i)] = i8080_word_t(i + 2);
+}
+
+static void search_first(i8080_addr_t addr)
+{
+    char pattern[11];
+    fcb_name(addr, pattern);
+    bool all_extents = fcb_byte(addr, FCB_EX) == '?';
+    unsigned want = fcb_byte(addr, FCB_EX) & 0x1f;
+
+    CPMFS.found.clear();
+    CPMFS.next_found = 0;
+    for (const auto& match : find_files(fcb_drive(addr), pattern))
+    {
+        std::FILE* fs = std::fopen(match.second.c_str(), "rb");
+        if (!fs) continue;
+        std::fseek(fs, 0, SEEK_END);
+        long size = std::ftell(fs);
+        std::fclose(fs);
+
+        unsigned long nrecs = size > 0 ? (unsigned long)(size + record_size - 1) / record_size : 0;
+        unsigned long nextents = nrecs ? (nrecs + extent_records - 1) / extent_records : 1;
+        for (unsigned long x = 0; x < nextents; ++x)
+        {
+            if (!all_extents && x != want)
+                continue;
+            cpm_entry e;
+            std::memcpy(e.name, match.first.data(), 11);
+            e.extent = unsigned(x);
+            unsigned long left = nrecs - x * extent_records;
+            e.rc = unsigned(left > extent_records ? extent_records : left);
+            CPMFS.found.push_back(e);
+        }
+    }
+}
+
+static int search_next(void)
+{
+    if (CPMFS.next_found >= CPMFS.found.size())
+        return 0xff;
+    put_entry(CPMFS.found[CPMFS.next_found++]);
+    return 0;
+}
+
+static int open_fcb(i8080_addr_t addr)
+{
+    cpm_file* f = get_file(addr);
+    if (!f) return 0xff;
+    fcb_byte(addr, FCB_S1) = 0;
+    set_seq_record(addr, f, seq_record(addr));
+    return 0;
+}
+
+static int make_fcb(i8080_addr_t addr)
+{
+    char name[11];
+    std::string host;
+    fcb_name(addr, name);
+    if (!to_host_name(name, host))
+        return 0xff;
+    unsigned drive = fcb_drive(addr);
+
+    // reuse the host name of a file being replaced
+    auto found = find_files(drive, name);
+    std::string path = found.empty() ?
+        drive_dir(drive) + "/" + host : found[0].second;
+    cpm_file* f = open_file(file_key(drive, name), path, true);
+    if (!f) return 0xff;
+    fcb_byte(addr, FCB_S1) = 0;
+    set_seq_record(addr, f, seq_record(addr));
+    return 0;
+}
+
+static int close_fcb(i8080_addr_t addr)
+{
+    char name[11];
+    fcb_name(addr, name);
+    unsigned drive = fcb_drive(addr);
+    std::string key = file_key(drive, name);
+    if (CPMFS.files.count(key) != 0)
+    {
+        auto& f = CPMFS.files[key];
+        bool ok = std::fflush(f.fs) == 0;
+        forget(key);
+        return ok ? 0 : 0xff;
+    }
+    return find_files(drive, name).empty() ? 0xff : 0;
+}
+
+static int delete_fcb(i8080_addr_t addr)
+{
+    char pattern[11];
+    fcb_name(addr, pattern);
+    unsigned drive = fcb_drive(addr);
+    int ret = 0xff;
+    for (const auto& match : find_files(drive, pattern))
+    {
+        forget(file_key(drive, match.first.c_str()));
+        if (std::remove(match.second.c_str()) == 0)
+            ret = 0;
+    }
+    return ret;
+}
+
+static int rename_fcb(i8080_addr_t addr)
+{
+    char from[11], to[11];
+    std::string host;
+    fcb_name(addr, from);
+    fcb_name(i8080_addr_t(addr + 16), to);
+    if (!to_host_name(to, host))
+        return 0xff;
+    unsigned drive = fcb_drive(addr);
+
+    auto found = find_files(drive, from);
+    if (found.empty())
+        return 0xff;
+    forget(file_key(drive, found[0].first.c_str()));
+    forget(file_key(drive, to));
+    std::string path = drive_dir(drive) + "/" + host;
+    return std::rename(found[0].second.c_str(), path.c_str()) == 0 ? 0 : 0xff;
+}
+
+static int read_seq(i8080_addr_t addr)
+{
+    cpm_file* f = get_file(addr);
+    if (!f) return 9; // invalid FCB
+    unsigned long rec = seq_record(addr);
+    int ret = read_record(f, rec);
+    if (ret == 0)
+        set_seq_record(addr, f, rec + 1);
+    return ret;
+}
+
+static int write_seq(i8080_addr_t addr)
+{
+    cpm_file* f = get_file(addr);
+    if (!f) return 9;
+    unsigned long rec = seq_record(addr);
+    int ret = write_record(f, rec);
+    if (ret == 0)
+        set_seq_record(addr, f, rec + 1);
+    return ret;
+}
+
+// Random read (33) or write (34, 40).
+static int random_access(i8080_addr_t addr, bool write)
+{
+    cpm_file* f = get_file(addr);
+    if (!f) return 9;
+    unsigned long rec = random_record(addr);
+    if (rec > 0xffff)
+        return 6; // past the end of the disk
+    int ret = write ? write_record(f, rec) : read_record(f, rec);
+    // the next sequential access is to the same record
+    set_seq_record(addr, f, rec);
+    return ret;
+}
+
+static int file_size(i8080_addr_t addr)
+{
+    cpm_file* f = get_file(addr);
+    if (!f) return 0xff;
+    set_random_record(addr, file_records(f));
+    return 0;
+}
+
+bool cpmfs_init(i8080_word_t* mem, const char* dir, i8080_addr_t tables)
+{
+    bool ok = cpmfs_end();
+    CPMFS.mem = mem;
+    CPMFS.dir = dir;
+    if (!dir_exists(CPMFS.dir)) {
+        emu_printerr("Could not open directory %s", dir);
+        return false;
+    }
+    CPMFS.dma = 0x80;
+    CPMFS.drive = 0;
+    CPMFS.user = 0;
+    CPMFS.found.clear();
+    CPMFS.next_found = 0;
+
+    CPMFS.dpb = tables;
+    for (unsigned i = 0; i < sizeof DPB; ++i)
+        mem[tables + i] = DPB[i];
+    for (unsigned i = 0; i < 32; ++i)
+        mem[tables + alloc_offset + i] = 0;
+    // the directory's blocks
+    mem[tables + alloc_offset] = 0xc0;
+    return ok;
+}
+
+// Parse a file name into the FCB at addr.
+static void parse_fcb(i8080_addr_t addr, const std::string& word)
+{
+    i8080_word_t* fcb = &CPMFS.mem[addr];
+    for (int i = 0; i < 16; ++i)
+        fcb[i] = i == 0 ? 0 : i <= 11 ? ' ' : 0;
+
+    std::size_t at = 0;
+    if (word.size() >= 2 && word[1] == ':')
+    {
+        fcb[FCB_DR] = i8080_word_t(word[0] - 'A' + 1);
+        at = 2;
+    }
+    // name, then extension
+    for (int part = 0; part < 2; ++part)
+    {
+        int start = part ? 9 : 1, len = part ? 3 : 8;
+        for (int i = 0; at < word.size() && word[at] != '.'; ++at)
+        {
+            if (word[at] == '*') {
+                for (; i < len; ++i) fcb[start + i] = '?';
+            }
+            else if (i < len)
+                fcb[start + i++] = i8080_word_t(word[at]);
+        }
+        if (at < word.size()) ++at; // dot
+    }
+}
+
+void cpmfs_cmdline(const char* tail)
+{
+    std::string upper;
+    for (const char* c = tail; *c; ++c)
+        upper += char(std::toupper(static_cast<unsigned char>(*c)));
+    // with its leading blank and terminator, up to 0xff
+    if (upper.size() > 125)
+        upper.resize(125);
+
+    i8080_word_t* mem = CPMFS.mem;
+    std::string buf = upper.empty() ? "" : " " + upper;
+    mem[0x80] = i8080_word_t(buf.size());
+    for (std::size_t i = 0; i < buf.size(); ++i)
+        mem[0x81 + i] = i8080_word_t(buf[i]);
+    mem[0x81 + buf.size()] = 0;
+
+    std::vector<std::string> words;
+    std::size_t at = 0;
+    while (words.size() < 2)
+    {
+        at = upper.find_first_not_of(' ', at);
+        if (at == std::string::npos) break;
+        auto end = upper.find(' ', at);
+        words.push_back(upper.substr(at, end - at));
+        at = end;
+    }
+    parse_fcb(0x5c, words.size() > 0 ? words[0] : "");
+    parse_fcb(0x6c, words.size() > 1 ? words[1] : "");
+    // current record of the first FCB, and its random record
+    for (unsigned i = 0x7c; i < 0x80; ++i)
+        mem[i] = 0;
+}
+
+// Return a byte in A and L, or a word in HL and BA.
+static void ret8(i8080* cpu, unsigned val)
+{
+    cpu->a = cpu->l = i8080_word_t(val & 0xff);
+    cpu->b = cpu->h = 0;
+}
+
+static void ret16(i8080* cpu, unsigned val)
+{
+    cpu->a = cpu->l = i8080_word_t(val & 0xff);
+    cpu->b = cpu->h = i8080_word_t(val >> 8);
+}
+
+bool cpmfs_call(i8080* cpu)
+{
+    i8080_addr_t de = wordconcat(cpu->d, cpu->e);
+    switch (cpu->c)
+    {
+    case 12: // version
+        ret16(cpu, 0x0022);
+        break;
+    case 13: // reset disks
+        CPMFS.dma = 0x80;
+        CPMFS.drive = 0;
+        ret8(cpu, 0);
+        break;
+    case 14: // select disk
+    {
+        unsigned drive = cpu->e & 0x0f;
+        bool ok = dir_exists(drive_dir(drive));
+        if (ok) CPMFS.drive = drive;
+        ret8(cpu, ok ? 0 : 0xff);
+        break;
+    }
+    case 15: ret8(cpu, open_fcb(de)); break;
+    case 16: ret8(cpu, close_fcb(de)); break;
+    case 17:
+        search_first(de);
+        ret8(cpu, search_next());
+        break;
+    case 18: ret8(cpu, search_next()); break;
+    case 19: ret8(cpu, delete_fcb(de)); break;
+    case 20: ret8(cpu, read_seq(de)); break;
+    case 21: ret8(cpu, write_seq(de)); break;
+    case 22: ret8(cpu, make_fcb(de)); break;
+    case 23: ret8(cpu, rename_fcb(de)); break;
+    case 24: // login vector
+    {
+        unsigned vec = 0;
+        for (unsigned d = 0; d < num_drives; ++d)
+            if (dir_exists(drive_dir(d)))
+                vec |= 1u << d;
+        ret16(cpu, vec);
+        break;
+    }
+    case 25: ret8(cpu, CPMFS.drive); break;
+    case 26: // set DMA
+        CPMFS.dma = de;
+        ret8(cpu, 0);
+        break;
+    case 27: ret16(cpu, CPMFS.dpb + alloc_offset); break;
+    case 28: // write protect disk
+    case 29: // read-only vector
+        ret16(cpu, 0);
+        break;
+    case 30: // set attributes
+        ret8(cpu, get_file(de) ? 0 : 0xff);
+        break;
+    case 31: ret16(cpu, CPMFS.dpb); break;
+    case 32: // user code
+        if (cpu->e == 0xff)
+            ret8(cpu, CPMFS.user);
+        else {
+            CPMFS.user = cpu->e & 0x0f;
+            ret8(cpu, 0);
+        }
+        break;
+    case 33: ret8(cpu, random_access(de, false)); break;
+    case 34:
+    case 40: // unwritten records read as zeroes on the host
+        ret8(cpu, random_access(de, true));
+        break;
+    case 35: ret8(cpu, file_size(de)); break;
+    case 36: // set random record
+        set_random_record(de, seq_record(de));
+        ret8(cpu, 0);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+bool cpmfs_end(void)
+{
+    bool ok = true;
+    for (auto& f : CPMFS.files)
+        ok = close_file(f.second) && ok;
+    CPMFS.files.clear();
+    CPMFS.last = nullptr;
+    return ok;
+}
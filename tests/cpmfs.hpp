@@ -0,0 +1,32 @@
+#ifndef CPMFS_HPP
+#define CPMFS_HPP
+
+#include "i8080/i8080.h"
+
+// CP/M 2.2 BDOS disk and file functions, on files in host
+// directories. Drive A: is the directory given to cpmfs_init(),
+// and drives B: to P: are its subdirectories b to p. Host files
+// match FCB names case-insensitively; files whose names are not
+// 8.3 are not seen. Open files are cached by name, so programs
+// need not close files they only read.
+
+// Set up for a program, with mem as the 8080's memory.
+// Writes the disk parameters programs may ask for, 48
+// bytes, at tables. Closes files left open by the last
+// program. Returns true on success.
+bool cpmfs_init(i8080_word_t* mem, const char* dir, i8080_addr_t tables);
+
+// Write the command tail to 0x80 and parse its first two
+// words into the default FCBs at 0x5c and 0x6c.
+void cpmfs_cmdline(const char* tail);
+
+// Do BDOS function cpu->c if it is a disk or file function,
+// and set its return registers.
+// Returns false if it is not one.
+bool cpmfs_call(i8080* cpu);
+
+// Close all files.
+// Returns true if all were written.
+bool cpmfs_end(void);
+
+#endif
@@ -6,11 +6,39 @@
 #include <climits>
 #include <string>
 #include <memory>
+#include <cstdint>
+#include <cerrno>
+
+#if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#include <unistd.h>
+#include <time.h>
+#endif
+#if defined(_POSIX_CLOCK_SELECTION) && _POSIX_CLOCK_SELECTION > 0 && \
+    defined(_POSIX_MONOTONIC_CLOCK) && _POSIX_MONOTONIC_CLOCK > 0
+#define EMU_USING_CLOCK_NANOSLEEP 1
+#else
+#include <chrono>
+#include <thread>
+#endif
 
 #include "i8080/i8080.h"
 #include "i8080/i8080_opcodes.h"
 
 #include "keyintr.hpp"
+#include "hle.hpp"
+#include "gdbstub.hpp"
+#include "symbols.hpp"
+#include "profile.hpp"
+#include "coverage.hpp"
+#include "sampler.hpp"
+#include "trace.hpp"
+#include "stats.hpp"
+#include "heatmap.hpp"
+#include "timeline.hpp"
+#include "probes.hpp"
+#include "cpmfs.hpp"
+#include "bios.hpp"
+#include "console.hpp"
 #include "emu.hpp"
 
 
@@ -18,6 +46,22 @@ static struct emu
 {
     i8080 cpu;
     std::unique_ptr<i8080_word_t[]> mem;
+    i8080_port ports[I8080_NUM_PORTS];
+    i8080_traps traps;
+    std::unique_ptr<i8080_hle_verify> hle_verify;
+    std::unique_ptr<i8080_debug> debug;
+    std::unique_ptr<i8080_coverage> coverage;
+    // The program as loaded, for coverage reports.
+    cfg_image image;
+#ifdef I8080_PROFILE
+    std::unique_ptr<i8080_profile> profile;
+#endif
+    symtab syms;
+    // Name of loaded program.
+    std::string progname;
+    // Emulated OS entry points, see emu_init().
+    i8080_addr_t bios;
+    i8080_addr_t bdos;
     bool quit;
     int err;
     emu_opts opts;
@@ -28,6 +72,8 @@ EMU;
 
 void emu_vprinterr(const char* format, std::va_list vlist) noexcept
 {
+    // the program's output so far comes first
+    console_flush();
     std::fputs("i8080emu: \033[1;31merror:\033[0m ", stderr);
     std::vfprintf(stderr, format, vlist);
     std::fputs("\n", stderr);
@@ -41,6 +87,14 @@ void emu_printerr(const char* format, ...) noexcept
     va_end(args);
 }
 
+// Stop running at the next instruction boundary.
+static void emu_quit(int err) noexcept
+{
+    EMU.quit = true;
+    EMU.err = err;
+    i8080_stop(&EMU.cpu);
+}
+
 static i8080_word_t intr_read(const i8080*) noexcept { return i8080_NOP; }
 
 static i8080_word_t mem_read(const i8080*, i8080_addr_t addr) noexcept
@@ -57,81 +111,242 @@ static void io_write(const i8080*, i8080_word_t port, i8080_word_t word) noexcep
 {
     emu_printerr("Unhandled I/O write to "
         "port %d w/ data: 0x%02x", port, word);
-    EMU.quit = true;
-    EMU.err = EMU_EHNDLR;
+    emu_quit(EMU_EHNDLR);
 }
 
 static i8080_word_t io_read(const i8080* cpu, i8080_word_t port) noexcept
 {
     emu_printerr("Unhandled I/O read from "
         "port %d, clobbered acc: 0x%02x", port, cpu->a);
-    EMU.quit = true;
-    EMU.err = EMU_EHNDLR;
+    emu_quit(EMU_EHNDLR);
+    return 0;
+}
+
+#ifdef EMU_USDT
+EMU_PROBE_SEMAPHORE(insn);
+EMU_PROBE_SEMAPHORE(interrupt);
+EMU_PROBE_SEMAPHORE(io_in_start);
+EMU_PROBE_SEMAPHORE(io_in_done);
+EMU_PROBE_SEMAPHORE(io_out_start);
+EMU_PROBE_SEMAPHORE(io_out_done);
+EMU_PROBE_SEMAPHORE(halt_enter);
+EMU_PROBE_SEMAPHORE(halt_exit);
+EMU_PROBE_SEMAPHORE(bdos);
+
+// All ports go through these, so the I/O probes see every
+// IN and OUT. The handlers they wrap, set up by emu_init().
+static i8080_port usdt_ports[I8080_NUM_PORTS];
+
+static i8080_word_t usdt_port_in(void*, const i8080* cpu, i8080_word_t port) noexcept
+{
+    EMU_PROBE2(io_in_start, port, cpu->cycles);
+    const i8080_port& p = usdt_ports[port];
+    i8080_word_t word = p.in ? p.in(p.ctx, cpu, port) : io_read(cpu, port);
+    EMU_PROBE3(io_in_done, port, word, cpu->cycles);
+    return word;
+}
+
+static void usdt_port_out(void*, const i8080* cpu, i8080_word_t port, i8080_word_t word) noexcept
+{
+    EMU_PROBE3(io_out_start, port, word, cpu->cycles);
+    const i8080_port& p = usdt_ports[port];
+    if (p.out)
+        p.out(p.ctx, cpu, port, word);
+    else
+        io_write(cpu, port, word);
+    EMU_PROBE2(io_out_done, port, cpu->cycles);
+}
+#endif
+
+// https://obsolescence.wixsite.com/obsolescence/cpm-internals  
+static constexpr auto cpm80_lowsize = 0x100u;
+static constexpr auto emu_memsize = 65536u;  // 64K
+using memsize_t = decltype(65536u);
+
+// Emulated OS entry points. Programs may jump to the
+// addresses at 0x0001 and 0x0006 instead of 0x0000 and
+// 0x0005, and 0x0006 also marks the top of the TPA.
+// The BIOS page has the jump table, then the disk
+// parameters for BDOS 27 and 31 at +0x40, then the
+// BIOS disk tables from +0x80 on. The BDOS is the
+// page below, unless booted.
+static constexpr i8080_addr_t cpm80_bios_top = 0xff00;
+static constexpr i8080_addr_t cpm80_bios_params = 0x40;
+static constexpr i8080_addr_t cpm80_bios_tables = 0x80;
+static constexpr i8080_addr_t cpm80_bdos_offset = 0x100 - 6;
+
+// A booted system's CCP and BDOS, from the system tracks
+// after the cold start loader. 0xfa00 is the BIOS of a
+// 64K system.
+static constexpr unsigned cpm80_system_size = 0x1600;
+static constexpr i8080_addr_t cpm80_boot_bios = 0xfa00;
+static constexpr i8080_addr_t cpm80_ccp_bdos = 0x806;
+
+static int cpm80_wboot(void*, i8080*) noexcept
+{
+    emu_quit(0);
     return 0;
 }
 
-static bool emu_cpm80_call(const i8080* cpu, i8080_addr_t addr) noexcept
+// Return a byte from the BDOS, in A and L.
+static void cpm80_ret8(i8080* cpu, i8080_word_t val) noexcept
 {
-    switch (addr)
-    {   
-    case 0x0000: // WBOOT
-        EMU.quit = true;
-        EMU.err = 0;
+    cpu->a = cpu->l = val;
+    cpu->b = cpu->h = 0;
+}
+
+static int cpm80_bdos_call(void*, i8080* cpu) noexcept
+{
+    int callno = (int)cpu->c;
+    timeline_bdos(callno);
+    EMU_PROBE3(bdos, callno, wordconcat(cpu->d, cpu->e), cpu->cycles);
+    switch (callno)
+    {
+    case 0: // system reset
+        emu_quit(0);
+        return 0;
+
+    case 1: // read char, echoed
+    {
+        int c = console_getc();
+        if (c < 0) {
+            emu_quit(0);
+            return 0;
+        }
+        console_putc(c);
+        cpm80_ret8(cpu, i8080_word_t(c));
         break;
-        
-    case 0x0005: // BDOS
-    {
-        int callno = (int)cpu->c;
-        switch (callno)
-        {          
-        case 2: // print char
-            std::putchar(cpu->e);
-            break;
-    
-        case 9: // print $-terminated string
+    }
+    case 2: // print char
+        console_putc(cpu->e);
+        break;
+
+    case 6: // direct console I/O
+        if (cpu->e == 0xff)
         {
-            i8080_word_t c;
-            i8080_addr_t ptr = wordconcat(cpu->d, cpu->e);
-            while ((c = EMU.mem[ptr++]) != '$')
-                std::putchar(c);
-            break;
+            // a char, or 0 if none
+            int c = console_ready(cpu->cycles) ? console_getc() : 0;
+            if (c < 0) {
+                emu_quit(0);
+                return 0;
+            }
+            cpm80_ret8(cpu, i8080_word_t(c));
         }
-        default:
-            emu_printerr("Unimplemented BDOS call %d", callno);
-            EMU.quit = true;
-            EMU.err = EMU_EBDOS;
-            break;
+        else console_putc(cpu->e);
+        break;
+
+    case 9: // print $-terminated string
+        console_puts(EMU.mem.get(), wordconcat(cpu->d, cpu->e), '$');
+        break;
+
+    case 10: // read line
+        if (!console_readline(EMU.mem.get(), wordconcat(cpu->d, cpu->e))) {
+            emu_quit(0);
+            return 0;
         }
         break;
-    }
-    case 0x0038:
-        emu_printerr("Program called debugger");
-        EMU.quit = true;
-        EMU.err = EMU_EDBGR;
+
+    case 11: // console status
+        cpm80_ret8(cpu, console_ready(cpu->cycles) ? 0xff : 0);
         break;
 
     default:
-        return false;
+        if (cpmfs_call(cpu))
+            break;
+        emu_printerr("Unimplemented BDOS call %d", callno);
+        emu_quit(EMU_EBDOS);
+        return 0;
     }
+    i8080_return(cpu);
+    return 0;
+}
 
-    return true;
+static void cpm80_jmp(i8080_addr_t at, i8080_addr_t to)
+{
+    EMU.mem[at] = i8080_JMP;
+    EMU.mem[at + 1] = i8080_word_t(to & 0xff);
+    EMU.mem[at + 2] = i8080_word_t(to >> 8);
 }
 
-static void cpm80_io_write(const i8080* cpu, i8080_word_t port, i8080_word_t word) noexcept
+// Load the CCP and BDOS and start the CCP, as a BIOS's
+// BOOT and WBOOT do.
+static void cpm80_boot(i8080* cpu, bool cold) noexcept
 {
-    // offset PC by size of OUT instruction
-    if (!emu_cpm80_call(cpu, cpu->pc - i8080_addr_t(2)))
-        io_write(cpu, port, word);
+    i8080_addr_t ccp = i8080_addr_t(EMU.bios - cpm80_system_size);
+    if (!bios_read_system(ccp, cpm80_system_size / 128))
+    {
+        emu_printerr("Could not boot from drive A:");
+        emu_quit(EMU_EFILE);
+        return;
+    }
+    cpm80_jmp(0x0000, EMU.bios + 3 * BIOS_WBOOT);
+    cpm80_jmp(0x0005, ccp + cpm80_ccp_bdos);
+    if (cold)
+    {
+        EMU.mem[0x0003] = 0;  // IOBYTE
+        EMU.mem[0x0004] = 0;  // drive A:, user 0
+    }
+    cpu->b = 0; cpu->c = 0x80;
+    bios_disk_call(BIOS_SETDMA, cpu);
+    cpu->c = EMU.mem[0x0004];
+    cpu->pc = ccp;
 }
 
-// https://obsolescence.wixsite.com/obsolescence/cpm-internals  
-static constexpr auto cpm80_lowsize = 0x100u;
-static constexpr auto emu_memsize = 65536u;  // 64K
-using memsize_t = decltype(65536u);
+static int cpm80_bios_call(void* ctx, i8080* cpu) noexcept
+{
+    int fn = static_cast<int>(reinterpret_cast<std::uintptr_t>(ctx));
+    switch (fn)
+    {
+    case BIOS_BOOT:
+    case BIOS_WBOOT:
+        if (EMU.opts.boot)
+            cpm80_boot(cpu, fn == BIOS_BOOT);
+        else
+            emu_quit(0);
+        return 0;
+
+    case BIOS_CONST:
+        cpu->a = console_ready(cpu->cycles) ? 0xff : 0;
+        break;
 
-// Injected at operating system call locations.
-static constexpr i8080_word_t emu_call[] = { i8080_OUT, 0xff, i8080_RET };
+    case BIOS_CONIN:
+    {
+        int c = console_getc();
+        if (c < 0) {
+            emu_quit(0);
+            return 0;
+        }
+        cpu->a = i8080_word_t(c & 0x7f);
+        break;
+    }
+    case BIOS_CONOUT:
+        console_putc(cpu->c);
+        break;
 
+    case BIOS_LIST:
+    case BIOS_PUNCH:
+        break;
+    case BIOS_READER:
+        cpu->a = 0x1a;  // EOF
+        break;
+    case BIOS_LISTST:
+        cpu->a = 0xff;
+        break;
+
+    default:
+        bios_disk_call(fn, cpu);
+        break;
+    }
+    i8080_return(cpu);
+    return 0;
+}
+
+static int cpm80_debugger(void*, i8080*) noexcept
+{
+    emu_printerr("Program called debugger");
+    emu_quit(EMU_EDBGR);
+    return 0;
+}
 
 int emu_init(emu_opts opts)
 {
@@ -141,22 +356,186 @@ int emu_init(emu_opts opts)
         EMU.cpu.mem_read = mem_read;
         EMU.cpu.mem_write = mem_write;
         EMU.cpu.io_read = io_read;
+        EMU.cpu.io_write = io_write;
         EMU.cpu.intr_read = intr_read;
+        EMU.cpu.ports = EMU.ports;
     }
+    // unregistered ports fall back to io_read/io_write
+    for (auto& port : EMU.ports)
+        port = i8080_port();
 
     if (opts.use_cpm_con)
     {
         // CP/M reserved RST 7 for debuggers like DDT!
         // can intercept this to detect if the CPU is executing garbage memory
         std::memset(EMU.mem.get(), i8080_RST_7, emu_memsize * sizeof(i8080_word_t));
-        std::memcpy(&EMU.mem[0x0038], emu_call, sizeof(emu_call));
 
-        std::memcpy(&EMU.mem[0x0000], emu_call, sizeof(emu_call)); // WBOOT
-        std::memcpy(&EMU.mem[0x0005], emu_call, sizeof(emu_call)); // BDOS
+        if (!bios_end())
+            return EMU_EFILE;
+        for (const auto& d : opts.disks)
+        {
+            if (!bios_attach(d.drive, d.path.c_str(), d.format.c_str()))
+                return EMU_EFILE;
+        }
+        // the disk tables must fit above the BIOS
+        unsigned tables = bios_tables_size();
+        EMU.bios = opts.bios ? opts.bios : opts.boot ? cpm80_boot_bios :
+            i8080_addr_t((cpm80_bios_top + cpm80_bios_tables - tables) & 0xff00);
+        if (EMU.bios + cpm80_bios_tables + tables > emu_memsize ||
+            EMU.bios < cpm80_lowsize + 0x100 + (opts.boot ? cpm80_system_size : 0))
+        {
+            emu_printerr("The BIOS does not fit at 0x%04x", unsigned(EMU.bios));
+            return EMU_EFILE;
+        }
+        if (opts.boot && opts.disks.empty())
+        {
+            emu_printerr("Booting needs a disk image for drive A:");
+            return EMU_EFILE;
+        }
+        EMU.bdos = i8080_addr_t(EMU.bios - cpm80_bdos_offset);
+
+        // trap both the vectors and their targets, so calls
+        // through the vectors cost no extra JMP. A booted
+        // system has its own BDOS and only needs the BIOS.
+        i8080_traps_init(&EMU.traps);
+        if (!opts.boot)
+        {
+            cpm80_jmp(0x0000, EMU.bios + 3 * BIOS_WBOOT);
+            cpm80_jmp(0x0005, EMU.bdos);
+            i8080_trap_set(&EMU.traps, 0x0005, cpm80_bdos_call, nullptr);
+            i8080_trap_set(&EMU.traps, EMU.bdos, cpm80_bdos_call, nullptr);
+            i8080_trap_set(&EMU.traps, 0x0000, cpm80_wboot, nullptr);
+            i8080_trap_set(&EMU.traps, 0x0038, cpm80_debugger, nullptr);
+        }
+        for (int fn = 0; fn < BIOS_NUM_FNS; ++fn)
+        {
+            i8080_addr_t entry = i8080_addr_t(EMU.bios + 3 * fn);
+            cpm80_jmp(entry, entry);
+            i8080_trap_set(&EMU.traps, entry, cpm80_bios_call,
+                reinterpret_cast<void*>(std::uintptr_t(fn)));
+        }
+        bios_init(EMU.mem.get(), i8080_addr_t(EMU.bios + cpm80_bios_tables));
+
+        if (!cpmfs_init(EMU.mem.get(), opts.cpm_dir.empty() ? "." : opts.cpm_dir.c_str(),
+            i8080_addr_t(EMU.bios + cpm80_bios_params)))
+            return EMU_EFILE;
+        cpmfs_cmdline(opts.cmdline.c_str());
+        if (opts.boot)
+            EMU.progname = "CP/M";
+        if (!console_init(opts.stdin_file.empty() ? nullptr : opts.stdin_file.c_str()))
+            return EMU_EFILE;
+    }
+    else if (opts.boot)
+    {
+        emu_printerr("Booting needs the CP/M console");
+        return EMU_EFILE;
+    }
+    else i8080_traps_init(&EMU.traps);
+
+    for (const auto& h : opts.hle)
+    {
+        const hle_routine* r = hle_find(h.routine.c_str());
+        if (!r) {
+            emu_printerr("Unknown HLE routine %s", h.routine.c_str());
+            return EMU_EHLE;
+        }
+        if (i8080_hle_set(&EMU.traps, h.addr, r->fn, nullptr, 
+            h.cycles ? h.cycles : r->cycles))
+        {
+            emu_printerr("Too many traps (max %d)", I8080_MAX_TRAPS);
+            return EMU_EHLE;
+        }
+    }
+    if (opts.hle_verify && !opts.hle.empty())
+    {
+        if (!EMU.hle_verify)
+            EMU.hle_verify.reset(new i8080_hle_verify);
+        i8080_hle_verify_init(EMU.hle_verify.get());
+        EMU.traps.verify = EMU.hle_verify.get();
+    }
+    if (!opts.breaks.empty() || !opts.watches.empty() || !opts.gdb.empty())
+    {
+        if (!EMU.debug)
+            EMU.debug.reset(new i8080_debug);
+        i8080_debug_init(EMU.debug.get());
+        for (auto addr : opts.breaks)
+            i8080_break_set(EMU.debug.get(), addr);
+        for (const auto& w : opts.watches)
+            i8080_watch_set(EMU.debug.get(), w.addr, w.flags);
+        EMU.cpu.debug = EMU.debug.get();
+    }
+    else EMU.cpu.debug = nullptr;
+
+    EMU.syms.syms.clear();
+    if (!opts.symbols_file.empty() && !symtab_load(EMU.syms, opts.symbols_file.c_str()))
+        return EMU_ESYMBOLS;
+
+    if (!opts.coverage_file.empty() || !opts.coverage_lcov.empty())
+    {
+        if (!EMU.coverage)
+            EMU.coverage.reset(new i8080_coverage);
+        i8080_coverage_init(EMU.coverage.get());
+        EMU.cpu.coverage = EMU.coverage.get();
+    }
+    else EMU.cpu.coverage = nullptr;
+
+    bool profiling = !opts.profile_file.empty() || !opts.profile_stacks.empty();
+#ifdef I8080_PROFILE
+    if (profiling)
+    {
+        if (!EMU.profile)
+            EMU.profile.reset(new i8080_profile);
+        i8080_profile_init(EMU.profile.get());
+        EMU.cpu.profile = EMU.profile.get();
+    }
+    else EMU.cpu.profile = nullptr;
+#else
+    if (profiling)
+    {
+        emu_printerr("Profiling needs a build with LIBI8080_PROFILE");
+        return EMU_EPROFILE;
+    }
+#endif
+
+#ifdef I8080_TRACE
+    EMU.cpu.trace = nullptr;
+#else
+    if (!opts.trace_file.empty())
+    {
+        emu_printerr("Tracing needs a build with LIBI8080_TRACE");
+        return EMU_ETRACE;
+    }
+#endif
+
+#ifndef I8080_STATS
+    if (!opts.stats_file.empty())
+    {
+        emu_printerr("Statistics need a build with LIBI8080_STATS");
+        return EMU_ESTATS;
+    }
+#endif
+
+#ifdef I8080_HEATMAP
+    EMU.cpu.heatmap = nullptr;
+#else
+    if (!opts.heatmap_file.empty() || !opts.heatmap_pgm.empty())
+    {
+        emu_printerr("Heatmaps need a build with LIBI8080_HEATMAP");
+        return EMU_EHEATMAP;
+    }
+#endif
 
-        EMU.cpu.io_write = cpm80_io_write;
+#ifdef EMU_USDT
+    for (unsigned port = 0; port < I8080_NUM_PORTS; ++port)
+    {
+        usdt_ports[port] = EMU.ports[port];
+        EMU.ports[port].in = usdt_port_in;
+        EMU.ports[port].out = usdt_port_out;
     }
-    else EMU.cpu.io_write = io_write;
+#endif
+
+    // no lookups at all if nothing is trapped
+    EMU.cpu.traps = (opts.use_cpm_con || !opts.hle.empty()) ? &EMU.traps : nullptr;
 
     EMU.quit = false;
     EMU.err = 0;
@@ -167,6 +546,12 @@ int emu_init(emu_opts opts)
 void emu_destroy(void)
 {
     EMU.mem.reset();
+    EMU.hle_verify.reset();
+    EMU.debug.reset();
+    EMU.coverage.reset();
+#ifdef I8080_PROFILE
+    EMU.profile.reset();
+#endif
 }
 
 // VS C4127
@@ -177,6 +562,13 @@ static constexpr bool word_t_is_byte(void)
 
 int emu_load(const char* filepath)
 {
+    const char* name = std::strrchr(filepath, '/');
+#ifdef _WIN32
+    const char* wname = std::strrchr(filepath, '\\');
+    if (wname && (!name || wname > name)) name = wname;
+#endif
+    EMU.progname = name ? name + 1 : filepath;
+
     std::FILE* fs = std::fopen(filepath, "rb");
     if (!fs) {
         emu_printerr("Could not open %s", filepath);
@@ -219,6 +611,10 @@ int emu_load(const char* filepath)
     }
     std::fclose(fs);
 
+    if (EMU.cpu.coverage &&
+        !cfg_image_load(EMU.image, filepath, EMU.opts.use_cpm_con ? cpm80_lowsize : 0))
+        return EMU_EFILE;
+
     return 0;
 }
 
@@ -263,8 +659,19 @@ static const char* emu_errname(int err) noexcept
     {
     case EMU_EKEYINTR: return "EMU_EKEYINTR";
     case EMU_EFILE: return "EMU_EFILE";
+    case EMU_EPROFILE: return "EMU_EPROFILE";
+    case EMU_ESYMBOLS: return "EMU_ESYMBOLS";
+    case EMU_ETRACE: return "EMU_ETRACE";
+    case EMU_ECOVERAGE: return "EMU_ECOVERAGE";
+    case EMU_ESTATS: return "EMU_ESTATS";
+    case EMU_EHEATMAP: return "EMU_EHEATMAP";
+    case EMU_ETIMELINE: return "EMU_ETIMELINE";
+    case EMU_EGDB: return "EMU_EGDB";
     case EMU_EHNDLR: return "EMU_EHNDLR";
     case EMU_EOPCODE: return "EMU_EOPCODE";
+    case EMU_EHLE: return "EMU_EHLE";
+    case EMU_EBREAK: return "EMU_EBREAK";
+    case EMU_EWATCH: return "EMU_EWATCH";
     case EMU_EBDOS: return "EMU_EBDOS";
     case EMU_EDBGR: return "EMU_EDBGR";
     default: return "Unknown error";
@@ -303,55 +710,424 @@ void emu_errexit(int err)
     std::exit(EXIT_FAILURE);
 }
 
-static int emu_do_run_with_intr(void)
+#if defined(EMU_USING_CLOCK_NANOSLEEP)
+static std::uint64_t emu_clock_ns(void) noexcept
+{
+    ::timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return std::uint64_t(ts.tv_sec) * 1000000000u + std::uint64_t(ts.tv_nsec);
+}
+
+static void emu_sleep_until_ns(std::uint64_t deadline) noexcept
 {
-    if (!keyintr_initlzd && !keyintr_init())
-        return EMU_EKEYINTR;
+    ::timespec ts;
+    ts.tv_sec = ::time_t(deadline / 1000000000u);
+    ts.tv_nsec = long(deadline % 1000000000u);
+    while (::clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+#else
+static std::uint64_t emu_clock_ns(void) noexcept
+{
+    using namespace std::chrono;
+    return std::uint64_t(duration_cast<nanoseconds>(
+        steady_clock::now().time_since_epoch()).count());
+}
+
+static void emu_sleep_until_ns(std::uint64_t deadline) noexcept
+{
+    using namespace std::chrono;
+    std::this_thread::sleep_until(steady_clock::time_point(
+        duration_cast<steady_clock::duration>(nanoseconds(deadline))));
+}
+#endif
+
+// Clock rate that cycles stand for: the throttled
+// rate, or an authentic 8080's.
+static double emu_cycle_mhz(void) noexcept
+{
+    return EMU.opts.clock_mhz > 0 ? EMU.opts.clock_mhz : 2.0;
+}
+
+// Wait for an interrupt while the CPU is halted. A halted
+// 8080 is still clocked, so the time waited is added to
+// the cycle count at emu_cycle_mhz().
+static bool emu_halt_wait(void)
+{
+    EMU_PROBE2(halt_enter, EMU.cpu.pc, EMU.cpu.cycles);
+    auto start = emu_clock_ns();
+    i8080_cycles_t start_cycles = EMU.cpu.cycles;
+    if (EMU.opts.conv_key_intr && !i8080_interrupt_pending(&EMU.cpu))
+    {
+        if (!keyintr_wait())
+            return false;
+    }
+    EMU.cpu.cycles += i8080_cycles_t(double(emu_clock_ns() - start) * emu_cycle_mhz() / 1000.0);
+    timeline_halt(start_cycles);
+    if (i8080_interrupt_pending(&EMU.cpu))
+        EMU_PROBE2(halt_exit, EMU.cpu.pc, EMU.cpu.cycles);
+    return true;
+}
 
-    if (!keyintr_start())
-        return EMU_EKEYINTR;
+#ifdef EMU_USDT
+// Cycles to run between checks for probes being attached.
+static constexpr i8080_cycles_t usdt_poll_cycles = 1000000;
+
+// i8080_run(), but one instruction at a time so each can be probed.
+static int emu_run_probed(i8080_cycles_t ncycles)
+{
+    i8080_cycles_t end = EMU.cpu.cycles + ncycles;
+    if (end < EMU.cpu.cycles)
+        end = i8080_cycles_t(-1);
+
+    do {
+        // an interrupt was accepted at the end of the last step
+        if (EMU.cpu.int_ff)
+            EMU_PROBE2(interrupt, EMU.cpu.pc, EMU.cpu.cycles);
+        else if (!EMU.cpu.halt)
+            EMU_PROBE3(insn, EMU.cpu.pc, EMU.mem[EMU.cpu.pc], EMU.cpu.cycles);
+        int err = i8080_step(&EMU.cpu);
+        if (err) return err;
+        if (EMU.cpu.halt) break;
+    } while (EMU.cpu.cycles < end);
+    return 0;
+}
+#endif
+
+// Run the CPU for ncycles, or until it halts.
+static int emu_exec(i8080_cycles_t ncycles)
+{
+#ifdef EMU_USDT
+    // returns often enough to notice tracers attaching
+    if (ncycles > usdt_poll_cycles)
+        ncycles = usdt_poll_cycles;
+    if (EMU_PROBE_ENABLED(insn) || EMU_PROBE_ENABLED(interrupt))
+        return emu_run_probed(ncycles);
+#endif
+    return i8080_run(&EMU.cpu, ncycles);
+}
+
+static int emu_do_run(void)
+{
+    // stop for heatmap snapshots
+    i8080_cycles_t ncycles = EMU.opts.heatmap_every ?
+        EMU.opts.heatmap_every : i8080_cycles_t(-1);
 
     int i80err = 0;
     while (!EMU.quit)
     {
-        i80err = i8080_step(&EMU.cpu);
+        i80err = emu_exec(ncycles);
         if (i80err) break;
+#ifdef I8080_HEATMAP
+        if (!heatmap_tick())
+            return EMU_EHEATMAP;
+#endif
+
+        if (EMU.cpu.halt && !emu_halt_wait())
+            return EMU_EKEYINTR;
+    }
+    return EMU.quit ? EMU.err : i80err;
+}
+
+// Run in slices of opts.slice_cycles, sleeping after each slice
+// until the wall-clock time at which a real 8080 at opts.clock_mhz
+// would have finished it. Deadlines are absolute from the start
+// of the run, so oversleeping in one slice is made up in the next.
+static int emu_do_run_throttled(void)
+{
+    const double ns_per_cycle = 1000.0 / EMU.opts.clock_mhz;
+
+    // time spent halted is not throttled
+    i8080_cycles_t epoch_cycles = EMU.cpu.cycles;
+    std::uint64_t epoch = emu_clock_ns();
+    std::uint64_t halted_ns = 0;
+    i8080_cycles_t halted_cycles = 0;
+    const std::uint64_t start = epoch;
+    const i8080_cycles_t start_cycles = epoch_cycles;
+
+    std::uint64_t max_overshoot = 0;
+    int i80err = 0;
+    while (!EMU.quit)
+    {
+        i80err = emu_exec(EMU.opts.slice_cycles);
+
+        // the last slice is throttled too
+        auto deadline = epoch + std::uint64_t(
+            double(EMU.cpu.cycles - epoch_cycles) * ns_per_cycle);
+        if (emu_clock_ns() < deadline)
+        {
+            emu_sleep_until_ns(deadline);
+            auto overshoot = emu_clock_ns() - deadline;
+            if (overshoot > max_overshoot)
+                max_overshoot = overshoot;
+        }
+        if (i80err) break;
+#ifdef I8080_HEATMAP
+        if (!heatmap_tick())
+            return EMU_EHEATMAP;
+#endif
 
         if (EMU.cpu.halt)
         {
-            if (!keyintr_wait())
-            {
-                keyintr_end();
+            auto halt_start = emu_clock_ns();
+            auto halt_start_cycles = EMU.cpu.cycles;
+            if (!emu_halt_wait())
                 return EMU_EKEYINTR;
-            }
-            i8080_interrupt(&EMU.cpu);
+
+            epoch = emu_clock_ns();
+            epoch_cycles = EMU.cpu.cycles;
+            halted_ns += epoch - halt_start;
+            halted_cycles += epoch_cycles - halt_start_cycles;
         }
     }
-    keyintr_end();
+
+    auto elapsed = emu_clock_ns() - start - halted_ns;
+    if (elapsed > 0)
+    {
+        double achieved_mhz = double(EMU.cpu.cycles - start_cycles - halted_cycles) *
+            1000.0 / double(elapsed);
+        std::fprintf(stderr, "i8080emu: clock: target %.3f MHz, achieved %.3f MHz, "
+            "max slice overshoot %.1f us\n", EMU.opts.clock_mhz, achieved_mhz,
+            double(max_overshoot) / 1000.0);
+    }
     return EMU.quit ? EMU.err : i80err;
 }
 
-static int emu_do_run(void)
+// Run under GDB. The CPU runs at full speed between stops,
+// checking for a break from the client every gdb_poll_cycles.
+static int emu_do_run_gdb(void)
 {
+    if (!gdb_start(EMU.opts.gdb.c_str(), &EMU.cpu))
+        return EMU_EGDB;
+
+    // client attaches to a stopped program
+    gdb_resume action = gdb_attach();
     int i80err = 0;
     while (!EMU.quit)
     {
-        i80err = i8080_step(&EMU.cpu);
-        if (i80err) break;
+        if (action == GDB_DETACH || action == GDB_KILL)
+            break;
+
+        gdb_reason reason = GDB_FAULT;
+        if (action == GDB_STEP)
+        {
+            i80err = i8080_step(&EMU.cpu);
+            // step off a breakpoint the client left in place
+            if (i80err == i8080_EBREAK)
+                i80err = i8080_step(&EMU.cpu);
+            reason = GDB_STEPPED;
+        }
+        else {
+            i80err = i8080_run(&EMU.cpu, EMU.opts.gdb_poll_cycles);
+            if (!i80err)
+            {
+                bool brk = EMU.cpu.halt ? gdb_wait(10) : gdb_poll();
+                if (!brk) continue;
+                reason = GDB_INTERRUPTED;
+            }
+        }
+        if (EMU.quit) break;
+
+        if (i80err == i8080_EBREAK) reason = GDB_BREAK;
+        else if (i80err == i8080_EWATCH) reason = GDB_WATCH;
+        else if (i80err) reason = GDB_FAULT;
+        i80err = 0;
+        action = gdb_stop(reason);
     }
-    return EMU.quit ? EMU.err : i80err;
+
+    if (EMU.quit)
+        gdb_exit(EMU.err);
+    gdb_end();
+
+    if (action == GDB_DETACH && !EMU.quit)
+    {
+        // breakpoints were removed by the client
+        EMU.cpu.debug = nullptr;
+        return emu_do_run();
+    }
+    return EMU.quit ? EMU.err : 0;
 }
 
 int emu_run(void)
 {
     i8080_reset(&EMU.cpu);
 
-    // start at load location
+    // start at load location, or cold boot
     if (EMU.opts.use_cpm_con)
-        EMU.cpu.pc = cpm80_lowsize;
+        EMU.cpu.pc = EMU.opts.boot ? EMU.bios : cpm80_lowsize;
 
     if (EMU.opts.conv_key_intr)
-        return emu_do_run_with_intr();
+    {
+        if (!keyintr_initlzd && !keyintr_init())
+            return EMU_EKEYINTR;
+        // interrupts are posted as they arrive, even while running
+        if (!keyintr_start(&EMU.cpu, i8080_NOP))
+            return EMU_EKEYINTR;
+    }
+
+    bool sampling = !EMU.opts.sample_file.empty();
+    if (sampling && !sampler_start(&EMU.cpu, EMU.mem.get(), EMU.opts.sample_hz))
+    {
+        if (EMU.opts.conv_key_intr)
+            keyintr_end();
+        return EMU_EPROFILE;
+    }
+
+#ifdef I8080_TRACE
+    bool tracing = !EMU.opts.trace_file.empty();
+    if (tracing)
+    {
+        const char* path = EMU.opts.trace_file.c_str();
+        bool ok = EMU.opts.trace_last != 0 ?
+            trace_start_last(&EMU.cpu, path, EMU.opts.trace_last) :
+            trace_start(&EMU.cpu, path);
+        if (!ok)
+        {
+            if (sampling)
+                sampler_stop();
+            if (EMU.opts.conv_key_intr)
+                keyintr_end();
+            return EMU_ETRACE;
+        }
+    }
+#endif
+
+#ifdef I8080_HEATMAP
+    bool heatmapping = !EMU.opts.heatmap_file.empty() || !EMU.opts.heatmap_pgm.empty();
+    if (heatmapping && !heatmap_start(&EMU.cpu,
+        EMU.opts.heatmap_file.empty() ? nullptr : EMU.opts.heatmap_file.c_str(),
+        EMU.opts.heatmap_pgm.empty() ? nullptr : EMU.opts.heatmap_pgm.c_str(),
+        EMU.opts.heatmap_every))
+    {
+#ifdef I8080_TRACE
+        if (tracing)
+            trace_stop();
+#endif
+        if (sampling)
+            sampler_stop();
+        if (EMU.opts.conv_key_intr)
+            keyintr_end();
+        return EMU_EHEATMAP;
+    }
+#endif
+
+    bool timelining = !EMU.opts.timeline_file.empty();
+    if (timelining && !timeline_start(&EMU.cpu, EMU.opts.timeline_file.c_str(),
+        emu_cycle_mhz(), EMU.progname.c_str()))
+    {
+#ifdef I8080_HEATMAP
+        if (heatmapping)
+            heatmap_end();
+#endif
+#ifdef I8080_TRACE
+        if (tracing)
+            trace_stop();
+#endif
+        if (sampling)
+            sampler_stop();
+        if (EMU.opts.conv_key_intr)
+            keyintr_end();
+        return EMU_ETIMELINE;
+    }
+
+    int err;
+    if (!EMU.opts.gdb.empty())
+        err = emu_do_run_gdb();
+    else if (EMU.opts.clock_mhz > 0)
+        err = emu_do_run_throttled();
     else
-        return emu_do_run();
+        err = emu_do_run();
+
+    if (EMU.opts.use_cpm_con)
+        console_end();
+    if (EMU.opts.conv_key_intr)
+        keyintr_end();
+
+    if (EMU.opts.use_cpm_con && !cpmfs_end() && !err)
+        err = EMU_EFILE;
+    if (EMU.opts.use_cpm_con && !bios_end() && !err)
+        err = EMU_EFILE;
+
+    // also useful if the program failed
+    if (timelining && !timeline_end() && !err)
+        err = EMU_ETIMELINE;
+
+#ifdef I8080_TRACE
+    // also useful if the program failed
+    if (tracing && !trace_stop() && !err)
+        err = EMU_ETRACE;
+#endif
+
+#ifdef I8080_HEATMAP
+    // also useful if the program failed
+    if (heatmapping && !heatmap_end() && !err)
+        err = EMU_EHEATMAP;
+#endif
+
+    if (sampling)
+    {
+        sampler_stop();
+        if (!sampler_write(EMU.opts.sample_file.c_str(), EMU.syms) && !err)
+            err = EMU_EPROFILE;
+    }
+
+    // also useful if the program failed
+    if (EMU.cpu.coverage)
+    {
+        cfg g;
+        g.image = EMU.image;
+        coverage_graph(g, EMU.cpu.coverage, cfg_entries(g.image));
+
+        bool ok = true;
+        const char* name = EMU.progname.c_str();
+        if (!EMU.opts.coverage_file.empty())
+            ok = coverage_write(EMU.opts.coverage_file.c_str(), EMU.cpu.coverage,
+                g, EMU.syms, name) && ok;
+        if (!EMU.opts.coverage_lcov.empty())
+            ok = coverage_write_lcov(EMU.opts.coverage_lcov.c_str(), EMU.cpu.coverage,
+                g, EMU.syms, name) && ok;
+        if (!ok && !err)
+            err = EMU_ECOVERAGE;
+    }
+
+#ifdef I8080_STATS
+    if (!EMU.opts.stats_file.empty() &&
+        !stats_write(EMU.opts.stats_file.c_str(), &EMU.cpu, EMU.progname.c_str()) && !err)
+        err = EMU_ESTATS;
+#endif
+
+#ifdef I8080_PROFILE
+    // also useful if the program failed
+    if (EMU.cpu.profile)
+    {
+        bool ok = true;
+        if (!EMU.opts.profile_file.empty())
+            ok = profile_write(EMU.opts.profile_file.c_str(), &EMU.cpu) && ok;
+        if (!EMU.opts.profile_stacks.empty())
+            ok = profile_write_stacks(EMU.opts.profile_stacks.c_str(), &EMU.cpu,
+                EMU.syms, EMU.progname.c_str()) && ok;
+        if (!ok && !err)
+            err = EMU_EPROFILE;
+    }
+#endif
+
+    if (err == EMU_EHLE && EMU.cpu.traps->verify)
+    {
+        const i8080_hle_verify* v = EMU.cpu.traps->verify;
+        if (std::strcmp(v->mismatch, "memory") == 0)
+            emu_printerr("HLE routine at 0x%04x differs from 8080 code: memory at 0x%04x",
+                v->routine, v->mismatch_addr);
+        else
+            emu_printerr("HLE routine at 0x%04x differs from 8080 code: %s",
+                v->routine, v->mismatch);
+    }
+    else if (err == EMU_EBREAK)
+        emu_printerr("Breakpoint at 0x%04x", EMU.debug->hit_addr);
+    else if (err == EMU_EWATCH)
+    {
+        const i8080_debug* d = EMU.debug.get();
+        emu_printerr("Watchpoint: instruction at 0x%04x %s 0x%02x %s 0x%04x",
+            d->hit_pc, d->hit_kind == I8080_WATCH_READ ? "read" : "wrote", d->hit_word, 
+            d->hit_kind == I8080_WATCH_READ ? "from" : "to", d->hit_addr);
+    }
+    return err;
 }
\ No newline at end of file
@@ -3,24 +3,148 @@
 #define EMU_HPP
 
 #include <cstdarg>
+#include <string>
+#include <vector>
 #include "i8080/i8080.h"
 
+// A subroutine to replace with a native routine.
+struct emu_hle
+{
+    i8080_addr_t addr;
+    // Name of routine, see hle.hpp.
+    std::string routine;
+    // Cycles charged per call. 0 uses
+    // the routine's default.
+    unsigned long cycles;
+};
+
+// A watchpoint.
+struct emu_watch
+{
+    i8080_addr_t addr;
+    // I8080_WATCH_READ and/or I8080_WATCH_WRITE.
+    int flags;
+};
+
+// A disk image for the BIOS.
+struct emu_disk
+{
+    // 0 for A:.
+    unsigned drive;
+    std::string path;
+    // "3740", "raw", or empty to go by size.
+    std::string format;
+};
+
 struct emu_opts
 {
     // Convert keyboard interrupts into 8080 interrupts.
     bool conv_key_intr;
     // Emulate CP/M-80 console.
     bool use_cpm_con;
+    // Host directory of drive A:. Empty for the
+    // current directory.
+    std::string cpm_dir;
+    // Command tail of the program.
+    std::string cmdline;
+    // Read console input from this file. Empty
+    // for stdin.
+    std::string stdin_file;
+    // Disk images for the BIOS.
+    std::vector<emu_disk> disks;
+    // Boot CP/M from drive A: instead of
+    // running a program.
+    bool boot;
+    // Address of the BIOS. 0 puts it at the top of
+    // memory, or at 0xfa00 (a 64K system) if booting.
+    i8080_addr_t bios;
+    // Throttle to this clock rate. 0 runs flat out.
+    double clock_mhz;
+    // Cycles to run between throttling sleeps.
+    unsigned long slice_cycles;
+    // Subroutines to run natively.
+    std::vector<emu_hle> hle;
+    // Check native subroutines against
+    // the interpreter.
+    bool hle_verify;
+    // Stop before executing these addresses.
+    std::vector<i8080_addr_t> breaks;
+    // Stop after these addresses are accessed.
+    std::vector<emu_watch> watches;
+    // Serve GDB on this TCP port or Unix
+    // socket path. Empty if not debugging.
+    std::string gdb;
+    // Cycles to run between checks for a
+    // break from GDB.
+    unsigned long gdb_poll_cycles;
+    // Write an execution profile here. Empty if not
+    // profiling. Needs a build with LIBI8080_PROFILE.
+    std::string profile_file;
+    // Write the profile's call paths here as
+    // folded stacks. Empty if not wanted.
+    std::string profile_stacks;
+    // Write a sampled profile here. Empty if
+    // not sampling.
+    std::string sample_file;
+    // Samples per second of CPU time.
+    unsigned sample_hz;
+    // Symbols of the program. Optional.
+    std::string symbols_file;
+    // Write a coverage report here. Empty if not wanted.
+    std::string coverage_file;
+    // Write coverage as an lcov tracefile here.
+    // Empty if not wanted.
+    std::string coverage_lcov;
+    // Write a binary execution trace here. Empty if not
+    // tracing. Needs a build with LIBI8080_TRACE.
+    std::string trace_file;
+    // If nonzero, trace only the last this many
+    // instructions, written when the program ends.
+    unsigned long trace_last;
+    // Write runtime statistics here. Empty if not
+    // wanted. Needs a build with LIBI8080_STATS.
+    std::string stats_file;
+    // Write memory accesses per page here as CSV.
+    // Empty if not wanted. Needs a build with
+    // LIBI8080_HEATMAP.
+    std::string heatmap_file;
+    // Write memory accesses per address here as
+    // a PGM image. Empty if not wanted.
+    std::string heatmap_pgm;
+    // If nonzero, snapshot the page counts every
+    // this many cycles.
+    unsigned long heatmap_every;
+    // Write a Chrome trace-event timeline here.
+    // Empty if not wanted.
+    std::string timeline_file;
 
     // sensible defaults
     emu_opts() : 
         conv_key_intr(false), 
-        use_cpm_con(true)
+        use_cpm_con(true),
+        boot(false),
+        bios(0),
+        clock_mhz(0),
+        slice_cycles(20000),
+        hle_verify(false),
+        gdb_poll_cycles(100000),
+        sample_hz(1000),
+        trace_last(0),
+        heatmap_every(0)
     {}
 
     emu_opts(bool conv_key_intr, bool use_cpm_con) :
         conv_key_intr(conv_key_intr),
-        use_cpm_con(use_cpm_con)
+        use_cpm_con(use_cpm_con),
+        boot(false),
+        bios(0),
+        clock_mhz(0),
+        slice_cycles(20000),
+        hle_verify(false),
+        gdb_poll_cycles(100000),
+        sample_hz(1000),
+        trace_last(0),
+        heatmap_every(0)
     {}
 };
 
@@ -41,6 +165,22 @@ void emu_destroy(void);
 
 enum emu_err
 {
+    // Could not write a timeline.
+    EMU_ETIMELINE = -10,
+    // Could not write a heatmap.
+    EMU_EHEATMAP = -9,
+    // Could not write statistics.
+    EMU_ESTATS = -8,
+    // Could not write coverage.
+    EMU_ECOVERAGE = -7,
+    // Could not trace or write trace.
+    EMU_ETRACE = -6,
+    // Could not read symbols.
+    EMU_ESYMBOLS = -5,
+    // Could not profile or write profile.
+    EMU_EPROFILE = -4,
+    // Could not serve GDB.
+    EMU_EGDB = -3,
     // Could not set up or intercept 
     // keyboard interrupts.
     EMU_EKEYINTR = -2,
@@ -49,6 +189,12 @@ enum emu_err
 
     EMU_EHNDLR = i8080_EHNDLR,
     EMU_EOPCODE = i8080_EOPCODE,
+    // Native subroutine did not match the
+    // interpreter, or is unknown.
+    EMU_EHLE = i8080_EHLE,
+    // Hit a breakpoint or watchpoint.
+    EMU_EBREAK = i8080_EBREAK,
+    EMU_EWATCH = i8080_EWATCH,
     // Unimplemented BDOS call.
     EMU_EBDOS,
     // Program called debugger.
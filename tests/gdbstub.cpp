@@ -0,0 +1,579 @@
+#if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#define EMU_USING_POSIX_GDBSTUB 1
+#endif
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+#include <cstdint>
+#include <string>
+
+#include "i8080/i8080.h"
+#include "gdbstub.hpp"
+#include "emu.hpp"
+
+#define wordconcat(w1, w2) (((i8080_dword_t)(w1) << 8) | (w2))
+
+// Z80 has 13 16-bit registers, see gdb/z80-tdep.c.
+static constexpr int gdb_nregs = 13;
+
+// Largest packet, PacketSize in qSupported (hex there).
+static constexpr unsigned long gdb_packet_size = 0x1000;
+// Most bytes an m reply holds, with its $ and #xx.
+static constexpr unsigned long gdb_max_read = (gdb_packet_size - 4) / 2;
+// Most bytes an M packet or watchpoint may cover.
+static constexpr unsigned long gdb_max_len = 0x10000;
+
+enum gdb_reg { GDB_AF, GDB_BC, GDB_DE, GDB_HL, GDB_SP, GDB_PC };
+
+static const char HEX[] = "0123456789abcdef";
+
+#define map_test(map, addr) (((map)[(addr) >> 3] >> ((addr) & 7)) & 0x1)
+
+static int hexval(char c) noexcept
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Parse hex digits from pos. Returns false if there are
+// none, or too many for val.
+static bool parse_hex(const std::string& s, std::size_t& pos, unsigned long& val) noexcept
+{
+    std::size_t start = pos;
+    val = 0;
+    int d;
+    while (pos < s.size() && (d = hexval(s[pos])) >= 0)
+    {
+        if (val >> (sizeof val * CHAR_BIT - 4) != 0)
+            return false;
+        val = (val << 4) | unsigned(d);
+        ++pos;
+    }
+    return pos != start;
+}
+
+static void put_hex8(std::string& s, unsigned val)
+{
+    s += HEX[(val >> 4) & 0xf];
+    s += HEX[val & 0xf];
+}
+
+// 16-bit registers are little-endian.
+static void put_hex16(std::string& s, unsigned val)
+{
+    put_hex8(s, val & 0xff);
+    put_hex8(s, (val >> 8) & 0xff);
+}
+
+static unsigned get_flags(const i8080* cpu) noexcept
+{
+    return (unsigned(cpu->s) << 7) | (unsigned(cpu->z) << 6) |
+        (unsigned(cpu->ac) << 4) | (unsigned(cpu->p) << 2) |
+        0x02 | unsigned(cpu->cy);
+}
+
+static void set_flags(i8080* cpu, unsigned flags) noexcept
+{
+    cpu->s = (flags >> 7) & 0x1;
+    cpu->z = (flags >> 6) & 0x1;
+    cpu->ac = (flags >> 4) & 0x1;
+    cpu->p = (flags >> 2) & 0x1;
+    cpu->cy = flags & 0x1;
+}
+
+static unsigned get_reg(const i8080* cpu, int reg) noexcept
+{
+    switch (reg)
+    {
+    case GDB_AF: return wordconcat(cpu->a, get_flags(cpu));
+    case GDB_BC: return wordconcat(cpu->b, cpu->c);
+    case GDB_DE: return wordconcat(cpu->d, cpu->e);
+    case GDB_HL: return wordconcat(cpu->h, cpu->l);
+    case GDB_SP: return cpu->sp;
+    case GDB_PC: return cpu->pc;
+    default: return 0;
+    }
+}
+
+static void set_reg(i8080* cpu, int reg, unsigned val) noexcept
+{
+    auto hi = i8080_word_t((val >> 8) & 0xff);
+    auto lo = i8080_word_t(val & 0xff);
+    switch (reg)
+    {
+    case GDB_AF: cpu->a = hi; set_flags(cpu, lo); break;
+    case GDB_BC: cpu->b = hi; cpu->c = lo; break;
+    case GDB_DE: cpu->d = hi; cpu->e = lo; break;
+    case GDB_HL: cpu->h = hi; cpu->l = lo; break;
+    case GDB_SP: cpu->sp = i8080_addr_t(val & 0xffff); break;
+    case GDB_PC: cpu->pc = i8080_addr_t(val & 0xffff); break;
+    default: break;
+    }
+}
+
+#ifdef EMU_USING_POSIX_GDBSTUB
+
+static struct gdbstub
+{
+    i8080* cpu;
+    int listen_fd;
+    int fd;
+    std::string unix_path;
+    char buf[4096];
+    std::size_t pos, len;
+    // Client understands swbreak stop replies.
+    bool swbreak;
+}
+GDB = { nullptr, -1, -1, std::string(), {}, 0, 0, false };
+
+// Look at the next byte without consuming it.
+// Returns -1 if the client went away.
+static int gdb_peekc(void)
+{
+    if (GDB.pos == GDB.len)
+    {
+        ::ssize_t n;
+        do n = ::read(GDB.fd, GDB.buf, sizeof(GDB.buf));
+        while (n < 0 && errno == EINTR);
+        if (n <= 0) return -1;
+        GDB.pos = 0;
+        GDB.len = std::size_t(n);
+    }
+    return (unsigned char)GDB.buf[GDB.pos];
+}
+
+// Read one byte. Returns -1 if the client went away.
+static int gdb_getc(void)
+{
+    int c = gdb_peekc();
+    if (c >= 0) ++GDB.pos;
+    return c;
+}
+
+static bool gdb_write(const char* data, std::size_t n)
+{
+    while (n > 0)
+    {
+        ::ssize_t w = ::write(GDB.fd, data, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += w;
+        n -= std::size_t(w);
+    }
+    return true;
+}
+
+// Send $data#checksum until the client acknowledges it.
+static bool gdb_put_packet(const std::string& data)
+{
+    unsigned sum = 0;
+    for (char c : data) sum += (unsigned char)c;
+
+    std::string pkt = "$" + data + "#";
+    put_hex8(pkt, sum & 0xff);
+    while (true)
+    {
+        if (!gdb_write(pkt.data(), pkt.size()))
+            return false;
+        int c = gdb_getc();
+        if (c == '+') return true;
+        if (c < 0) return false;
+        // anything else: resend
+    }
+}
+
+// Receive a packet. Returns false if the client went away.
+static bool gdb_get_packet(std::string& data)
+{
+    while (true)
+    {
+        int c;
+        // skip acks and breaks while stopped
+        while ((c = gdb_getc()) != '$')
+            if (c < 0) return false;
+
+        data.clear();
+        unsigned sum = 0;
+        while ((c = gdb_getc()) != '#')
+        {
+            if (c < 0) return false;
+            data += char(c);
+            sum += unsigned(c);
+        }
+        int h1 = gdb_getc(), h2 = gdb_getc();
+        if (h1 < 0 || h2 < 0) return false;
+
+        if (hexval(char(h1)) * 16 + hexval(char(h2)) == int(sum & 0xff))
+            return gdb_write("+", 1);
+        if (!gdb_write("-", 1))
+            return false;
+    }
+}
+
+static bool gdb_fail(const char* what)
+{
+    emu_printerr("gdb: %s: %s", what, std::strerror(errno));
+    gdb_end();
+    return false;
+}
+
+bool gdb_start(const char* where, i8080* cpu)
+{
+    GDB.cpu = cpu;
+    GDB.pos = GDB.len = 0;
+    GDB.swbreak = false;
+
+    char* end;
+    unsigned long port = std::strtoul(where, &end, 10);
+    if (*where != '\0' && *end == '\0')
+    {
+        if (port == 0 || port > 65535) {
+            emu_printerr("gdb: bad port %s", where);
+            return false;
+        }
+        GDB.listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (GDB.listen_fd < 0)
+            return gdb_fail("socket");
+
+        int one = 1;
+        ::setsockopt(GDB.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        // local clients only
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(std::uint16_t(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(GDB.listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0)
+            return gdb_fail("bind");
+    }
+    else {
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        if (std::strlen(where) >= sizeof(addr.sun_path)) {
+            emu_printerr("gdb: socket path %s is too long", where);
+            return false;
+        }
+        GDB.listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (GDB.listen_fd < 0)
+            return gdb_fail("socket");
+
+        addr.sun_family = AF_UNIX;
+        std::strcpy(addr.sun_path, where);
+        ::unlink(where);
+        if (::bind(GDB.listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0)
+            return gdb_fail("bind");
+        GDB.unix_path = where;
+    }
+    if (::listen(GDB.listen_fd, 1) != 0)
+        return gdb_fail("listen");
+
+    std::fprintf(stderr, "i8080emu: waiting for gdb on %s\n", where);
+    do GDB.fd = ::accept(GDB.listen_fd, nullptr, nullptr);
+    while (GDB.fd < 0 && errno == EINTR);
+    if (GDB.fd < 0)
+        return gdb_fail("accept");
+
+    if (GDB.unix_path.empty())
+    {
+        int one = 1;
+        ::setsockopt(GDB.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return true;
+}
+
+void gdb_end(void)
+{
+    if (GDB.fd >= 0) ::close(GDB.fd);
+    if (GDB.listen_fd >= 0) ::close(GDB.listen_fd);
+    if (!GDB.unix_path.empty()) ::unlink(GDB.unix_path.c_str());
+    GDB.fd = GDB.listen_fd = -1;
+    GDB.unix_path.clear();
+}
+
+bool gdb_wait(int ms)
+{
+    if (GDB.pos == GDB.len)
+    {
+        pollfd pfd = { GDB.fd, POLLIN, 0 };
+        if (::poll(&pfd, 1, ms) <= 0)
+            return false;
+    }
+    // A closed connection also stops the CPU.
+    int c = gdb_peekc();
+    if (c < 0) return true;
+    // Ctrl+C is sent out-of-band as a single byte.
+    if (c == 0x03) {
+        ++GDB.pos;
+        return true;
+    }
+    // stray acks
+    if (c == '+' || c == '-') {
+        ++GDB.pos;
+        return false;
+    }
+    // Anything else starts a packet, which also stops the CPU.
+    // It is left in the buffer for gdb_stop() to read whole.
+    return true;
+}
+
+bool gdb_poll(void)
+{
+    return gdb_wait(0);
+}
+
+void gdb_exit(int status)
+{
+    std::string pkt = "W";
+    put_hex8(pkt, unsigned(status) & 0xff);
+    gdb_put_packet(pkt);
+}
+
+// Stop reply, e.g. T05watch:1234;
+static std::string gdb_stop_reply(gdb_reason reason)
+{
+    std::string reply = "T";
+    switch (reason)
+    {
+    case GDB_INTERRUPTED: put_hex8(reply, 2); break; // SIGINT
+    case GDB_FAULT: put_hex8(reply, 4); break; // SIGILL
+    default: put_hex8(reply, 5); break; // SIGTRAP
+    }
+    if (reason == GDB_WATCH)
+    {
+        const i8080_debug* d = GDB.cpu->debug;
+        bool rd = d->hit_kind == I8080_WATCH_READ;
+        // awatch if watching both ways
+        bool both = rd ? map_test(d->watch_wr, d->hit_addr) :
+            map_test(d->watch_rd, d->hit_addr);
+        reply += both ? "awatch:" : (rd ? "rwatch:" : "watch:");
+        char buf[8];
+        std::snprintf(buf, sizeof(buf), "%x;", unsigned(d->hit_addr));
+        reply += buf;
+    }
+    else if (reason == GDB_BREAK && GDB.swbreak)
+        reply += "swbreak:;";
+    return reply;
+}
+
+// Set or clear a breakpoint or watchpoint, for Z and z packets.
+static bool gdb_point(const std::string& pkt, bool set)
+{
+    std::size_t pos = 1;
+    unsigned long type, addr, len;
+    if (!parse_hex(pkt, pos, type) || pos >= pkt.size() || pkt[pos++] != ',' ||
+        !parse_hex(pkt, pos, addr) || pos >= pkt.size() || pkt[pos++] != ',' ||
+        !parse_hex(pkt, pos, len) || len > gdb_max_len)
+        return false;
+
+    i8080_debug* d = GDB.cpu->debug;
+    int flags;
+    switch (type)
+    {
+    case 0: case 1: // software, hardware breakpoint
+        if (set) i8080_break_set(d, i8080_addr_t(addr & 0xffff));
+        else i8080_break_clear(d, i8080_addr_t(addr & 0xffff));
+        return true;
+    case 2: flags = I8080_WATCH_WRITE; break;
+    case 3: flags = I8080_WATCH_READ; break;
+    case 4: flags = I8080_WATCH_READ | I8080_WATCH_WRITE; break;
+    default: return false;
+    }
+    for (unsigned long i = 0; i < len; ++i)
+    {
+        auto a = i8080_addr_t((addr + i) & 0xffff);
+        if (set) i8080_watch_set(d, a, flags);
+        else i8080_watch_clear(d, a, flags);
+    }
+    return true;
+}
+
+// Handle a request that does not resume the CPU.
+static std::string gdb_request(const std::string& pkt)
+{
+    i8080* cpu = GDB.cpu;
+    std::string reply;
+    std::size_t pos = 1;
+    unsigned long addr, len, val;
+
+    switch (pkt[0])
+    {
+    case 'g':
+        for (int r = 0; r < gdb_nregs; ++r)
+            put_hex16(reply, get_reg(cpu, r));
+        return reply;
+
+    case 'G':
+        for (int r = 0; r < gdb_nregs && pos + 4 <= pkt.size(); ++r, pos += 4)
+        {
+            int b[4];
+            for (int i = 0; i < 4; ++i)
+                if ((b[i] = hexval(pkt[pos + i])) < 0) return "E01";
+            set_reg(cpu, r, unsigned((b[2] << 12) | (b[3] << 8) | (b[0] << 4) | b[1]));
+        }
+        return "OK";
+
+    case 'p':
+        if (!parse_hex(pkt, pos, val)) return "E01";
+        put_hex16(reply, int(val) < gdb_nregs ? get_reg(cpu, int(val)) : 0);
+        return reply;
+
+    case 'P':
+    {
+        if (!parse_hex(pkt, pos, addr) || pos >= pkt.size() || pkt[pos++] != '=')
+            return "E01";
+        if (pkt.size() - pos < 4) return "E01";
+        int b[4];
+        for (int i = 0; i < 4; ++i)
+            if ((b[i] = hexval(pkt[pos + i])) < 0) return "E01";
+        set_reg(cpu, int(addr), unsigned((b[2] << 12) | (b[3] << 8) | (b[0] << 4) | b[1]));
+        return "OK";
+    }
+    case 'm':
+        if (!parse_hex(pkt, pos, addr) || pos >= pkt.size() || pkt[pos++] != ',' ||
+            !parse_hex(pkt, pos, len) || len > gdb_max_read)
+            return "E01";
+        for (unsigned long i = 0; i < len; ++i)
+            put_hex8(reply, cpu->mem_read(cpu, i8080_addr_t((addr + i) & 0xffff)));
+        return reply;
+
+    case 'M':
+        if (!parse_hex(pkt, pos, addr) || pos >= pkt.size() || pkt[pos++] != ',' ||
+            !parse_hex(pkt, pos, len) || pos >= pkt.size() || pkt[pos++] != ':' ||
+            len > gdb_max_len || len > (pkt.size() - pos) / 2)
+            return "E01";
+        for (unsigned long i = 0; i < len; ++i, pos += 2)
+        {
+            int h = hexval(pkt[pos]), l = hexval(pkt[pos + 1]);
+            if (h < 0 || l < 0) return "E01";
+            cpu->mem_write(cpu, i8080_addr_t((addr + i) & 0xffff), i8080_word_t(h * 16 + l));
+        }
+        return "OK";
+
+    case 'Z': case 'z':
+        return gdb_point(pkt, pkt[0] == 'Z') ? "OK" : "";
+
+    case 'q':
+        if (pkt.compare(0, 10, "qSupported") == 0)
+        {
+            GDB.swbreak = pkt.find("swbreak+") != std::string::npos;
+            return "PacketSize=1000;swbreak+";
+        }
+        if (pkt == "qAttached") return "1";
+        if (pkt == "qC") return "QC1";
+        if (pkt == "qfThreadInfo") return "m1";
+        if (pkt == "qsThreadInfo") return "l";
+        return "";
+
+    case 'H': case 'T':
+        return "OK";
+
+    default:
+        // unsupported
+        return "";
+    }
+}
+
+// Handle a request. Returns true and sets action if the
+// client resumes or goes away.
+static bool gdb_handle(const std::string& pkt, gdb_reason reason, gdb_resume& action)
+{
+    if (pkt.empty()) {
+        gdb_put_packet("");
+        return false;
+    }
+    std::size_t pos = 1;
+    unsigned long addr;
+    switch (pkt[0])
+    {
+    case '?':
+        gdb_put_packet(gdb_stop_reply(reason));
+        return false;
+    case 'c': case 's':
+        // optional resume address
+        if (parse_hex(pkt, pos, addr))
+            GDB.cpu->pc = i8080_addr_t(addr & 0xffff);
+        action = pkt[0] == 'c' ? GDB_CONTINUE : GDB_STEP;
+        return true;
+    case 'D':
+        gdb_put_packet("OK");
+        action = GDB_DETACH;
+        return true;
+    case 'k':
+        action = GDB_KILL;
+        return true;
+    default:
+        if (gdb_put_packet(gdb_request(pkt)))
+            return false;
+        action = GDB_DETACH;
+        return true;
+    }
+}
+
+// Serve requests until the client resumes or goes away.
+static gdb_resume gdb_serve(gdb_reason reason)
+{
+    std::string pkt;
+    gdb_resume action = GDB_DETACH;
+    while (gdb_get_packet(pkt))
+    {
+        if (gdb_handle(pkt, reason, action))
+            return action;
+    }
+    return GDB_DETACH;
+}
+
+gdb_resume gdb_attach(void)
+{
+    // the client asks why we stopped with '?'
+    return gdb_serve(GDB_STEPPED);
+}
+
+gdb_resume gdb_stop(gdb_reason reason)
+{
+    // Read a packet that stopped the CPU before the stop reply
+    // goes out, so waiting for its ack does not eat the packet.
+    // It is answered after the reply.
+    std::string pending;
+    bool has_pending = GDB.pos < GDB.len && GDB.buf[GDB.pos] == '$';
+    if (has_pending && !gdb_get_packet(pending))
+        return GDB_DETACH;
+
+    if (!gdb_put_packet(gdb_stop_reply(reason)))
+        return GDB_DETACH;
+    gdb_resume action;
+    if (has_pending && gdb_handle(pending, reason, action))
+        return action;
+    return gdb_serve(reason);
+}
+
+#else
+
+bool gdb_start(const char*, i8080*)
+{
+    emu_printerr("gdb: not supported on this platform");
+    return false;
+}
+
+void gdb_end(void) {}
+bool gdb_poll(void) { return false; }
+bool gdb_wait(int) { return false; }
+gdb_resume gdb_attach(void) { return GDB_DETACH; }
+gdb_resume gdb_stop(gdb_reason) { return GDB_DETACH; }
+void gdb_exit(int) {}
+
+#endif
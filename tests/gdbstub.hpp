@@ -0,0 +1,65 @@
+#ifndef GDBSTUB_HPP
+#define GDBSTUB_HPP
+
+#include "i8080/i8080.h"
+
+// A stub for the GDB remote serial protocol. Registers are
+// laid out as for GDB's z80 architecture (af, bc, de, hl, sp,
+// pc, then unused Z80 registers), so a client can attach with
+//  (gdb) set architecture z80
+//  (gdb) target remote :<port>
+
+// Why the CPU stopped.
+enum gdb_reason
+{
+    // Single step completed.
+    GDB_STEPPED,
+    // Client sent a break (Ctrl+C).
+    GDB_INTERRUPTED,
+    // Hit a breakpoint or watchpoint, see cpu->debug.
+    GDB_BREAK,
+    GDB_WATCH,
+    // CPU error, e.g. unhandled I/O.
+    GDB_FAULT
+};
+
+// What the client asked for.
+enum gdb_resume
+{
+    GDB_CONTINUE,
+    GDB_STEP,
+    // Client detached, run without the stub.
+    GDB_DETACH,
+    // Client asked to kill the program.
+    GDB_KILL
+};
+
+// Listen on a localhost TCP port, or a Unix socket if where
+// is not a number, and wait for a client to connect.
+// cpu->debug must be set.
+// Returns true on success.
+bool gdb_start(const char* where, i8080* cpu);
+
+// Close the connection.
+void gdb_end(void);
+
+// Check for a break from the client without blocking.
+// Call this every few thousand cycles while running.
+bool gdb_poll(void);
+
+// Wait up to ms milliseconds for a break from the client.
+// Use this instead of gdb_poll() while the CPU is halted.
+bool gdb_wait(int ms);
+
+// Serve a newly connected client, which sees the
+// CPU as stopped, until it resumes or goes away.
+gdb_resume gdb_attach(void);
+
+// Report a stop to the client and serve its requests
+// until it resumes or goes away.
+gdb_resume gdb_stop(gdb_reason reason);
+
+// Tell the client the program exited.
+void gdb_exit(int status);
+
+#endif
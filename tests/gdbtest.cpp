@@ -0,0 +1,225 @@
+// Drives i8080emu's GDB stub through a scripted remote serial
+// protocol session over a Unix socket, as a CTest.
+// Usage: i8080gdbtest <i8080emu> <program.COM>
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const char HEX[] = "0123456789abcdef";
+
+static struct client
+{
+    int fd;
+    pid_t emu;
+    int failures;
+}
+CLIENT;
+
+static void put_hex8(std::string& s, unsigned val)
+{
+    s += HEX[(val >> 4) & 0xf];
+    s += HEX[val & 0xf];
+}
+
+static int getc_fd(void)
+{
+    unsigned char c;
+    return ::read(CLIENT.fd, &c, 1) == 1 ? c : -1;
+}
+
+static bool write_all(const std::string& s)
+{
+    return ::write(CLIENT.fd, s.data(), s.size()) == ::ssize_t(s.size());
+}
+
+// Receive a packet and acknowledge it.
+static bool get_packet(std::string& data)
+{
+    int c;
+    while ((c = getc_fd()) != '$')
+        if (c < 0) return false;
+    data.clear();
+    while ((c = getc_fd()) != '#')
+    {
+        if (c < 0) return false;
+        data += char(c);
+    }
+    if (getc_fd() < 0 || getc_fd() < 0)
+        return false;
+    return write_all("+");
+}
+
+// Send a packet, wait for its ack, and return the reply.
+static std::string request(const std::string& data, bool reply = true)
+{
+    unsigned sum = 0;
+    for (char c : data) sum += (unsigned char)c;
+    std::string pkt = "$" + data + "#";
+    put_hex8(pkt, sum & 0xff);
+    std::string resp;
+    if (!write_all(pkt) || getc_fd() != '+' || (reply && !get_packet(resp)))
+        return "<no reply>";
+    return resp;
+}
+
+static void check(const char* what, bool ok, const std::string& got)
+{
+    std::printf("%s %s", ok ? "ok  " : "FAIL", what);
+    if (!ok) std::printf(" (got '%s')", got.c_str());
+    std::printf("\n");
+    if (!ok) ++CLIENT.failures;
+}
+
+static void expect(const std::string& pkt, const std::string& want)
+{
+    std::string got = request(pkt);
+    check(pkt.c_str(), got == want, got);
+}
+
+static void expect_prefix(const std::string& pkt, const std::string& want)
+{
+    std::string got = request(pkt);
+    check(pkt.c_str(), got.compare(0, want.size(), want) == 0, got);
+}
+
+// PC from a g reply: the sixth register, little-endian.
+static unsigned reply_pc(const std::string& regs)
+{
+    if (regs.size() < 24) return 0x10000;
+    std::string pc = regs.substr(22, 2) + regs.substr(20, 2);
+    return unsigned(std::strtoul(pc.c_str(), nullptr, 16));
+}
+
+static bool connect_emu(const std::string& path)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    // until i8080emu is listening
+    for (int tries = 0; tries < 100; ++tries)
+    {
+        CLIENT.fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (CLIENT.fd < 0) return false;
+        if (::connect(CLIENT.fd, (sockaddr*)&addr, sizeof(addr)) == 0)
+        {
+            // never hang the test on a stuck stub
+            timeval tv = { 10, 0 };
+            ::setsockopt(CLIENT.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            return true;
+        }
+        ::close(CLIENT.fd);
+        ::usleep(50000);
+    }
+    return false;
+}
+
+static bool read_program(const char* path, std::vector<unsigned char>& bin)
+{
+    std::FILE* fs = std::fopen(path, "rb");
+    if (!fs) return false;
+    int c;
+    while ((c = std::fgetc(fs)) != EOF)
+        bin.push_back((unsigned char)c);
+    std::fclose(fs);
+    return !bin.empty();
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        std::fprintf(stderr, "usage: i8080gdbtest <i8080emu> <program.COM>\n");
+        return EXIT_FAILURE;
+    }
+    std::vector<unsigned char> bin;
+    if (!read_program(argv[2], bin)) {
+        std::fprintf(stderr, "i8080gdbtest: could not read %s\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+    std::string sock = "i8080gdbtest." + std::to_string(::getpid()) + ".sock";
+
+    ::signal(SIGPIPE, SIG_IGN);
+    CLIENT.emu = ::fork();
+    if (CLIENT.emu == 0)
+    {
+        ::execl(argv[1], argv[1], "-f", argv[2], "--gdb", sock.c_str(), (char*)nullptr);
+        std::perror("i8080gdbtest: exec");
+        std::_Exit(127);
+    }
+    if (CLIENT.emu < 0 || !connect_emu(sock)) {
+        std::fprintf(stderr, "i8080gdbtest: could not connect to %s\n", sock.c_str());
+        if (CLIENT.emu > 0) ::kill(CLIENT.emu, SIGKILL);
+        return EXIT_FAILURE;
+    }
+
+    expect_prefix("qSupported:swbreak+", "PacketSize=");
+    expect_prefix("?", "T05");
+
+    // stopped at the load address
+    std::string regs = request("g");
+    check("g", regs.size() == 13 * 4 && reply_pc(regs) == 0x100, regs);
+
+    std::string code;
+    for (int i = 0; i < 4; ++i) put_hex8(code, bin[i]);
+    expect("m100,4", code);
+    expect("M8000,3:a1b2c3", "OK");
+    expect("m8000,3", "a1b2c3");
+
+    // lengths that would overflow or exhaust memory
+    expect("m0,ffffffffffffffff", "E01");
+    expect("m0,100000", "E01");
+    expect("M0,8000000000000000:00", "E01");
+    expect("M0,4:00", "E01");
+    expect("m0,10000000000000000000", "E01");
+    expect("Z2,0,ffffffffffffffff", ""); // refused as unsupported
+
+    expect_prefix("s", "T05");
+    regs = request("g");
+    check("g after s", reply_pc(regs) != 0x100 && reply_pc(regs) <= 0xffff, regs);
+
+    // the program prints through the BDOS first
+    expect("Z0,5,1", "OK");
+    expect_prefix("c", "T05");
+    regs = request("g");
+    check("g at breakpoint", reply_pc(regs) == 0x0005, regs);
+    expect("z0,5,1", "OK");
+
+    // loop forever, then stop it with Ctrl+C
+    expect("M100,3:c30001", "OK");
+    request("c100", false);
+    ::usleep(50000);
+    write_all("\x03");
+    std::string reply;
+    check("Ctrl+C stops", get_packet(reply) && reply.compare(0, 3, "T02") == 0, reply);
+
+    // a packet sent while running stops it too, and is answered
+    // whole after the stop reply
+    request("c", false);
+    ::usleep(50000);
+    expect_prefix("?", "T02");
+    check("? answered", get_packet(reply) && reply.compare(0, 3, "T02") == 0, reply);
+    regs = request("g");
+    check("g after stop", reply_pc(regs) >= 0x100 && reply_pc(regs) < 0x103, regs);
+
+    request("k", false);
+    ::close(CLIENT.fd);
+
+    int status = 0;
+    bool exited = ::waitpid(CLIENT.emu, &status, 0) == CLIENT.emu && WIFEXITED(status);
+    check("k ends i8080emu", exited, exited ? "" : "still running or killed");
+    ::unlink(sock.c_str());
+
+    std::printf("%d failed\n", CLIENT.failures);
+    return CLIENT.failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
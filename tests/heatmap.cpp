@@ -0,0 +1,161 @@
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <memory>
+
+#include "i8080/i8080.h"
+#include "heatmap.hpp"
+#include "emu.hpp"
+
+#ifdef I8080_HEATMAP
+
+static struct heatmap
+{
+    i8080* cpu;
+    std::unique_ptr<i8080_heatmap> map;
+    std::unique_ptr<i8080_cycles_t[]> addr;
+    // Page counts at the last snapshot.
+    i8080_cycles_t last[I8080_HEAT_KINDS][256];
+    std::FILE* csv;
+    std::string csv_path;
+    std::string pgm_path;
+    i8080_cycles_t every;
+    i8080_cycles_t next;
+    bool ok;
+}
+HEATMAP;
+
+static bool snapshot(void)
+{
+    const i8080_heatmap* map = HEATMAP.map.get();
+    auto& last = HEATMAP.last;
+    for (unsigned page = 0; page < 256; ++page)
+    {
+        i8080_cycles_t delta[I8080_HEAT_KINDS];
+        bool any = false;
+        for (int kind = 0; kind < I8080_HEAT_KINDS; ++kind)
+        {
+            delta[kind] = map->page[kind][page] - last[kind][page];
+            last[kind][page] = map->page[kind][page];
+            any = any || delta[kind] != 0;
+        }
+        if (!any) continue;
+        std::fprintf(HEATMAP.csv, "%llu,%u,%llu,%llu,%llu,%llu,%llu\n",
+            (unsigned long long)HEATMAP.cpu->cycles, page,
+            (unsigned long long)delta[I8080_HEAT_FETCH],
+            (unsigned long long)delta[I8080_HEAT_READ],
+            (unsigned long long)delta[I8080_HEAT_WRITE],
+            (unsigned long long)delta[I8080_HEAT_STACK_READ],
+            (unsigned long long)delta[I8080_HEAT_STACK_WRITE]);
+    }
+    if (std::ferror(HEATMAP.csv)) {
+        emu_printerr("Could not write %s", HEATMAP.csv_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// 256x256, one row per page, shaded by the log of all
+// accesses to each address, so rarely used memory shows.
+static bool write_pgm(void)
+{
+    const char* path = HEATMAP.pgm_path.c_str();
+    std::FILE* fs = std::fopen(path, "wb");
+    if (!fs) {
+        emu_printerr("Could not open %s", path);
+        return false;
+    }
+
+    const i8080_cycles_t* counts = HEATMAP.addr.get();
+    std::unique_ptr<double[]> total(new double[65536]());
+    double max = 0;
+    for (unsigned long a = 0; a < 65536; ++a)
+    {
+        for (int kind = 0; kind < I8080_HEAT_KINDS; ++kind)
+            total[a] += double(counts[((unsigned long)kind << 16) | a]);
+        if (total[a] > max) max = total[a];
+    }
+
+    std::fprintf(fs, "P5\n# memory accesses per address, log scale, one row per page\n"
+        "256 256\n255\n");
+    for (unsigned long a = 0; a < 65536; ++a)
+    {
+        int shade = max > 0 ? int(255.0 * std::log1p(total[a]) / std::log1p(max) + 0.5) : 0;
+        std::fputc(shade, fs);
+    }
+
+    bool ok = !std::ferror(fs);
+    if (std::fclose(fs) != 0)
+        ok = false;
+    if (!ok)
+        emu_printerr("Could not write %s", path);
+    return ok;
+}
+
+bool heatmap_start(i8080* cpu, const char* csv_path, const char* pgm_path,
+    i8080_cycles_t every)
+{
+    HEATMAP.cpu = cpu;
+    HEATMAP.csv_path = csv_path ? csv_path : "";
+    HEATMAP.pgm_path = pgm_path ? pgm_path : "";
+    HEATMAP.csv = nullptr;
+    if (csv_path)
+    {
+        HEATMAP.csv = std::fopen(csv_path, "w");
+        if (!HEATMAP.csv) {
+            emu_printerr("Could not open %s", csv_path);
+            return false;
+        }
+        std::fputs("cycles,page,fetch,read,write,stack_read,stack_write\n", HEATMAP.csv);
+    }
+
+    if (!HEATMAP.map)
+        HEATMAP.map.reset(new i8080_heatmap);
+    HEATMAP.addr.reset(pgm_path ?
+        new i8080_cycles_t[(unsigned long)I8080_HEAT_KINDS << 16] : nullptr);
+    i8080_heatmap_init(HEATMAP.map.get(), HEATMAP.addr.get());
+    for (auto& kind : HEATMAP.last)
+        for (auto& count : kind)
+            count = 0;
+
+    HEATMAP.every = every;
+    HEATMAP.next = cpu->cycles + every;
+    HEATMAP.ok = true;
+    cpu->heatmap = HEATMAP.map.get();
+    return true;
+}
+
+bool heatmap_tick(void)
+{
+    if (!HEATMAP.csv || HEATMAP.every == 0 || HEATMAP.cpu->cycles < HEATMAP.next)
+        return true;
+    // one snapshot even if a run overshot several periods
+    while (HEATMAP.next <= HEATMAP.cpu->cycles)
+        HEATMAP.next += HEATMAP.every;
+    if (HEATMAP.ok && !snapshot())
+        HEATMAP.ok = false;
+    return HEATMAP.ok;
+}
+
+bool heatmap_end(void)
+{
+    bool ok = HEATMAP.ok;
+    if (HEATMAP.csv)
+    {
+        if (ok)
+            ok = snapshot();
+        if (std::fclose(HEATMAP.csv) != 0 && ok) {
+            emu_printerr("Could not write %s", HEATMAP.csv_path.c_str());
+            ok = false;
+        }
+        HEATMAP.csv = nullptr;
+    }
+    if (!HEATMAP.pgm_path.empty())
+        ok = write_pgm() && ok;
+
+    HEATMAP.cpu->heatmap = nullptr;
+    HEATMAP.addr.reset();
+    return ok;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef HEATMAP_HPP
+#define HEATMAP_HPP
+
+#include "i8080/i8080.h"
+
+#ifdef I8080_HEATMAP
+// Memory access heatmaps, from cpu->heatmap. Page counts are
+// written as CSV, one row per page accessed and snapshot:
+// cycles,page,fetch,read,write,stack_read,stack_write
+// where cycles is when the snapshot was taken, and counts
+// are accesses since the last snapshot. Per-address counts
+// are written as a PGM image at the end.
+
+// Start counting cpu's memory accesses. Either path may be
+// null. If every is nonzero, a snapshot is due every this
+// many cycles; otherwise there is one at the end.
+// Returns true on success.
+bool heatmap_start(i8080* cpu, const char* csv_path, const char* pgm_path,
+    i8080_cycles_t every);
+
+// Write a snapshot if one is due. Call between runs of the CPU.
+// Returns true on success.
+bool heatmap_tick(void);
+
+// Write the last snapshot and the image, and stop counting.
+// Returns true on success.
+bool heatmap_end(void);
+#endif
+
+#endif
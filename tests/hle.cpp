@@ -0,0 +1,153 @@
+#include <cstring>
+
+#include "i8080/i8080.h"
+#include "hle.hpp"
+
+// Each routine must leave registers, flags and memory exactly
+// as its reference 8080 routine (in the comments) does. Programs
+// that use a variant of a routine can be checked with --hle-verify.
+
+#define wordconcat(w1, w2) (((i8080_dword_t)(w1) << 8) | (w2))
+#define hi(dword) (i8080_word_t((dword) >> 8))
+#define lo(dword) (i8080_word_t((dword) & 0xff))
+
+static inline i8080_word_t parity(i8080_word_t w)
+{
+    w ^= (w >> 4);
+    w ^= (w >> 2);
+    w ^= (w >> 1);
+    return !(w & 0x1);
+}
+
+// Flags after ORA with a zero result.
+static inline void set_flags_zero(i8080* cpu)
+{
+    cpu->z = 1; cpu->s = 0; cpu->p = 1;
+    cpu->cy = 0; cpu->ac = 0;
+}
+
+// Copy BC bytes from [HL] to [DE] (65536 if BC is 0).
+//  blkcpy: mov a,m
+//          stax d
+//          inx h
+//          inx d
+//          dcx b
+//          mov a,b
+//          ora c
+//          jnz blkcpy
+//          ret
+static void hle_blkcpy(void*, i8080* cpu) noexcept
+{
+    i8080_dword_t src = wordconcat(cpu->h, cpu->l);
+    i8080_dword_t dst = wordconcat(cpu->d, cpu->e);
+    i8080_dword_t n = wordconcat(cpu->b, cpu->c);
+    do {
+        cpu->mem_write(cpu, dst, cpu->mem_read(cpu, src));
+        src = i8080_dword_t(src + 1);
+        dst = i8080_dword_t(dst + 1);
+        n = i8080_dword_t(n - 1);
+    } while (n != 0);
+
+    cpu->h = hi(src); cpu->l = lo(src);
+    cpu->d = hi(dst); cpu->e = lo(dst);
+    cpu->b = 0; cpu->c = 0;
+    cpu->a = 0;
+    set_flags_zero(cpu);
+}
+
+// HL = BC * DE (low 16 bits), DE = 0.
+//  mul16:  lxi h,0
+//          mvi a,16
+//  loop:   dad h
+//          xchg
+//          dad h
+//          xchg
+//          jnc skip
+//          dad b
+//  skip:   dcr a
+//          jnz loop
+//          ret
+static void hle_mul16(void*, i8080* cpu) noexcept
+{
+    unsigned long bc = wordconcat(cpu->b, cpu->c);
+    unsigned long de = wordconcat(cpu->d, cpu->e);
+    unsigned long hl = 0;
+    unsigned cy = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        hl <<= 1;
+        de <<= 1;
+        cy = (de >> 16) & 0x1;
+        hl &= 0xffff; de &= 0xffff;
+        if (cy)
+        {
+            hl += bc;
+            cy = (hl >> 16) & 0x1;
+            hl &= 0xffff;
+        }
+    }
+    cpu->h = hi(hl); cpu->l = lo(hl);
+    cpu->d = 0; cpu->e = 0;
+    cpu->a = 0;
+    // DCR A from 1
+    cpu->z = 1; cpu->s = 0; cpu->p = 1; cpu->ac = 1;
+    cpu->cy = cy;
+}
+
+// Compare 0-terminated strings at [DE] and [HL].
+// Z is set if equal, else CY is set if [DE] < [HL].
+//  strcmp: ldax d
+//          cmp m
+//          rnz
+//          ora a
+//          rz
+//          inx h
+//          inx d
+//          jmp strcmp
+static void hle_strcmp(void*, i8080* cpu) noexcept
+{
+    i8080_dword_t hl = wordconcat(cpu->h, cpu->l);
+    i8080_dword_t de = wordconcat(cpu->d, cpu->e);
+    while (true)
+    {
+        i8080_word_t a = cpu->mem_read(cpu, de);
+        i8080_word_t m = cpu->mem_read(cpu, hl);
+        cpu->a = a;
+        if (a != m)
+        {
+            // CMP M
+            unsigned res = a + (m ^ 0xffu) + 1;
+            cpu->ac = (((a & 0xf) + ((m & 0xf) ^ 0xf) + 1) >> 4) & 0x1;
+            cpu->cy = !((res >> 8) & 0x1);
+            cpu->z = 0;
+            cpu->s = (res >> 7) & 0x1;
+            cpu->p = parity(i8080_word_t(res & 0xff));
+            break;
+        }
+        if (a == 0)
+        {
+            set_flags_zero(cpu);
+            break;
+        }
+        hl = i8080_dword_t(hl + 1);
+        de = i8080_dword_t(de + 1);
+    }
+    cpu->h = hi(hl); cpu->l = lo(hl);
+    cpu->d = hi(de); cpu->e = lo(de);
+}
+
+const hle_routine HLE_ROUTINES[] =
+{
+    {"blkcpy", hle_blkcpy, 778, "Copy BC bytes from [HL] to [DE]."},
+    {"mul16", hle_mul16, 955, "HL = BC * DE."},
+    {"strcmp", hle_strcmp, 418, "Compare 0-terminated strings at [DE] and [HL]."},
+    {nullptr, nullptr, 0, nullptr}
+};
+
+const hle_routine* hle_find(const char* name)
+{
+    for (auto r = HLE_ROUTINES; r->name; ++r)
+        if (std::strcmp(r->name, name) == 0)
+            return r;
+    return nullptr;
+}
@@ -0,0 +1,22 @@
+#ifndef HLE_HPP
+#define HLE_HPP
+
+#include "i8080/i8080.h"
+
+// A native replacement for a common 8080 subroutine.
+struct hle_routine
+{
+    const char* name;
+    i8080_hle_fn fn;
+    // Cycles charged per call if not configured.
+    unsigned long cycles;
+    const char* desc;
+};
+
+// Find a routine by name, or return nullptr.
+const hle_routine* hle_find(const char* name);
+
+// List of routines, terminated by an entry with a null name.
+extern const hle_routine HLE_ROUTINES[];
+
+#endif
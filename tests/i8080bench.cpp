@@ -0,0 +1,825 @@
+// Benchmarks the emulator on fixed workloads: the CP/M test
+// binaries, and synthetic kernels that each stress one kind
+// of instruction. Prints results as JSON, so runs on different
+// builds and commits can be compared.
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "i8080/i8080.h"
+#include "i8080/i8080_opcodes.h"
+
+namespace {
+
+struct workload
+{
+    const char* name;
+    // Test binary in the binaries directory, or null for a kernel.
+    const char* file;
+    const i8080_word_t* code;
+    std::size_t size;
+    const char* desc;
+
+    // Expected cycles, and FNV-1a hash of the console output
+    // of test binaries. A change means the emulation changed.
+    unsigned long long cycles;
+    unsigned long out_hash;
+};
+
+// The emulated machine: 64K of RAM, and just enough of CP/M
+// to run the test binaries. Console output is not printed,
+// only counted and hashed.
+struct machine
+{
+    i8080 cpu;
+    i8080_traps traps;
+    i8080_port ports[I8080_NUM_PORTS];
+    i8080_word_t mem[65536];
+    i8080_word_t io[I8080_NUM_PORTS];
+
+    bool done;
+    const char* err;
+    unsigned long out_bytes;
+    unsigned long out_hash;
+};
+
+// One workload's measurements.
+struct result
+{
+    unsigned long long insns;
+    unsigned long long cycles;
+    unsigned long out_bytes;
+    unsigned long out_hash;
+    std::vector<double> seconds;
+};
+
+struct stats
+{
+    double mean, stddev, min, max;
+};
+
+}
+
+// Synthetic kernels. Each loops over its body 65536 times
+// per pass, for the number of passes set at 0x0104, then
+// warm boots. Registers are set up so the loads and stores
+// stay within their buffers.
+
+static const i8080_word_t ALU_KERNEL[] = {
+    0x31, 0x00, 0xf0,   // lxi   sp, 0f000h
+    0x3e, 0x0c,         // mvi   a, 0ch
+    0x32, 0x41, 0x01,   // sta   count
+    // outer:
+    0x21, 0x00, 0x10,   // lxi   h, 1000h
+    0x11, 0x00, 0x20,   // lxi   d, 2000h
+    0x01, 0x00, 0x00,   // lxi   b, 0
+    // loop:
+    0x82,               // add   d
+    0x8b,               // adc   e
+    0x94,               // sub   h
+    0x9d,               // sbb   l
+    0xa2,               // ana   d
+    0xab,               // xra   e
+    0xb4,               // ora   h
+    0xbd,               // cmp   l
+    0x14,               // inr   d
+    0x1d,               // dcr   e
+    0x07,               // rlc
+    0x1f,               // rar
+    0x27,               // daa
+    0x2f,               // cma
+    0xc6, 0x04,         // adi   04h
+    0xce, 0x03,         // aci   03h
+    0xd6, 0x01,         // sui   01h
+    0xee, 0x5a,         // xri   5ah
+    0xf6, 0x01,         // ori   01h
+    0xe6, 0x7f,         // ani   7fh
+    0xfe, 0x03,         // cpi   03h
+    0x29,               // dad   h
+    0x23,               // inx   h
+    0x37,               // stc
+    0x3f,               // cmc
+    0x0b,               // dcx   b
+    0x78,               // mov   a, b
+    0xb1,               // ora   c
+    0xc2, 0x11, 0x01,   // jnz   loop
+    0x21, 0x41, 0x01,   // lxi   h, count
+    0x35,               // dcr   m
+    0xc2, 0x08, 0x01,   // jnz   outer
+    0xc3, 0x00, 0x00,   // jmp   0
+    // count:
+    0x00,               // db    0
+};
+
+static const i8080_word_t MEM_KERNEL[] = {
+    0x31, 0x00, 0xf0,   // lxi   sp, 0f000h
+    0x3e, 0x18,         // mvi   a, 18h
+    0x32, 0x38, 0x01,   // sta   count
+    // outer:
+    0x21, 0x00, 0x10,   // lxi   h, 1000h
+    0x11, 0x00, 0x20,   // lxi   d, 2000h
+    0x01, 0x00, 0x00,   // lxi   b, 0
+    // loop:
+    0x7e,               // mov   a, m
+    0x12,               // stax  d
+    0x2c,               // inr   l
+    0x1c,               // inr   e
+    0x1a,               // ldax  d
+    0x77,               // mov   m, a
+    0x2c,               // inr   l
+    0x7e,               // mov   a, m
+    0x86,               // add   m
+    0x77,               // mov   m, a
+    0x1c,               // inr   e
+    0x12,               // stax  d
+    0x56,               // mov   d, m
+    0x5e,               // mov   e, m
+    0x16, 0x20,         // mvi   d, 20h
+    0x73,               // mov   m, e
+    0x3a, 0x00, 0x30,   // lda   3000h
+    0x32, 0x01, 0x30,   // sta   3001h
+    0x0b,               // dcx   b
+    0x78,               // mov   a, b
+    0xb1,               // ora   c
+    0xc2, 0x11, 0x01,   // jnz   loop
+    0x21, 0x38, 0x01,   // lxi   h, count
+    0x35,               // dcr   m
+    0xc2, 0x08, 0x01,   // jnz   outer
+    0xc3, 0x00, 0x00,   // jmp   0
+    // count:
+    0x00,               // db    0
+};
+
+// Both ways of every conditional jump are taken, depending
+// on the bits of the loop counter.
+static const i8080_word_t BRANCH_KERNEL[] = {
+    0x31, 0x00, 0xf0,   // lxi   sp, 0f000h
+    0x3e, 0x14,         // mvi   a, 14h
+    0x32, 0x49, 0x01,   // sta   count
+    // outer:
+    0x21, 0x00, 0x10,   // lxi   h, 1000h
+    0x11, 0x00, 0x20,   // lxi   d, 2000h
+    0x01, 0x00, 0x00,   // lxi   b, 0
+    // loop:
+    0x79,               // mov   a, c
+    0x0f,               // rrc
+    0xda, 0x17, 0x01,   // jc    b1
+    0x14,               // inr   d
+    // b1:
+    0x0f,               // rrc
+    0xd2, 0x1c, 0x01,   // jnc   b2
+    0x1c,               // inr   e
+    // b2:
+    0xa7,               // ana   a
+    0xfa, 0x21, 0x01,   // jm    b3
+    0x24,               // inr   h
+    // b3:
+    0xea, 0x25, 0x01,   // jpe   b4
+    0x2c,               // inr   l
+    // b4:
+    0x7a,               // mov   a, d
+    0xbb,               // cmp   e
+    0xca, 0x2e, 0x01,   // jz    b5
+    0xda, 0x2e, 0x01,   // jc    b5
+    0x15,               // dcr   d
+    // b5:
+    0xf2, 0x32, 0x01,   // jp    b6
+    0x14,               // inr   d
+    // b6:
+    0xe2, 0x38, 0x01,   // jpo   b7
+    0xc3, 0x39, 0x01,   // jmp   b8
+    // b7:
+    0x1d,               // dcr   e
+    // b8:
+    0x0b,               // dcx   b
+    0x78,               // mov   a, b
+    0xb1,               // ora   c
+    0xc2, 0x11, 0x01,   // jnz   loop
+    0x21, 0x49, 0x01,   // lxi   h, count
+    0x35,               // dcr   m
+    0xc2, 0x08, 0x01,   // jnz   outer
+    0xc3, 0x00, 0x00,   // jmp   0
+    // count:
+    0x00,               // db    0
+};
+
+static const i8080_word_t STACK_KERNEL[] = {
+    0x31, 0x00, 0xf0,   // lxi   sp, 0f000h
+    0x3e, 0x10,         // mvi   a, 10h
+    0x32, 0x2c, 0x01,   // sta   count
+    // outer:
+    0x21, 0x00, 0x10,   // lxi   h, 1000h
+    0x11, 0x00, 0x20,   // lxi   d, 2000h
+    0x01, 0x00, 0x00,   // lxi   b, 0
+    // loop:
+    0xc5,               // push  b
+    0xd5,               // push  d
+    0xe5,               // push  h
+    0xf5,               // push  psw
+    0xcd, 0x2d, 0x01,   // call  sub1
+    0xf1,               // pop   psw
+    0xe1,               // pop   h
+    0xd1,               // pop   d
+    0xc1,               // pop   b
+    0x0b,               // dcx   b
+    0x78,               // mov   a, b
+    0xb1,               // ora   c
+    0xc2, 0x11, 0x01,   // jnz   loop
+    0x21, 0x2c, 0x01,   // lxi   h, count
+    0x35,               // dcr   m
+    0xc2, 0x08, 0x01,   // jnz   outer
+    0xc3, 0x00, 0x00,   // jmp   0
+    // count:
+    0x00,               // db    0
+    // sub1:
+    0xe5,               // push  h
+    0xcd, 0x35, 0x01,   // call  sub2
+    0xe1,               // pop   h
+    0xe3,               // xthl
+    0xe3,               // xthl
+    0xc9,               // ret
+    // sub2:
+    0x21, 0x00, 0x00,   // lxi   h, 0
+    0x39,               // dad   sp
+    0xf9,               // sphl
+    0xc9,               // ret
+};
+
+// Ports 0x10-0x12 go through the port table, and
+// 0x20-0x21 fall back to io_read and io_write.
+static const i8080_word_t IO_KERNEL[] = {
+    0x31, 0x00, 0xf0,   // lxi   sp, 0f000h
+    0x3e, 0x18,         // mvi   a, 18h
+    0x32, 0x37, 0x01,   // sta   count
+    // outer:
+    0x21, 0x00, 0x10,   // lxi   h, 1000h
+    0x11, 0x00, 0x20,   // lxi   d, 2000h
+    0x01, 0x00, 0x00,   // lxi   b, 0
+    // loop:
+    0xdb, 0x10,         // in    10h
+    0xd3, 0x11,         // out   11h
+    0xdb, 0x12,         // in    12h
+    0xee, 0x01,         // xri   01h
+    0xd3, 0x10,         // out   10h
+    0xdb, 0x11,         // in    11h
+    0xd3, 0x12,         // out   12h
+    0xdb, 0x20,         // in    20h
+    0xd3, 0x21,         // out   21h
+    0xdb, 0x10,         // in    10h
+    0xd3, 0x11,         // out   11h
+    0x0b,               // dcx   b
+    0x78,               // mov   a, b
+    0xb1,               // ora   c
+    0xc2, 0x11, 0x01,   // jnz   loop
+    0x21, 0x37, 0x01,   // lxi   h, count
+    0x35,               // dcr   m
+    0xc2, 0x08, 0x01,   // jnz   outer
+    0xc3, 0x00, 0x00,   // jmp   0
+    // count:
+    0x00,               // db    0
+};
+
+#define KERNEL(k) nullptr, k, sizeof(k) / sizeof(k[0])
+
+static const workload WORKLOADS[] = {
+    { "tst8080", "TST8080.COM", nullptr, 0, "Microcosm 8080 diagnostic",
+        4894ull, 0xcd25ba0bul },
+    { "8080pre", "8080PRE.COM", nullptr, 0, "8080 preliminary exerciser",
+        7797ull, 0xe88e962ful },
+    { "cputest", "CPUTEST.COM", nullptr, 0, "SuperSoft CPU test",
+        255651553ull, 0xc43e2d86ul },
+    { "8080exm", "8080EXM.COM", nullptr, 0, "8080 instruction exerciser",
+        23803378391ull, 0x19b5d416ul },
+    { "alu", KERNEL(ALU_KERNEL), "arithmetic, logic and rotates on registers",
+        121111288ull, 0 },
+    { "mem", KERNEL(MEM_KERNEL), "MOV r,M, MOV M,r, LDAX and STAX",
+        242222536ull, 0 },
+    { "branch", KERNEL(BRANCH_KERNEL), "conditional jumps",
+        196609140ull, 0 },
+    { "stack", KERNEL(STACK_KERNEL), "PUSH, POP, CALL, RET and XTHL",
+        255853544ull, 0 },
+    { "io", KERNEL(IO_KERNEL), "IN and OUT",
+        206046664ull, 0 }
+};
+
+static constexpr i8080_addr_t LOAD_ADDR = 0x100;
+static constexpr i8080_addr_t BDOS = 0x0005;
+
+static machine& mach(const i8080* cpu)
+{
+    return *static_cast<machine*>(cpu->udata);
+}
+
+static i8080_word_t mem_read(const i8080* cpu, i8080_addr_t addr) noexcept
+{
+    return mach(cpu).mem[addr];
+}
+
+static void mem_write(const i8080* cpu, i8080_addr_t addr, i8080_word_t word) noexcept
+{
+    mach(cpu).mem[addr] = word;
+}
+
+static i8080_word_t io_read(const i8080* cpu, i8080_word_t port) noexcept
+{
+    return mach(cpu).io[port];
+}
+
+static void io_write(const i8080* cpu, i8080_word_t port, i8080_word_t word) noexcept
+{
+    mach(cpu).io[port] = word;
+}
+
+static i8080_word_t port_in(void* ctx, const i8080*, i8080_word_t port) noexcept
+{
+    return static_cast<machine*>(ctx)->io[port];
+}
+
+static void port_out(void* ctx, const i8080*, i8080_word_t port, i8080_word_t word) noexcept
+{
+    static_cast<machine*>(ctx)->io[port] = word;
+}
+
+static i8080_word_t intr_read(const i8080*) noexcept { return i8080_NOP; }
+
+static void quit(machine& m, const char* err)
+{
+    m.done = true;
+    m.err = err;
+    i8080_stop(&m.cpu);
+}
+
+// FNV-1a
+static void put(machine& m, i8080_word_t c)
+{
+    m.out_bytes++;
+    m.out_hash = ((m.out_hash ^ c) * 16777619ul) & 0xfffffffful;
+}
+
+static int wboot(void* ctx, i8080*) noexcept
+{
+    quit(*static_cast<machine*>(ctx), nullptr);
+    return 0;
+}
+
+static int bdos(void* ctx, i8080* cpu) noexcept
+{
+    machine& m = *static_cast<machine*>(ctx);
+    switch (cpu->c)
+    {
+    case 2: // print char
+        put(m, cpu->e);
+        break;
+
+    case 9: // print $-terminated string
+    {
+        i8080_addr_t ptr = i8080_addr_t((cpu->d << 8) | cpu->e);
+        while (m.mem[ptr] != '$')
+            put(m, m.mem[ptr++]);
+        break;
+    }
+    default:
+        quit(m, "unimplemented BDOS call");
+        return 0;
+    }
+    i8080_return(cpu);
+    return 0;
+}
+
+static int debugger(void* ctx, i8080*) noexcept
+{
+    quit(*static_cast<machine*>(ctx), "program called debugger");
+    return 0;
+}
+
+static void jmp(machine& m, i8080_addr_t at, i8080_addr_t to)
+{
+    m.mem[at] = i8080_JMP;
+    m.mem[at + 1] = i8080_word_t(to & 0xff);
+    m.mem[at + 2] = i8080_word_t(to >> 8);
+}
+
+static void setup(machine& m, const std::vector<i8080_word_t>& image)
+{
+    std::memset(&m.cpu, 0, sizeof(m.cpu));
+    m.cpu.mem_read = mem_read;
+    m.cpu.mem_write = mem_write;
+    m.cpu.io_read = io_read;
+    m.cpu.io_write = io_write;
+    m.cpu.intr_read = intr_read;
+    m.cpu.udata = &m;
+
+    for (auto& port : m.ports)
+        port = i8080_port();
+    for (unsigned port = 0x10; port <= 0x12; ++port)
+        m.ports[port] = { port_in, port_out, &m };
+    m.cpu.ports = m.ports;
+    std::memset(m.io, 0, sizeof(m.io));
+
+    std::memset(m.mem, i8080_RST_7, sizeof(m.mem));
+    jmp(m, 0x0000, 0x0000);
+    jmp(m, BDOS, BDOS);
+    std::memcpy(m.mem + LOAD_ADDR, image.data(), image.size());
+
+    i8080_traps_init(&m.traps);
+    i8080_trap_set(&m.traps, 0x0000, wboot, &m);
+    i8080_trap_set(&m.traps, BDOS, bdos, &m);
+    i8080_trap_set(&m.traps, 0x0038, debugger, &m);
+    m.cpu.traps = &m.traps;
+
+    m.done = false;
+    m.err = nullptr;
+    m.out_bytes = 0;
+    m.out_hash = 2166136261ul;
+
+    i8080_reset(&m.cpu);
+    m.cpu.pc = LOAD_ADDR;
+}
+
+static bool load(const std::string& path, std::vector<i8080_word_t>& image)
+{
+    std::FILE* fs = std::fopen(path.c_str(), "rb");
+    if (!fs) {
+        std::fprintf(stderr, "i8080bench: could not open %s\n", path.c_str());
+        return false;
+    }
+    image.clear();
+    int c;
+    while ((c = std::fgetc(fs)) != EOF && image.size() <= 65536u - LOAD_ADDR)
+        image.push_back(i8080_word_t(c));
+    bool ok = !std::ferror(fs);
+    std::fclose(fs);
+    if (!ok || image.size() > 65536u - LOAD_ADDR) {
+        std::fprintf(stderr, "i8080bench: could not load %s\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Returns true if the program ran to its warm boot.
+static bool finished(const machine& m, int err, const char* name)
+{
+    if (m.err || (err && err != i8080_ESTOP) || !m.done) {
+        std::fprintf(stderr, "i8080bench: %s: %s at 0x%04x\n", name,
+            m.err ? m.err : err ? "emulator error" : "halted", m.cpu.pc);
+        return false;
+    }
+    return true;
+}
+
+// Counts instructions by stepping, and warms up the caches
+// and branch predictors for the timed runs.
+static bool count_run(machine& m, const workload& w,
+    const std::vector<i8080_word_t>& image, result& res)
+{
+    setup(m, image);
+    unsigned long long insns = 0;
+    int err = 0;
+    while (!m.done && !m.cpu.halt)
+    {
+        err = i8080_step(&m.cpu);
+        if (err) break;
+        insns++;
+    }
+    if (!finished(m, err, w.name))
+        return false;
+
+    res.insns = insns;
+    res.cycles = m.cpu.cycles;
+    res.out_bytes = m.out_bytes;
+    res.out_hash = m.out_hash;
+    return true;
+}
+
+static bool timed_run(machine& m, const workload& w,
+    const std::vector<i8080_word_t>& image, result& res)
+{
+    setup(m, image);
+    auto start = std::chrono::steady_clock::now();
+    int err = i8080_run(&m.cpu, i8080_cycles_t(-1));
+    auto end = std::chrono::steady_clock::now();
+    if (!finished(m, err, w.name))
+        return false;
+
+    if (m.cpu.cycles != res.cycles || m.out_hash != res.out_hash) {
+        std::fprintf(stderr, "i8080bench: %s: runs differ\n", w.name);
+        return false;
+    }
+    res.seconds.push_back(std::chrono::duration<double>(end - start).count());
+    return true;
+}
+
+// Returns true if the workload ran as it always has.
+static bool check_emulation(const workload& w, const result& res)
+{
+    bool ok = true;
+    if (res.cycles != w.cycles) {
+        std::fprintf(stderr, "i8080bench: %s: took %llu cycles, expected %llu\n",
+            w.name, res.cycles, w.cycles);
+        ok = false;
+    }
+    if (w.file && res.out_hash != w.out_hash) {
+        std::fprintf(stderr, "i8080bench: %s: console output changed "
+            "(hash %08lx, expected %08lx)\n", w.name, res.out_hash, w.out_hash);
+        ok = false;
+    }
+    return ok;
+}
+
+static stats get_stats(const std::vector<double>& v)
+{
+    stats s = { 0, 0, v[0], v[0] };
+    for (double x : v)
+    {
+        s.mean += x;
+        if (x < s.min) s.min = x;
+        if (x > s.max) s.max = x;
+    }
+    s.mean /= v.size();
+    for (double x : v)
+        s.stddev += (x - s.mean) * (x - s.mean);
+    if (v.size() > 1)
+        s.stddev = std::sqrt(s.stddev / (v.size() - 1));
+    return s;
+}
+
+// Best of the runs; the others were slowed down by
+// something else on the machine.
+static double best_mips(const result& res)
+{
+    double best = 0;
+    for (double sec : res.seconds)
+        if (res.insns / sec / 1e6 > best)
+            best = res.insns / sec / 1e6;
+    return best;
+}
+
+static void put_stats(std::FILE* fs, const char* key, const std::vector<double>& v)
+{
+    stats s = get_stats(v);
+    std::fprintf(fs, ",\n      \"%s\": { \"mean\": %.4f, \"stddev\": %.4f, "
+        "\"min\": %.4f, \"max\": %.4f }", key, s.mean, s.stddev, s.min, s.max);
+}
+
+static void put_result(std::FILE* fs, const workload& w, const result& res)
+{
+    std::vector<double> mhz, mips, ns;
+    for (double sec : res.seconds)
+    {
+        mhz.push_back(res.cycles / sec / 1e6);
+        mips.push_back(res.insns / sec / 1e6);
+        ns.push_back(sec * 1e9 / res.insns);
+    }
+
+    std::fprintf(fs, "    {\n      \"name\": \"%s\",\n      \"kind\": \"%s\",\n",
+        w.name, w.file ? "binary" : "kernel");
+    std::fprintf(fs, "      \"instructions\": %llu,\n      \"cycles\": %llu,\n",
+        res.insns, res.cycles);
+    if (w.file)
+        std::fprintf(fs, "      \"output_bytes\": %lu,\n      \"output_hash\": \"%08lx\",\n",
+            res.out_bytes, res.out_hash);
+    std::fprintf(fs, "      \"seconds\": [");
+    for (std::size_t i = 0; i < res.seconds.size(); ++i)
+        std::fprintf(fs, "%s%.6f", i ? ", " : " ", res.seconds[i]);
+    std::fprintf(fs, " ]");
+    if (!res.seconds.empty())
+    {
+        put_stats(fs, "mhz", mhz);
+        put_stats(fs, "mips", mips);
+        put_stats(fs, "ns_per_instr", ns);
+    }
+    std::fprintf(fs, "\n    }");
+}
+
+static bool write_results(const char* path, unsigned runs,
+    const std::vector<const workload*>& todo, const std::vector<result>& results)
+{
+    std::FILE* fs = path ? std::fopen(path, "w") : stdout;
+    if (!fs) {
+        std::fprintf(stderr, "i8080bench: could not open %s\n", path);
+        return false;
+    }
+    std::fprintf(fs, "{\n  \"version\": 1,\n  \"build\": { \"profile\": %s, \"trace\": %s },\n",
+#ifdef I8080_PROFILE
+        "true",
+#else
+        "false",
+#endif
+#ifdef I8080_TRACE
+        "true"
+#else
+        "false"
+#endif
+    );
+    std::fprintf(fs, "  \"runs\": %u,\n  \"workloads\": [\n", runs);
+    for (std::size_t i = 0; i < todo.size(); ++i)
+    {
+        put_result(fs, *todo[i], results[i]);
+        std::fputs(i + 1 < todo.size() ? ",\n" : "\n", fs);
+    }
+    std::fputs("  ]\n}\n", fs);
+
+    bool ok = !std::ferror(fs);
+    if (path && std::fclose(fs) != 0)
+        ok = false;
+    if (!ok)
+        std::fprintf(stderr, "i8080bench: could not write %s\n", path ? path : "results");
+    return ok;
+}
+
+// Best MIPS of workload name in baseline, the JSON written
+// by an earlier run. Returns 0 if it is not there.
+static double baseline_mips(const std::string& baseline, const char* name)
+{
+    std::string key = std::string("\"name\": \"") + name + "\"";
+    std::size_t pos = baseline.find(key);
+    if (pos == std::string::npos)
+        return 0;
+    std::size_t next = baseline.find("\"name\": ", pos + key.size());
+    pos = baseline.find("\"mips\": {", pos);
+    if (pos == std::string::npos || pos > next)
+        return 0;
+    pos = baseline.find("\"max\": ", pos);
+    if (pos == std::string::npos || pos > next)
+        return 0;
+    return std::strtod(baseline.c_str() + pos + 7, nullptr);
+}
+
+static bool read_file(const char* path, std::string& text)
+{
+    std::FILE* fs = std::fopen(path, "rb");
+    if (!fs)
+        return false;
+    char buf[4096];
+    std::size_t n;
+    text.clear();
+    while ((n = std::fread(buf, 1, sizeof(buf), fs)) > 0)
+        text.append(buf, n);
+    bool ok = !std::ferror(fs);
+    std::fclose(fs);
+    return ok;
+}
+
+// Compare the best MIPS of each workload with the baseline.
+// Returns true if none is slower by more than tolerance percent.
+static bool check_baseline(const std::string& baseline, const char* path, double tolerance,
+    const std::vector<const workload*>& todo, const std::vector<result>& results)
+{
+    bool ok = true;
+    std::fprintf(stderr, "Throughput against %s (best of runs, tolerance %.1f%%):\n",
+        path, tolerance);
+    std::fprintf(stderr, "  %-10s %10s %10s %8s\n", "Workload", "MIPS", "Baseline", "Change");
+    for (std::size_t i = 0; i < todo.size(); ++i)
+    {
+        const char* name = todo[i]->name;
+        double mips = best_mips(results[i]);
+        double base = baseline_mips(baseline, name);
+        if (base <= 0) {
+            std::fprintf(stderr, "  %-10s %10.2f %10s %8s  not in baseline\n",
+                name, mips, "-", "-");
+            continue;
+        }
+        double change = 100.0 * (mips - base) / base;
+        bool slow = change < -tolerance;
+        std::fprintf(stderr, "  %-10s %10.2f %10.2f %+7.1f%%  %s\n",
+            name, mips, base, change, slow ? "REGRESSED" : "ok");
+        if (slow) ok = false;
+    }
+    return ok;
+}
+
+static const workload* find(const char* name)
+{
+    for (const auto& w : WORKLOADS)
+        if (std::strcmp(w.name, name) == 0)
+            return &w;
+    return nullptr;
+}
+
+static void usage(void)
+{
+    std::fputs("Usage: i8080bench [-n <runs>] [-d <dir>] [-o <file>]\n"
+        "                  [-b <baseline> [-t <percent>]] [-w <workload>]...\n"
+        "       i8080bench -l\n"
+        "Run each workload (all by default) runs times, and print the\n"
+        "emulated MHz, MIPS and ns per instruction as JSON. Fails if a\n"
+        "workload's cycle count or console output has changed.\n"
+        "  -n <runs>      Timed runs per workload, after one untimed run\n"
+        "                 that counts instructions. 0 only checks the\n"
+        "                 emulation. (default: 5)\n"
+        "  -d <dir>       Directory of the test binaries. (default: testbin)\n"
+        "  -o <file>      Write the results to file instead of stdout.\n"
+        "  -b <baseline>  Compare the best MIPS of each workload with the\n"
+        "                 results in this file, from an earlier -o, and fail\n"
+        "                 if it is lower. Results are only written with -o.\n"
+        "                 Exits with 77 if the file does not exist.\n"
+        "  -t <percent>   Allowed drop in MIPS from the baseline. (default: 10)\n"
+        "  -w <workload>  Run this workload. Can be repeated.\n"
+        "  -l             List the workloads.\n", stderr);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned runs = 5;
+    std::string dir = "testbin";
+    const char* outpath = nullptr;
+    const char* basepath = nullptr;
+    double tolerance = 10;
+    std::vector<const workload*> todo;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            char* end;
+            unsigned long n = std::strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || n > 1000) {
+                usage();
+                return EXIT_FAILURE;
+            }
+            runs = unsigned(n);
+        }
+        else if (std::strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            dir = argv[++i];
+        else if (std::strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            outpath = argv[++i];
+        else if (std::strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            basepath = argv[++i];
+        else if (std::strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            char* end;
+            tolerance = std::strtod(argv[++i], &end);
+            if (*end != '\0' || !(tolerance >= 0 && tolerance < 100)) {
+                usage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (std::strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+        {
+            const workload* w = find(argv[++i]);
+            if (!w) {
+                std::fprintf(stderr, "i8080bench: unknown workload %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            todo.push_back(w);
+        }
+        else if (std::strcmp(argv[i], "-l") == 0)
+        {
+            for (const auto& w : WORKLOADS)
+                std::printf("%-10s%s\n", w.name, w.desc);
+            return EXIT_SUCCESS;
+        }
+        else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (basepath && runs == 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    if (todo.empty())
+        for (const auto& w : WORKLOADS)
+            todo.push_back(&w);
+
+    // read first, so a missing baseline is reported quickly
+    std::string baseline;
+    if (basepath && !read_file(basepath, baseline)) {
+        std::fprintf(stderr, "i8080bench: no baseline %s, skipping.\n"
+            "Write one with: i8080bench -o %s\n", basepath, basepath);
+        return 77; // CTest SKIP_RETURN_CODE
+    }
+
+    bool ok = true;
+    std::vector<i8080_word_t> image;
+    std::vector<result> results(todo.size());
+    std::unique_ptr<machine> m(new machine);
+    for (std::size_t i = 0; i < todo.size(); ++i)
+    {
+        const workload& w = *todo[i];
+        if (w.file) {
+            if (!load(dir + "/" + w.file, image))
+                return EXIT_FAILURE;
+        }
+        else image.assign(w.code, w.code + w.size);
+
+        if (!count_run(*m, w, image, results[i]))
+            return EXIT_FAILURE;
+        if (!check_emulation(w, results[i]))
+            ok = false;
+        for (unsigned r = 0; r < runs; ++r)
+            if (!timed_run(*m, w, image, results[i]))
+                return EXIT_FAILURE;
+    }
+
+    if ((!basepath || outpath) && !write_results(outpath, runs, todo, results))
+        return EXIT_FAILURE;
+    if (basepath && !check_baseline(baseline, basepath, tolerance, todo, results))
+        ok = false;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
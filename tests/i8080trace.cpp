@@ -0,0 +1,190 @@
+// Decodes binary execution traces written by i8080emu --trace
+// or --trace-last. See trace.hpp for the format.
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstdarg>
+#include <vector>
+
+#include "i8080/i8080.h"
+#include "symbols.hpp"
+#include "trace.hpp"
+#include "emu.hpp"
+
+// Record field offsets, as in i8080_trace_rec.
+enum
+{
+    REC_PC = 0,
+    REC_SP = 2,
+    REC_OP = 4,
+    REC_LEN = 7,
+    REC_A = 8,
+    REC_FLAGS = 9,
+    REC_CYCLES = 12,
+    REC_MIN_SIZE = 16
+};
+
+// For symbols.cpp.
+void emu_vprinterr(const char* format, std::va_list vlist) noexcept
+{
+    std::fputs("i8080trace: ", stderr);
+    std::vfprintf(stderr, format, vlist);
+    std::fputc('\n', stderr);
+}
+
+void emu_printerr(const char* format, ...) noexcept
+{
+    std::va_list args;
+    va_start(args, format);
+    emu_vprinterr(format, args);
+    va_end(args);
+}
+
+static unsigned read16(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned long read32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+// Formatting by hand; printf() would dominate decoding.
+static char* put_hex(char* out, unsigned val, int digits)
+{
+    static const char HEX[] = "0123456789abcdef";
+    for (int i = digits - 1; i >= 0; --i)
+        out[i] = HEX[val & 0xf], val >>= 4;
+    return out + digits;
+}
+
+// Right-aligned in width columns.
+static char* put_dec(char* out, unsigned long long val, int width)
+{
+    char tmp[24];
+    int n = 0;
+    do {
+        tmp[n++] = char('0' + val % 10);
+        val /= 10;
+    } while (val != 0);
+    for (int i = n; i < width; ++i)
+        *out++ = ' ';
+    while (n > 0)
+        *out++ = tmp[--n];
+    return out;
+}
+
+static char* put_str(char* out, const char* s)
+{
+    while (*s)
+        *out++ = *s++;
+    return out;
+}
+
+static void usage(void)
+{
+    std::fputs("Usage: i8080trace [-s <symbols>] <trace>\n"
+        "Print a binary execution trace, one instruction per line:\n"
+        "cycles before the instruction, registers, address and instruction,\n"
+        "and with -s, the symbol it is in.\n", stderr);
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = nullptr;
+    const char* symfile = nullptr;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            symfile = argv[++i];
+        else if (argv[i][0] != '-' && !path)
+            path = argv[i];
+        else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (!path) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    symtab syms;
+    if (symfile && !symtab_load(syms, symfile))
+        return EXIT_FAILURE;
+
+    std::FILE* fs = std::fopen(path, "rb");
+    if (!fs) {
+        std::fprintf(stderr, "i8080trace: could not open %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    unsigned char hdr[TRACE_HEADER_SIZE];
+    if (std::fread(hdr, 1, sizeof(hdr), fs) != sizeof(hdr) ||
+        std::memcmp(hdr, TRACE_MAGIC, 8) != 0 ||
+        read16(hdr + 8) != TRACE_VERSION) {
+        std::fprintf(stderr, "i8080trace: %s is not a trace\n", path);
+        std::fclose(fs);
+        return EXIT_FAILURE;
+    }
+    // newer writers may append fields
+    unsigned recsize = read16(hdr + 10);
+    if (recsize < REC_MIN_SIZE) {
+        std::fprintf(stderr, "i8080trace: bad record size in %s\n", path);
+        std::fclose(fs);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<unsigned char> rec(recsize);
+    unsigned long long cycles = 0;
+    unsigned long prev = 0;
+    bool first = true;
+
+    while (std::fread(rec.data(), 1, recsize, fs) == recsize)
+    {
+        i8080_addr_t pc = read16(&rec[REC_PC]);
+
+        // records keep the low 32 bits of the cycle count
+        unsigned long low = read32(&rec[REC_CYCLES]);
+        if (first)
+            cycles = low;
+        else
+            cycles += (low - prev) & 0xfffffffful;
+        prev = low;
+        first = false;
+
+        // "%12llu  a=%02x f=%02x sp=%04x  0x%04x\t<instruction>"
+        char line[128];
+        char* p = put_dec(line, cycles, 12);
+        p = put_hex(put_str(p, "  a="), rec[REC_A], 2);
+        p = put_hex(put_str(p, " f="), rec[REC_FLAGS], 2);
+        p = put_hex(put_str(p, " sp="), read16(&rec[REC_SP]), 4);
+        p = put_hex(put_str(p, "  0x"), pc, 4);
+        *p++ = '\t';
+
+        const i8080_word_t op[3] = { rec[REC_OP], rec[REC_OP + 1], rec[REC_OP + 2] };
+        if (i8080_disasm(op, rec[REC_LEN], p, line + sizeof(line) - p))
+            while (*p) ++p;
+        else
+            *p++ = '?';
+
+        if (!syms.syms.empty())
+        {
+            std::string name = symtab_name(syms, pc);
+            p = put_str(p, "\t; ");
+            p = put_str(p, name.substr(0, line + sizeof(line) - p - 2).c_str());
+        }
+        *p++ = '\n';
+        std::fwrite(line, 1, p - line, stdout);
+    }
+
+    bool ok = !std::ferror(fs);
+    std::fclose(fs);
+    if (!ok) {
+        std::fprintf(stderr, "i8080trace: could not read %s\n", path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
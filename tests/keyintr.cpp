@@ -1,5 +1,16 @@
+#if defined(__linux__)
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <cstdint>
+#include <thread>
+#include <system_error>
+#define EMU_USING_LINUX_KEYINTR 1
 
-#if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#elif defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
 // any value above 200112L is okay
 #define _POSIX_C_SOURCE 200809L
 #include <unistd.h>
@@ -56,23 +67,195 @@ static void fatal(const char* format, ...) noexcept
     std::abort();
 }
 
-#if defined(EMU_USING_POSIX_KEYINTR)
+// CPU receiving interrupts, and the opcode to post.
+static i8080* keyintr_cpu = nullptr;
+static i8080_word_t keyintr_opcode;
+
+#if defined(EMU_USING_LINUX_KEYINTR)
 static const int keyintr_sigs[] = { SIGINT, SIGTSTP };
 #define NUM_KEYINTR_SIGS 2
+#define MAX_KEYINTR_WATCHES 16
+
+// Signals are blocked and read from a signalfd by a listener
+// thread, which posts them to the CPU. The halted CPU blocks
+// on an epoll set holding the wake eventfd and device fds.
+static sigset_t keyintr_mask;
+static sigset_t keyintr_old_mask;
+
+static int wake_fd = -1;    // written by cpu->wake
+static int halt_epfd = -1;  // halted CPU waits on this
+static int sig_fd = -1;
+static int stop_fd = -1;    // stops the listener
+static int listen_epfd = -1;
+static std::thread listener;
+
+struct keyintr_watch_t
+{
+    int fd;
+    void(*ready)(int fd, void* ctx);
+    void* ctx;
+};
+static keyintr_watch_t keyintr_watches[MAX_KEYINTR_WATCHES];
+static constexpr std::uint32_t wake_id = MAX_KEYINTR_WATCHES;
+static constexpr std::uint32_t sig_id = 0;
+static constexpr std::uint32_t stop_id = 1;
+
+static bool epoll_add(int epfd, int fd, std::uint32_t id)
+{
+    ::epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    ev.data.u32 = id;
+    return ::epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != -1;
+}
 
-static sem_t keyintr_sem;
-static struct sigaction keyintr_sa;
+static void close_fd(int& fd)
+{
+    if (fd != -1 && ::close(fd) == -1)
+        fatal("close errno %d", errno);
+    fd = -1;
+}
 
-static bool signals(const int* sigs, int nsigs, void(*handler)(int))
+// signal-safe
+static void keyintr_wake(const i8080*) noexcept
 {
-    for (int i = 0; i < nsigs; ++i)
-        if (::signal(sigs[i], handler) == SIG_ERR)
+    std::uint64_t one = 1;
+    // fails only if the counter would overflow,
+    // in which case a wakeup is already pending
+    ::ssize_t n = ::write(wake_fd, &one, sizeof(one));
+    (void)n;
+}
+
+static void drain_sigs(void)
+{
+    ::signalfd_siginfo info[NUM_KEYINTR_SIGS * 4];
+    while (::read(sig_fd, info, sizeof(info)) > 0);
+}
+
+static void keyintr_listen(void) noexcept
+{
+    while (true)
+    {
+        ::epoll_event evs[2];
+        int n = ::epoll_wait(listen_epfd, evs, 2, -1);
+        if (n == -1)
+        {
+            if (errno == EINTR) continue;
+            fatal("epoll_wait errno %d", errno);
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            if (evs[i].data.u32 == stop_id)
+                return;
+
+            drain_sigs();
+            i8080_interrupt_async(keyintr_cpu, keyintr_opcode);
+        }
+    }
+}
+
+static void listener_close(void)
+{
+    close_fd(listen_epfd);
+    close_fd(stop_fd);
+    if (sig_fd != -1)
+    {
+        drain_sigs();
+        close_fd(sig_fd);
+    }
+    if (::pthread_sigmask(SIG_SETMASK, &keyintr_old_mask, NULL) != 0)
+        fatal("pthread_sigmask revert");
+}
+
+// Must be called before any other threads are started,
+// so that all threads inherit the blocked signals.
+static bool listener_open(void)
+{
+    if (::pthread_sigmask(SIG_BLOCK, &keyintr_mask, &keyintr_old_mask) != 0)
+        return false;
+
+    sig_fd = ::signalfd(-1, &keyintr_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    stop_fd = ::eventfd(0, EFD_CLOEXEC);
+    listen_epfd = ::epoll_create1(EPOLL_CLOEXEC);
+
+    if (sig_fd == -1 || stop_fd == -1 || listen_epfd == -1 ||
+        !epoll_add(listen_epfd, sig_fd, sig_id) ||
+        !epoll_add(listen_epfd, stop_fd, stop_id))
+    {
+        listener_close();
+        return false;
+    }
+    return true;
+}
+
+bool keyintr_wait(void)
+{
+    ::epoll_event evs[MAX_KEYINTR_WATCHES + 1];
+    int n;
+    while ((n = ::epoll_wait(halt_epfd, evs, MAX_KEYINTR_WATCHES + 1, -1)) == -1)
+        if (errno != EINTR)
             return false;
+
+    for (int i = 0; i < n; ++i)
+    {
+        std::uint32_t id = evs[i].data.u32;
+        if (id == wake_id)
+        {
+            std::uint64_t count;
+            if (::read(wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                fatal("eventfd read errno %d", errno);
+        }
+        else {
+            auto& w = keyintr_watches[id];
+            if (w.ready) w.ready(w.fd, w.ctx);
+        }
+    }
     return true;
 }
 
+bool keyintr_watch(int fd, void(*ready)(int fd, void* ctx), void* ctx)
+{
+    assert(keyintr_initlzd);
+
+    for (std::uint32_t i = 0; i < MAX_KEYINTR_WATCHES; ++i)
+    {
+        auto& w = keyintr_watches[i];
+        if (!w.ready)
+        {
+            if (!epoll_add(halt_epfd, fd, i))
+                return false;
+            w.fd = fd;
+            w.ready = ready;
+            w.ctx = ctx;
+            return true;
+        }
+    }
+    return false;
+}
+
+void keyintr_unwatch(int fd)
+{
+    for (auto& w : keyintr_watches)
+    {
+        if (w.ready && w.fd == fd)
+        {
+            if (::epoll_ctl(halt_epfd, EPOLL_CTL_DEL, fd, NULL) == -1)
+                fatal("epoll_ctl del errno %d", errno);
+            w.ready = nullptr;
+        }
+    }
+}
+
+#elif defined(EMU_USING_POSIX_KEYINTR)
+static const int keyintr_sigs[] = { SIGINT, SIGTSTP };
+#define NUM_KEYINTR_SIGS 2
+
+static sem_t keyintr_sem;
+static struct sigaction keyintr_sa;
+static struct sigaction keyintr_old_sas[NUM_KEYINTR_SIGS];
+
 // On failure, all handlers are reverted.
-static bool sigactions(const int* sigs, int nsigs, 
+static bool sigactions(const int* sigs, int nsigs,
     struct sigaction* sa, struct sigaction* old_sas)
 {
     for (int i = 0; i < nsigs; ++i)
@@ -88,101 +271,74 @@ static bool sigactions(const int* sigs, int nsigs,
     return true;
 }
 
-// Silently fails if a thread is already waiting.
-static void sem_reset(sem_t* sem)
+// signal-safe
+static void keyintr_wake(const i8080*) noexcept
 {
-    while (true)
-    {
-        int value;
-        if (::sem_getvalue(sem, &value) == -1)
-            fatal("sem_getvalue errno %d", errno);
-
-        if (value == 0)
-            break;
-        else
-        {
-            errno = 0;
-            while (::sem_trywait(sem) == -1 && errno == EINTR)
-                errno = 0;
-            if (!(errno == 0 || errno == EAGAIN))
-                fatal("sem_trywait errno %d", errno);
-        }
-    }
+    if (::sem_post(&keyintr_sem) == -1)
+        safe_fatal("sem_post");
 }
 
 extern "C" void keyintr_handler(int sig) noexcept
 {
     (void)sig;
-    if (!signals(keyintr_sigs, NUM_KEYINTR_SIGS, SIG_IGN))
-        safe_fatal("signals SIG_IGN");
-
-    if (::sem_post(&keyintr_sem) == -1)
-        safe_fatal("sem_post");
+    i8080_interrupt_async(keyintr_cpu, keyintr_opcode);
 }
 
+// Spurious wakeups are possible, as the
+// semaphore counts every posted interrupt.
 bool keyintr_wait(void)
 {
-    struct sigaction old_sas[NUM_KEYINTR_SIGS];
-    if (!sigactions(keyintr_sigs, NUM_KEYINTR_SIGS, &keyintr_sa, old_sas)) {
-        sem_reset(&keyintr_sem);
-        return false;
-    }
     errno = 0;
     while (::sem_wait(&keyintr_sem) == -1 && errno == EINTR)
         errno = 0;
     if (errno)
         fatal("sem_wait errno %d", errno);
-
-    // just in case, as there can be a race between
-    // signal types before all are set to SIG_IGN
-    sem_reset(&keyintr_sem);
     return true;
 }
 
 #elif defined(EMU_USING_WIN32_KEYINTR)
 static HANDLE keyintr_sem;
 
+// runs on a new thread
 static BOOL WINAPI keyintr_handler(DWORD event) noexcept
 {
     if (event == CTRL_C_EVENT)
     {
-        if (!SetConsoleCtrlHandler(NULL, TRUE))
-            fatal("win32 disable Ctrl+C error %d", GetLastError());
-
-        if (!ReleaseSemaphore(keyintr_sem, 1, NULL))
-            fatal("ReleaseSemaphore error %d", GetLastError());
+        i8080_interrupt_async(keyintr_cpu, keyintr_opcode);
         return TRUE;
     }
     else return FALSE;
 }
 
-bool keyintr_wait(void)
+static void keyintr_wake(const i8080*) noexcept
 {
-    if (!SetConsoleCtrlHandler(NULL, FALSE)) // enable Ctrl+C
-        return false;
+    // max count is 1, a pending wakeup is enough
+    if (!ReleaseSemaphore(keyintr_sem, 1, NULL) &&
+        GetLastError() != ERROR_TOO_MANY_POSTS)
+        fatal("ReleaseSemaphore error %d", GetLastError());
+}
 
+bool keyintr_wait(void)
+{
     if (WaitForSingleObject(keyintr_sem, INFINITE) != WAIT_OBJECT_0)
         fatal("WaitForSingleObject error %d", GetLastError());
     return true;
 }
 
 #else
-static volatile std::sig_atomic_t keyintr;
-
 extern "C" void keyintr_handler(int sig) noexcept
 {
-    std::signal(sig, SIG_IGN);
-    keyintr = 1;
+    // handler may have been reset to SIG_DFL
+    std::signal(sig, keyintr_handler);
+    i8080_interrupt_async(keyintr_cpu, keyintr_opcode);
 }
 
+static void keyintr_wake(const i8080*) noexcept {}
+
 bool keyintr_wait(void)
 {
-    if (std::signal(SIGINT, keyintr_handler) == SIG_ERR)
-        return false;
-
-    while (keyintr != 1)
+    while (!i8080_interrupt_pending(keyintr_cpu))
         std::this_thread::sleep_for(std::chrono::milliseconds(1));
-    keyintr = 0;
     return true;
 }
 #endif
@@ -194,8 +350,11 @@ static void keyintr_atexit() noexcept
 {
     if (keyintr_initlzd)
     {
-#if defined(EMU_USING_POSIX_KEYINTR)
-        sem_reset(&keyintr_sem);
+#if defined(EMU_USING_LINUX_KEYINTR)
+        close_fd(halt_epfd);
+        close_fd(wake_fd);
+
+#elif defined(EMU_USING_POSIX_KEYINTR)
         if (::sem_destroy(&keyintr_sem) == -1)
             fatal("sem_destroy errno %d", errno);
 
@@ -215,7 +374,24 @@ bool keyintr_init(void)
     if (std::atexit(keyintr_atexit) != 0)
         return false;
 
-#if defined(EMU_USING_POSIX_KEYINTR)
+#if defined(EMU_USING_LINUX_KEYINTR)
+    wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    halt_epfd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (wake_fd == -1 || halt_epfd == -1 ||
+        !epoll_add(halt_epfd, wake_fd, wake_id))
+    {
+        close_fd(halt_epfd);
+        close_fd(wake_fd);
+        return false;
+    }
+
+    if (::sigemptyset(&keyintr_mask) == -1)
+        fatal("sigemptyset errno %d", errno);
+    for (int i = 0; i < NUM_KEYINTR_SIGS; ++i)
+        if (::sigaddset(&keyintr_mask, keyintr_sigs[i]) == -1)
+            fatal("sigaddset errno %d", errno);
+
+#elif defined(EMU_USING_POSIX_KEYINTR)
     if (::sem_init(&keyintr_sem, 0, 0) == -1)
         return false;
 
@@ -238,34 +414,41 @@ bool keyintr_init(void)
     keyintr_sem = CreateSemaphore(NULL, 0, 1, NULL);
     if (!keyintr_sem)
         return false;
-#else
-    keyintr = 0;
 #endif
     keyintr_initlzd = true;
     return true;
 }
 
-bool keyintr_start(void)
+bool keyintr_start(i8080* cpu, i8080_word_t opcode)
 {
     assert(keyintr_initlzd && !keyintr_active);
 
-#if defined(EMU_USING_POSIX_KEYINTR)
-    if (!signals(keyintr_sigs, NUM_KEYINTR_SIGS, SIG_IGN)) {
-        keyintr_end();
+    keyintr_cpu = cpu;
+    keyintr_opcode = opcode;
+    cpu->wake = keyintr_wake;
+
+#if defined(EMU_USING_LINUX_KEYINTR)
+    if (!listener_open())
         return false;
+    try {
+        listener = std::thread(keyintr_listen);
     }
-#elif defined(EMU_USING_WIN32_KEYINTR)
-    if (!SetConsoleCtrlHandler(NULL, TRUE))
+    catch (const std::system_error&) {
+        listener_close();
+        return false;
+    }
+#elif defined(EMU_USING_POSIX_KEYINTR)
+    // handlers stay installed until keyintr_end()
+    if (!sigactions(keyintr_sigs, NUM_KEYINTR_SIGS, &keyintr_sa, keyintr_old_sas))
         return false;
 
-    // add the handler once. resetting the handler after each signal
-    // is not possible as the handler runs on a new thread
-    if (!SetConsoleCtrlHandler(keyintr_handler, TRUE)) {
-        keyintr_end();
+#elif defined(EMU_USING_WIN32_KEYINTR)
+    // the handler runs on a new thread, and
+    // stays installed until keyintr_end()
+    if (!SetConsoleCtrlHandler(keyintr_handler, TRUE))
         return false;
-    }
 #else
-    if (std::signal(SIGINT, SIG_IGN) == SIG_ERR)
+    if (std::signal(SIGINT, keyintr_handler) == SIG_ERR)
         return false;
 #endif
     keyintr_active = true;
@@ -276,19 +459,25 @@ void keyintr_end(void)
 {
     assert(keyintr_initlzd && keyintr_active);
 
-#if defined(EMU_USING_POSIX_KEYINTR)
-    if (!signals(keyintr_sigs, NUM_KEYINTR_SIGS, SIG_DFL))
-        fatal("signals SIG_DFL errno %d", errno);
+#if defined(EMU_USING_LINUX_KEYINTR)
+    std::uint64_t one = 1;
+    if (::write(stop_fd, &one, sizeof(one)) == -1)
+        fatal("eventfd write errno %d", errno);
+    listener.join();
+    listener_close();
+
+#elif defined(EMU_USING_POSIX_KEYINTR)
+    for (int i = 0; i < NUM_KEYINTR_SIGS; ++i)
+        if (::sigaction(keyintr_sigs[i], &keyintr_old_sas[i], NULL) == -1)
+            fatal("sigaction revert errno %d", errno);
 
 #elif defined(EMU_USING_WIN32_KEYINTR)
     if (!SetConsoleCtrlHandler(keyintr_handler, FALSE))
         fatal("win32 remove keyintr_handler error %d", GetLastError());
-
-    if (!SetConsoleCtrlHandler(NULL, FALSE))
-        fatal("win32 enable Ctrl+C error %d", GetLastError());
 #else
     if (std::signal(SIGINT, SIG_DFL) == SIG_ERR)
         fatal("signal SIG_DFL");
 #endif
+    keyintr_cpu->wake = nullptr;
     keyintr_active = false;
 }
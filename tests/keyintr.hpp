@@ -1,20 +1,36 @@
-
 #ifndef KEYINTR_HPP
 #define KEYINTR_HPP
 
+#include "i8080/i8080.h"
+
 extern bool keyintr_initlzd;
 
 // First-time init.
 bool keyintr_init(void);
 
-// Start listening for keyboard interrupts.
-bool keyintr_start(void);
+// Start converting keyboard interrupts into 8080 interrupts.
+// opcode is posted to cpu with i8080_interrupt_async() as
+// soon as an interrupt arrives, whether or not the CPU is
+// halted. Sets cpu->wake.
+bool keyintr_start(i8080* cpu, i8080_word_t opcode);
 
 // Stop listening for keyboard interrupts.
 void keyintr_end(void);
 
-// Wait for a keyboard interrupt.
+// Block until an interrupt is posted to the CPU
+// or a watched fd has been serviced. Call this
+// when the CPU is halted.
 // Returns true on success.
 bool keyintr_wait(void);
 
-#endif
\ No newline at end of file
+#if defined(__linux__)
+// Watch a device fd while the CPU is halted. ready() is
+// called from keyintr_wait() when fd becomes readable, and
+// may post an interrupt with i8080_interrupt_async().
+bool keyintr_watch(int fd, void(*ready)(int fd, void* ctx), void* ctx);
+
+// Stop watching a device fd.
+void keyintr_unwatch(int fd);
+#endif
+
+#endif
@@ -1,11 +1,16 @@
 
 #include <cstdlib>
 #include <cstdarg>
+#include <cctype>
 #include <string>
+#include <vector>
 #include <iostream>
 
 #define CXXOPTS_NO_RTTI
 #include "cxxopts.hpp"
+#include "hle.hpp"
+#include "cfg.hpp"
+#include "symbols.hpp"
 #include "emu.hpp"
 
 static const std::pair<const char*, emu_opts> TESTS[] = 
@@ -26,16 +31,133 @@ static int bail(const char* format, ...) noexcept
     return EXIT_FAILURE;
 }
 
+// Parse an address.
+static bool parse_addr(const std::string& str, i8080_addr_t& addr)
+{
+    char* end;
+    unsigned long val = std::strtoul(str.c_str(), &end, 0);
+    if (str.empty() || *end != '\0' || val > 0xffff)
+        return false;
+    addr = i8080_addr_t(val);
+    return true;
+}
+
+// Parse addr[:r|w|rw].
+static bool parse_watch(const std::string& spec, emu_watch& watch)
+{
+    auto c = spec.find(':');
+    if (!parse_addr(spec.substr(0, c), watch.addr))
+        return false;
+    auto mode = (c == std::string::npos) ? std::string("w") : spec.substr(c + 1);
+    if (mode == "r") watch.flags = I8080_WATCH_READ;
+    else if (mode == "w") watch.flags = I8080_WATCH_WRITE;
+    else if (mode == "rw") watch.flags = I8080_WATCH_READ | I8080_WATCH_WRITE;
+    else return false;
+    return true;
+}
+
+// Parse drive:file[:3740|raw].
+static bool parse_disk(const std::string& spec, emu_disk& disk)
+{
+    if (spec.size() < 3 || spec[1] != ':')
+        return false;
+    char drive = char(std::toupper(static_cast<unsigned char>(spec[0])));
+    if (drive < 'A' || drive > 'P')
+        return false;
+    disk.drive = unsigned(drive - 'A');
+    disk.path = spec.substr(2);
+    disk.format.clear();
+    auto c = disk.path.rfind(':');
+    if (c != std::string::npos)
+    {
+        auto format = disk.path.substr(c + 1);
+        if (format == "3740" || format == "raw")
+        {
+            disk.format = format;
+            disk.path.erase(c);
+        }
+    }
+    return !disk.path.empty();
+}
+
+// Parse addr:routine[:cycles].
+static bool parse_hle(const std::string& spec, emu_hle& hle)
+{
+    auto c1 = spec.find(':');
+    if (c1 == std::string::npos) return false;
+    auto c2 = spec.find(':', c1 + 1);
+
+    if (!parse_addr(spec.substr(0, c1), hle.addr))
+        return false;
+    hle.routine = spec.substr(c1 + 1, c2 == std::string::npos ? c2 : c2 - c1 - 1);
+    hle.cycles = 0;
+    if (c2 != std::string::npos)
+    {
+        char* end;
+        auto cycles = spec.substr(c2 + 1);
+        hle.cycles = std::strtoul(cycles.c_str(), &end, 0);
+        if (cycles.empty() || *end != '\0')
+            return false;
+    }
+    return hle_find(hle.routine.c_str()) != nullptr;
+}
+
+static std::string hle_help(void)
+{
+    std::string help = "Replace the subroutine at addr with a native routine, "
+        "charging cycles per call. Routines:";
+    for (auto r = HLE_ROUTINES; r->name; ++r)
+        help += std::string(" ") + r->name + " (" + r->desc + ")";
+    return help;
+}
+
 static int run(const std::string& file, emu_opts opts)
 {
     int e;
     if ((e = emu_init(opts)) != 0 ||
-        (e = emu_load(file.c_str())) != 0 ||
+        (!opts.boot && (e = emu_load(file.c_str())) != 0) ||
         (e = emu_run()) != 0)
         return e;
     return 0;
 }
 
+// Disassemble file instead of running it.
+static int disassemble(const std::string& file, const cxxopts::ParseResult& res)
+{
+    cfg g;
+    i8080_addr_t base = res["con"].as<bool>() ? 0x100 : 0;
+    if (!cfg_image_load(g.image, file.c_str(), base))
+        return EXIT_FAILURE;
+
+    auto entries = cfg_entries(g.image);
+    if (res["entry"].count() != 0)
+    {
+        for (auto& spec : res["entry"].as<std::vector<std::string>>())
+        {
+            i8080_addr_t addr;
+            if (!parse_addr(spec, addr))
+                return bail("Bad entry point %s", spec.c_str());
+            entries.push_back(addr);
+        }
+    }
+
+    symtab syms;
+    if (res["symbols"].count() != 0 &&
+        !symtab_load(syms, res["symbols"].as<std::string>().c_str()))
+        return EXIT_FAILURE;
+
+    cfg_build(g, entries);
+
+    bool ok = true;
+    if (res["disasm"].count() != 0)
+        ok = cfg_write_listing(res["disasm"].as<std::string>().c_str(), g, syms) && ok;
+    if (res["cfg-dot"].count() != 0)
+        ok = cfg_write_dot(res["cfg-dot"].as<std::string>().c_str(), g, syms) && ok;
+    if (res["cfg-json"].count() != 0)
+        ok = cfg_write_json(res["cfg-json"].as<std::string>().c_str(), g, syms) && ok;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, char** argv)
 {
     try {
@@ -46,6 +168,103 @@ int main(int argc, char** argv)
                 cxxopts::value<bool>()->default_value("true"))
             ("kintr", "Convert Ctrl+C interrupts to 8080 interrupts.")
             ("f,file", "Input file.", cxxopts::value<std::string>(), "<file>");
+        opts.add_options("CP/M")
+            ("dir", "Host directory of drive A:. Drives B: to P: are its subdirectories "
+                "b to p.", cxxopts::value<std::string>()->default_value("."), "<dir>")
+            ("cmdline", "Command tail of the program, e.g. 'HELLO.ASM'. Its first two "
+                "words are also put in the default FCBs.",
+                cxxopts::value<std::string>()->default_value(""), "<text>")
+            ("stdin-file", "Read console input from file, as fast as the program asks "
+                "for it, instead of stdin. The program ends when it runs out.",
+                cxxopts::value<std::string>(), "<file>")
+            ("disk", "Map a disk image as a drive for the BIOS's disk entry points, "
+                "e.g. A:cpm22.dsk. Images are IBM 3740 (8\" single density) or raw, "
+                "by size if not given.",
+                cxxopts::value<std::vector<std::string>>(), "<drive:file[:3740|raw]>")
+            ("boot", "Boot CP/M from the system tracks of drive A: instead of running "
+                "a file.")
+            ("bios", "Address of the BIOS. Booted systems need the one they were built "
+                "for, by default 0xfa00. Otherwise at the top of memory.",
+                cxxopts::value<std::string>(), "<addr>");
+        opts.add_options("Timing")
+            ("clock", "Throttle to this clock rate, e.g. 2 for an authentic 8080. "
+                "Runs as fast as possible if 0.",
+                cxxopts::value<double>()->default_value("0"), "<MHz>")
+            ("slice", "Cycles to run between throttling sleeps.",
+                cxxopts::value<unsigned long>()->default_value("20000"), "<cycles>");
+        opts.add_options("HLE")
+            ("hle", hle_help(), 
+                cxxopts::value<std::vector<std::string>>(), "<addr:routine[:cycles]>")
+            ("hle-verify", "Check each native routine against the 8080 code it replaces.");
+        opts.add_options("Debug")
+            ("break", "Stop before executing the instruction at addr.",
+                cxxopts::value<std::vector<std::string>>(), "<addr>")
+            ("watch", "Stop after an instruction reads (r) and/or writes (w) addr. "
+                "Instruction fetches are not watched.",
+                cxxopts::value<std::vector<std::string>>(), "<addr[:r|w|rw]>")
+            ("gdb", "Wait for GDB to attach on this localhost TCP port or Unix socket path. "
+                "Use 'set architecture z80' in GDB.",
+                cxxopts::value<std::string>(), "<port|path>")
+            ("gdb-poll", "Cycles to run between checks for a break from GDB.",
+                cxxopts::value<unsigned long>()->default_value("100000"), "<cycles>");
+        opts.add_options("Profile")
+            ("profile", "Write an execution profile, by opcode and address, "
+                "to file. Needs a build with LIBI8080_PROFILE.",
+                cxxopts::value<std::string>(), "<file>")
+            ("profile-stacks", "Write the call paths taken, with cycles, to file as "
+                "folded stacks for flame graphs. Needs a build with LIBI8080_PROFILE.",
+                cxxopts::value<std::string>(), "<file>")
+            ("sample", "Sample the PC and top of stack at intervals of CPU time, "
+                "and write histograms to file. Does not need LIBI8080_PROFILE.",
+                cxxopts::value<std::string>(), "<file>")
+            ("sample-hz", "Samples per second of CPU time.",
+                cxxopts::value<unsigned>()->default_value("1000"), "<Hz>")
+            ("symbols", "Read symbols from file, as hex address and name pairs "
+                "(e.g. a CP/M .SYM file).",
+                cxxopts::value<std::string>(), "<file>")
+            ("coverage", "Write the program's code coverage to file: instructions run "
+                "and branch directions taken, per symbol and per address.",
+                cxxopts::value<std::string>(), "<file>")
+            ("coverage-lcov", "Write the program's code coverage to file as an lcov "
+                "tracefile, with addresses as line numbers and symbols as functions.",
+                cxxopts::value<std::string>(), "<file>")
+            ("stats", "Write runtime statistics (instructions, interrupts and their "
+                "latency, I/O by port, memory accesses, halts) to file at exit, in "
+                "Prometheus text format. Needs a build with LIBI8080_STATS.",
+                cxxopts::value<std::string>(), "<file>")
+            ("heatmap", "Write memory accesses per 256-byte page to file as CSV: "
+                "instruction fetches, data reads and writes, and stack reads and writes. "
+                "Needs a build with LIBI8080_HEATMAP.",
+                cxxopts::value<std::string>(), "<file>")
+            ("heatmap-pgm", "Write memory accesses per address to file as a 256x256 "
+                "PGM image, one row per page, log scaled. Needs a build with LIBI8080_HEATMAP.",
+                cxxopts::value<std::string>(), "<file>")
+            ("heatmap-every", "Add a snapshot of the accesses since the last one to the "
+                "--heatmap file every this many cycles, not just the totals at exit.",
+                cxxopts::value<unsigned long>()->default_value("0"), "<cycles>")
+            ("timeline", "Write a timeline of the run to file as Chrome trace-event JSON, "
+                "for Perfetto: time running and halted, interrupts, BDOS calls and I/O. "
+                "Times are at --clock, or 2 MHz if running flat out.",
+                cxxopts::value<std::string>(), "<file>");
+        opts.add_options("Trace")
+            ("trace", "Write every instruction executed, with registers and cycles, "
+                "to file as a binary trace. Decode it with i8080trace. "
+                "Needs a build with LIBI8080_TRACE.",
+                cxxopts::value<std::string>(), "<file>")
+            ("trace-last", "Trace only the last n instructions, keeping them in memory "
+                "and writing them when the program ends.",
+                cxxopts::value<unsigned long>()->default_value("0"), "<n>");
+        opts.add_options("Disassemble")
+            ("disasm", "Disassemble the input file instead of running it, following "
+                "its control flow from the load address and RST vectors, and write a "
+                "listing that can be reassembled to file.",
+                cxxopts::value<std::string>(), "<file>")
+            ("cfg-dot", "Write the control-flow graph of the input file in DOT format.",
+                cxxopts::value<std::string>(), "<file>")
+            ("cfg-json", "Write the control-flow graph of the input file as JSON.",
+                cxxopts::value<std::string>(), "<file>")
+            ("entry", "Also disassemble from addr, e.g. an interrupt handler.",
+                cxxopts::value<std::vector<std::string>>(), "<addr>");
         opts.add_options("Test")
             ("t,tests", "Run tests.")
             ("testdir", "Look for test binaries in this directory.",
@@ -76,14 +295,109 @@ int main(int argc, char** argv)
             return EXIT_SUCCESS;
         }
         else {
-            if (res["file"].count() == 0)
+            bool boot = res["boot"].as<bool>();
+            if (res["file"].count() == 0 && !boot)
                 return bail("No input file");
 
-            auto& file = res["file"].as<std::string>();
+            auto file = res["file"].count() != 0 ?
+                res["file"].as<std::string>() : std::string();
+            if (res["disasm"].count() != 0 || res["cfg-dot"].count() != 0 ||
+                res["cfg-json"].count() != 0)
+                return disassemble(file, res);
+
             bool conv_key_intr = res["kintr"].as<bool>();
             bool use_cpm_con = res["con"].as<bool>();
 
-            int e = run(file, emu_opts(conv_key_intr, use_cpm_con));
+            emu_opts eopts(conv_key_intr, use_cpm_con);
+            eopts.cpm_dir = res["dir"].as<std::string>();
+            eopts.cmdline = res["cmdline"].as<std::string>();
+            if (res["stdin-file"].count() != 0)
+                eopts.stdin_file = res["stdin-file"].as<std::string>();
+            if (res["disk"].count() != 0)
+            {
+                for (auto& spec : res["disk"].as<std::vector<std::string>>())
+                {
+                    emu_disk disk;
+                    if (!parse_disk(spec, disk))
+                        return bail("Bad disk %s", spec.c_str());
+                    eopts.disks.push_back(disk);
+                }
+            }
+            eopts.boot = boot;
+            if (res["bios"].count() != 0 &&
+                !parse_addr(res["bios"].as<std::string>(), eopts.bios))
+                return bail("Bad BIOS address");
+            eopts.clock_mhz = res["clock"].as<double>();
+            eopts.slice_cycles = res["slice"].as<unsigned long>();
+            if (eopts.clock_mhz < 0 || eopts.slice_cycles == 0)
+                return bail("Bad timing options");
+
+            if (res["hle"].count() != 0)
+            {
+                for (auto& spec : res["hle"].as<std::vector<std::string>>())
+                {
+                    emu_hle hle;
+                    if (!parse_hle(spec, hle))
+                        return bail("Bad HLE option %s", spec.c_str());
+                    eopts.hle.push_back(hle);
+                }
+            }
+            eopts.hle_verify = res["hle-verify"].as<bool>();
+
+            if (res["break"].count() != 0)
+            {
+                for (auto& spec : res["break"].as<std::vector<std::string>>())
+                {
+                    i8080_addr_t addr;
+                    if (!parse_addr(spec, addr))
+                        return bail("Bad breakpoint %s", spec.c_str());
+                    eopts.breaks.push_back(addr);
+                }
+            }
+            if (res["profile"].count() != 0)
+                eopts.profile_file = res["profile"].as<std::string>();
+            if (res["profile-stacks"].count() != 0)
+                eopts.profile_stacks = res["profile-stacks"].as<std::string>();
+            if (res["sample"].count() != 0)
+                eopts.sample_file = res["sample"].as<std::string>();
+            eopts.sample_hz = res["sample-hz"].as<unsigned>();
+            if (res["symbols"].count() != 0)
+                eopts.symbols_file = res["symbols"].as<std::string>();
+            if (res["coverage"].count() != 0)
+                eopts.coverage_file = res["coverage"].as<std::string>();
+            if (res["coverage-lcov"].count() != 0)
+                eopts.coverage_lcov = res["coverage-lcov"].as<std::string>();
+            if (res["stats"].count() != 0)
+                eopts.stats_file = res["stats"].as<std::string>();
+            if (res["heatmap"].count() != 0)
+                eopts.heatmap_file = res["heatmap"].as<std::string>();
+            if (res["heatmap-pgm"].count() != 0)
+                eopts.heatmap_pgm = res["heatmap-pgm"].as<std::string>();
+            eopts.heatmap_every = res["heatmap-every"].as<unsigned long>();
+            if (res["timeline"].count() != 0)
+                eopts.timeline_file = res["timeline"].as<std::string>();
+            if (res["trace"].count() != 0)
+                eopts.trace_file = res["trace"].as<std::string>();
+            eopts.trace_last = res["trace-last"].as<unsigned long>();
+
+            if (res["gdb"].count() != 0)
+                eopts.gdb = res["gdb"].as<std::string>();
+            eopts.gdb_poll_cycles = res["gdb-poll"].as<unsigned long>();
+            if (eopts.gdb_poll_cycles == 0)
+                return bail("Bad GDB options");
+
+            if (res["watch"].count() != 0)
+            {
+                for (auto& spec : res["watch"].as<std::vector<std::string>>())
+                {
+                    emu_watch watch;
+                    if (!parse_watch(spec, watch))
+                        return bail("Bad watchpoint %s", spec.c_str());
+                    eopts.watches.push_back(watch);
+                }
+            }
+
+            int e = run(file, eopts);
             if (e) emu_errexit(e);
             
             return EXIT_SUCCESS;
@@ -0,0 +1,43 @@
+#ifndef PROBES_HPP
+#define PROBES_HPP
+
+// USDT probes of provider i8080emu, for bpftrace, perf and
+// systemtap. Each probe has a semaphore that tracers set while
+// attached, and is skipped with one not-taken branch otherwise.
+// Build with LIBI8080_USDT; without it the probes are no-ops.
+//
+// insn(pc, opcode, cycles)          before each instruction
+// interrupt(pc, cycles)             before an interrupt's instruction
+// io_in_start(port, cycles)
+// io_in_done(port, value, cycles)   around IN handlers
+// io_out_start(port, value, cycles)
+// io_out_done(port, cycles)         around OUT handlers
+// halt_enter(pc, cycles)            the CPU halted
+// halt_exit(pc, cycles)             an interrupt woke it up
+// bdos(function, de, cycles)        before a BDOS call
+//
+// insn and interrupt make the CPU run one instruction at a
+// time while attached, so are much slower than the others.
+
+#ifdef EMU_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+// Define the semaphore of a probe, once.
+#define EMU_PROBE_SEMAPHORE(name) \
+    volatile unsigned short i8080emu_##name##_semaphore \
+    __attribute__((used, section(".probes"))) = 0
+
+#define EMU_PROBE_ENABLED(name) __builtin_expect(i8080emu_##name##_semaphore != 0, 0)
+
+#define EMU_PROBE2(name, a1, a2) do { \
+    if (EMU_PROBE_ENABLED(name)) DTRACE_PROBE2(i8080emu, name, a1, a2); } while (0)
+#define EMU_PROBE3(name, a1, a2, a3) do { \
+    if (EMU_PROBE_ENABLED(name)) DTRACE_PROBE3(i8080emu, name, a1, a2, a3); } while (0)
+#else
+#define EMU_PROBE_ENABLED(name) false
+#define EMU_PROBE2(name, a1, a2) ((void)0)
+#define EMU_PROBE3(name, a1, a2, a3) ((void)0)
+#endif
+
+#endif
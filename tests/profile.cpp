@@ -0,0 +1,155 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "i8080/i8080.h"
+#include "profile.hpp"
+#include "emu.hpp"
+
+#ifdef I8080_PROFILE
+
+namespace {
+
+struct entry
+{
+    unsigned key;
+    i8080_cycles_t count;
+    i8080_cycles_t cycles;
+};
+
+// Disassemble the instruction at addr.
+static std::string disasm_at(const i8080* cpu, i8080_addr_t addr)
+{
+    i8080_word_t bytes[3];
+    for (int i = 0; i < 3; ++i)
+        bytes[i] = cpu->mem_read(cpu, i8080_addr_t(addr + i));
+    char buf[32];
+    return i8080_disasm(bytes, 3, buf, sizeof(buf)) ? buf : "?";
+}
+
+// Disassemble opcode with zero operands.
+static std::string disasm_op(i8080_word_t opcode)
+{
+    i8080_word_t bytes[3] = { opcode, 0, 0 };
+    char buf[32];
+    return i8080_disasm(bytes, 3, buf, sizeof(buf)) ? buf : "?";
+}
+
+static void sort_by_cycles(std::vector<entry>& entries)
+{
+    std::sort(entries.begin(), entries.end(),
+        [](const entry& e1, const entry& e2) {
+            return e1.cycles != e2.cycles ? e1.cycles > e2.cycles : e1.key < e2.key;
+        });
+}
+
+static bool close_report(std::FILE* fs, const char* path)
+{
+    bool ok = !std::ferror(fs);
+    if (std::fclose(fs) != 0) ok = false;
+    if (!ok) emu_printerr("Could not write %s", path);
+    return ok;
+}
+
+static double percent(i8080_cycles_t part, i8080_cycles_t total)
+{
+    return total ? 100.0 * double(part) / double(total) : 0.0;
+}
+
+}
+
+bool profile_write(const char* path, const i8080* cpu)
+{
+    const i8080_profile* prof = cpu->profile;
+
+    std::vector<entry> ops, pcs;
+    i8080_cycles_t total_count = 0, total_cycles = 0;
+    for (unsigned i = 0; i < 256; ++i)
+    {
+        if (!prof->op_count[i]) continue;
+        ops.push_back({ i, prof->op_count[i], prof->op_cycles[i] });
+        total_count += prof->op_count[i];
+        total_cycles += prof->op_cycles[i];
+    }
+    for (unsigned i = 0; i < 65536; ++i)
+    {
+        if (prof->pc_count[i])
+            pcs.push_back({ i, prof->pc_count[i], prof->pc_cycles[i] });
+    }
+    sort_by_cycles(ops);
+    sort_by_cycles(pcs);
+
+    std::FILE* fs = std::fopen(path, "w");
+    if (!fs) {
+        emu_printerr("Could not open %s", path);
+        return false;
+    }
+
+    std::fprintf(fs, "; %llu instructions, %llu cycles\n\n", 
+        (unsigned long long)total_count, (unsigned long long)total_cycles);
+
+    std::fputs("; opcodes by cycles\n", fs);
+    std::fprintf(fs, "%-8s %16s %16s %7s  %s\n", 
+        "; opcode", "count", "cycles", "%", "instruction");
+    for (const auto& e : ops)
+    {
+        std::fprintf(fs, "    0x%02x %16llu %16llu %7.3f  %s\n", e.key,
+            (unsigned long long)e.count, (unsigned long long)e.cycles,
+            percent(e.cycles, total_cycles), disasm_op(i8080_word_t(e.key)).c_str());
+    }
+
+    std::fputs("\n; addresses by cycles\n", fs);
+    std::fprintf(fs, "%-8s %16s %16s %7s  %s\n",
+        "; addr", "count", "cycles", "%", "instruction");
+    for (const auto& e : pcs)
+    {
+        std::fprintf(fs, "  0x%04x %16llu %16llu %7.3f  %s\n", e.key,
+            (unsigned long long)e.count, (unsigned long long)e.cycles,
+            percent(e.cycles, total_cycles), disasm_at(cpu, i8080_addr_t(e.key)).c_str());
+    }
+
+    return close_report(fs, path);
+}
+
+bool profile_write_stacks(const char* path, const i8080* cpu,
+    const symtab& syms, const char* root)
+{
+    const i8080_profile* prof = cpu->profile;
+    std::FILE* fs = std::fopen(path, "w");
+    if (!fs) {
+        emu_printerr("Could not open %s", path);
+        return false;
+    }
+
+    std::vector<std::string> names(prof->nnodes);
+    names[0] = root;
+    for (unsigned i = 1; i < prof->nnodes; ++i)
+        names[i] = symtab_name(syms, prof->node[i].addr);
+
+    std::vector<unsigned> path_nodes;
+    std::string line;
+    for (unsigned i = 0; i < prof->nnodes; ++i)
+    {
+        if (!prof->node[i].cycles) continue;
+
+        path_nodes.clear();
+        for (unsigned n = i; n != 0; n = prof->node[n].parent)
+            path_nodes.push_back(n);
+
+        line = names[0];
+        for (auto it = path_nodes.rbegin(); it != path_nodes.rend(); ++it)
+            line += ";" + names[*it];
+        std::fprintf(fs, "%s %llu\n", line.c_str(), 
+            (unsigned long long)prof->node[i].cycles);
+    }
+    if (prof->lost_calls)
+    {
+        std::fprintf(stderr, "i8080emu: profile: %lu calls not recorded, "
+            "call tree or stack full\n", prof->lost_calls);
+    }
+    return close_report(fs, path);
+}
+
+#endif
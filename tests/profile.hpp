@@ -0,0 +1,21 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include "i8080/i8080.h"
+#include "symbols.hpp"
+
+#ifdef I8080_PROFILE
+// Write a report of cpu->profile to path, sorted by cycles.
+// Addresses are disassembled from cpu's memory.
+// Returns true on success.
+bool profile_write(const char* path, const i8080* cpu);
+
+// Write the call tree in cpu->profile as folded stacks, one line
+// per call path, e.g. "root;main;print 1234" (cycles), for use
+// with flamegraph.pl and similar tools.
+// Returns true on success.
+bool profile_write_stacks(const char* path, const i8080* cpu, 
+    const symtab& syms, const char* root);
+#endif
+
+#endif
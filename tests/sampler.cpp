@@ -0,0 +1,213 @@
+#if defined(__linux__)
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/syscall.h>
+#define EMU_USING_LINUX_SAMPLER 1
+
+// older glibc
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#elif defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#define EMU_USING_POSIX_SAMPLER 1
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include "sampler.hpp"
+#include "emu.hpp"
+
+static struct sampler
+{
+    const i8080* cpu;
+    const i8080_word_t* mem;
+    std::unique_ptr<unsigned long[]> pc_samples;
+    std::unique_ptr<unsigned long[]> ret_samples;
+    unsigned long nsamples;
+    unsigned long nhalted;
+    bool running;
+#if defined(EMU_USING_LINUX_SAMPLER) || defined(EMU_USING_POSIX_SAMPLER)
+    // SIGPROF handler before sampler_start().
+    struct sigaction old_sa;
+#endif
+#if defined(EMU_USING_LINUX_SAMPLER)
+    timer_t timer;
+#endif
+}
+SAMPLER;
+
+#if defined(EMU_USING_LINUX_SAMPLER) || defined(EMU_USING_POSIX_SAMPLER)
+
+// signal-safe: only reads CPU state and memory
+// and updates counters owned by this thread
+static void sampler_handler(int) noexcept
+{
+    int saved_errno = errno;
+    const volatile i8080* cpu = SAMPLER.cpu;
+    i8080_addr_t pc = cpu->pc;
+    i8080_addr_t sp = cpu->sp;
+
+    SAMPLER.nsamples++;
+    if (cpu->halt)
+        SAMPLER.nhalted++;
+    else {
+        SAMPLER.pc_samples[pc]++;
+        i8080_addr_t ret = i8080_addr_t(
+            (SAMPLER.mem[i8080_addr_t(sp + 1)] << 8) | SAMPLER.mem[sp]);
+        SAMPLER.ret_samples[ret]++;
+    }
+    errno = saved_errno;
+}
+
+// Put back the SIGPROF handler from before sampler_start().
+// Ignoring SIGPROF first discards a signal still pending from
+// the timer, which the old handler may not expect.
+static void restore_handler(void)
+{
+    signal(SIGPROF, SIG_IGN);
+    sigaction(SIGPROF, &SAMPLER.old_sa, nullptr);
+}
+
+bool sampler_start(const i8080* cpu, const i8080_word_t* mem, unsigned hz)
+{
+    if (hz == 0 || hz > 1000000) {
+        emu_printerr("sampler: bad rate %u Hz", hz);
+        return false;
+    }
+    SAMPLER.cpu = cpu;
+    SAMPLER.mem = mem;
+    SAMPLER.pc_samples.reset(new unsigned long[65536]());
+    SAMPLER.ret_samples.reset(new unsigned long[65536]());
+    SAMPLER.nsamples = 0;
+    SAMPLER.nhalted = 0;
+
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sampler_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGPROF, &sa, &SAMPLER.old_sa) != 0) {
+        emu_printerr("sampler: sigaction: %s", std::strerror(errno));
+        return false;
+    }
+
+    long interval_ns = 1000000000L / long(hz);
+#if defined(EMU_USING_LINUX_SAMPLER)
+    // CPU time of this thread only, so samples
+    // never land on the keyboard interrupt thread
+    struct sigevent sev;
+    std::memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = pid_t(::syscall(SYS_gettid));
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &SAMPLER.timer) != 0) {
+        emu_printerr("sampler: timer_create: %s", std::strerror(errno));
+        restore_handler();
+        return false;
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = interval_ns / 1000000000L;
+    its.it_interval.tv_nsec = interval_ns % 1000000000L;
+    its.it_value = its.it_interval;
+    if (timer_settime(SAMPLER.timer, 0, &its, nullptr) != 0) {
+        emu_printerr("sampler: timer_settime: %s", std::strerror(errno));
+        timer_delete(SAMPLER.timer);
+        restore_handler();
+        return false;
+    }
+#else
+    struct itimerval itv;
+    itv.it_interval.tv_sec = interval_ns / 1000000000L;
+    itv.it_interval.tv_usec = (interval_ns % 1000000000L) / 1000;
+    itv.it_value = itv.it_interval;
+    if (setitimer(ITIMER_PROF, &itv, nullptr) != 0) {
+        emu_printerr("sampler: setitimer: %s", std::strerror(errno));
+        restore_handler();
+        return false;
+    }
+#endif
+    SAMPLER.running = true;
+    return true;
+}
+
+void sampler_stop(void)
+{
+    if (!SAMPLER.running) return;
+#if defined(EMU_USING_LINUX_SAMPLER)
+    timer_delete(SAMPLER.timer);
+#else
+    struct itimerval itv;
+    std::memset(&itv, 0, sizeof(itv));
+    setitimer(ITIMER_PROF, &itv, nullptr);
+#endif
+    restore_handler();
+    SAMPLER.running = false;
+}
+
+#else
+
+bool sampler_start(const i8080*, const i8080_word_t*, unsigned)
+{
+    emu_printerr("sampler: not supported on this platform");
+    return false;
+}
+
+void sampler_stop(void) {}
+
+#endif
+
+// Write one histogram, sorted by samples.
+static void write_histogram(std::FILE* fs, const unsigned long* samples,
+    unsigned long total, const symtab& syms)
+{
+    std::vector<unsigned> addrs;
+    for (unsigned i = 0; i < 65536; ++i)
+        if (samples[i]) addrs.push_back(i);
+    std::sort(addrs.begin(), addrs.end(), [samples](unsigned a1, unsigned a2) {
+        return samples[a1] != samples[a2] ? samples[a1] > samples[a2] : a1 < a2;
+    });
+
+    for (auto addr : addrs)
+    {
+        std::fprintf(fs, "  0x%04x %12lu %7.3f  %s\n", addr, samples[addr],
+            total ? 100.0 * double(samples[addr]) / double(total) : 0.0,
+            syms.syms.empty() ? "" : symtab_name(syms, i8080_addr_t(addr)).c_str());
+    }
+}
+
+bool sampler_write(const char* path, const symtab& syms)
+{
+    if (!SAMPLER.pc_samples)
+        return false;
+
+    std::FILE* fs = std::fopen(path, "w");
+    if (!fs) {
+        emu_printerr("Could not open %s", path);
+        return false;
+    }
+    unsigned long running = SAMPLER.nsamples - SAMPLER.nhalted;
+    std::fprintf(fs, "; %lu samples, %lu halted\n\n", SAMPLER.nsamples, SAMPLER.nhalted);
+
+    std::fputs("; PC\n", fs);
+    std::fprintf(fs, "%-8s %12s %7s  %s\n", "; addr", "samples", "%", "symbol");
+    write_histogram(fs, SAMPLER.pc_samples.get(), running, syms);
+
+    std::fputs("\n; word at top of stack (return address if in a subroutine)\n", fs);
+    std::fprintf(fs, "%-8s %12s %7s  %s\n", "; addr", "samples", "%", "symbol");
+    write_histogram(fs, SAMPLER.ret_samples.get(), running, syms);
+
+    bool ok = !std::ferror(fs);
+    if (std::fclose(fs) != 0) ok = false;
+    if (!ok) emu_printerr("Could not write %s", path);
+    return ok;
+}
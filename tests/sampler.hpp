@@ -0,0 +1,25 @@
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include "i8080/i8080.h"
+#include "symbols.hpp"
+
+// Statistical profiler. A host timer interrupts the calling
+// thread hz times per second of CPU time it uses, and the signal
+// handler records cpu's PC and the word at the top of its stack
+// (usually the return address, if in a subroutine).
+// Instruments nothing, so the interpreter is not perturbed.
+
+// Start sampling. mem is cpu's 64K memory, read directly
+// by the signal handler.
+// Returns true on success.
+bool sampler_start(const i8080* cpu, const i8080_word_t* mem, unsigned hz);
+
+// Stop sampling.
+void sampler_stop(void);
+
+// Write the histograms, sorted by samples.
+// Returns true on success.
+bool sampler_write(const char* path, const symtab& syms);
+
+#endif
@@ -0,0 +1,92 @@
+/* Minimal <sys/sdt.h>, used when systemtap's is not installed.
+   Emits the same .note.stapsdt records, which bpftrace, perf and
+   systemtap read, for STAP_PROBE and DTRACE_PROBE with up to 6
+   arguments. Arguments are passed as unsigned 64-bit values.
+   Define _SDT_HAS_SEMAPHORES to record provider_name_semaphore.
+
+   Only 64-bit ELF targets are supported (x86-64 and AArch64).
+   Elsewhere the probes compile to nothing. */
+
+#ifndef _SYS_SDT_H
+#define _SYS_SDT_H
+
+#if defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+
+#ifdef _SDT_HAS_SEMAPHORES
+#define _SDT_SEMAPHORE(provider, name) #provider "_" #name "_semaphore"
+#else
+#define _SDT_SEMAPHORE(provider, name) "0"
+#endif
+
+/* The probe site is a nop; its address, the shared base address, */
+/* the semaphore and the argument locations go in the note. */
+#define _SDT_NOTE(provider, name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte " _SDT_SEMAPHORE(provider, name) "\n" \
+    ".asciz \"" #provider "\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#define _SDT_ARG(x) "nor"((unsigned long long)(x))
+#define _SDT_PROBE(provider, name, args, ...) \
+    __asm__ __volatile__(_SDT_NOTE(provider, name, args) :: __VA_ARGS__)
+
+#define STAP_PROBE(provider, name) \
+    __asm__ __volatile__(_SDT_NOTE(provider, name, ""))
+#define STAP_PROBE1(provider, name, a1) \
+    _SDT_PROBE(provider, name, "8@%0", _SDT_ARG(a1))
+#define STAP_PROBE2(provider, name, a1, a2) \
+    _SDT_PROBE(provider, name, "8@%0 8@%1", _SDT_ARG(a1), _SDT_ARG(a2))
+#define STAP_PROBE3(provider, name, a1, a2, a3) \
+    _SDT_PROBE(provider, name, "8@%0 8@%1 8@%2", _SDT_ARG(a1), _SDT_ARG(a2), _SDT_ARG(a3))
+#define STAP_PROBE4(provider, name, a1, a2, a3, a4) \
+    _SDT_PROBE(provider, name, "8@%0 8@%1 8@%2 8@%3", _SDT_ARG(a1), _SDT_ARG(a2), \
+        _SDT_ARG(a3), _SDT_ARG(a4))
+#define STAP_PROBE5(provider, name, a1, a2, a3, a4, a5) \
+    _SDT_PROBE(provider, name, "8@%0 8@%1 8@%2 8@%3 8@%4", _SDT_ARG(a1), _SDT_ARG(a2), \
+        _SDT_ARG(a3), _SDT_ARG(a4), _SDT_ARG(a5))
+#define STAP_PROBE6(provider, name, a1, a2, a3, a4, a5, a6) \
+    _SDT_PROBE(provider, name, "8@%0 8@%1 8@%2 8@%3 8@%4 8@%5", _SDT_ARG(a1), _SDT_ARG(a2), \
+        _SDT_ARG(a3), _SDT_ARG(a4), _SDT_ARG(a5), _SDT_ARG(a6))
+
+#else
+
+#define STAP_PROBE(provider, name) ((void)0)
+#define STAP_PROBE1(provider, name, a1) ((void)0)
+#define STAP_PROBE2(provider, name, a1, a2) ((void)0)
+#define STAP_PROBE3(provider, name, a1, a2, a3) ((void)0)
+#define STAP_PROBE4(provider, name, a1, a2, a3, a4) ((void)0)
+#define STAP_PROBE5(provider, name, a1, a2, a3, a4, a5) ((void)0)
+#define STAP_PROBE6(provider, name, a1, a2, a3, a4, a5, a6) ((void)0)
+
+#endif
+
+#define DTRACE_PROBE(provider, name) STAP_PROBE(provider, name)
+#define DTRACE_PROBE1(provider, name, a1) STAP_PROBE1(provider, name, a1)
+#define DTRACE_PROBE2(provider, name, a1, a2) STAP_PROBE2(provider, name, a1, a2)
+#define DTRACE_PROBE3(provider, name, a1, a2, a3) STAP_PROBE3(provider, name, a1, a2, a3)
+#define DTRACE_PROBE4(provider, name, a1, a2, a3, a4) \
+    STAP_PROBE4(provider, name, a1, a2, a3, a4)
+#define DTRACE_PROBE5(provider, name, a1, a2, a3, a4, a5) \
+    STAP_PROBE5(provider, name, a1, a2, a3, a4, a5)
+#define DTRACE_PROBE6(provider, name, a1, a2, a3, a4, a5, a6) \
+    STAP_PROBE6(provider, name, a1, a2, a3, a4, a5, a6)
+
+#endif
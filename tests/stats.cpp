@@ -0,0 +1,97 @@
+#include <cstdio>
+#include <string>
+
+#include "i8080/i8080.h"
+#include "stats.hpp"
+#include "emu.hpp"
+
+#ifdef I8080_STATS
+
+// Escape a label value.
+static std::string escape(const char* s)
+{
+    std::string ret;
+    for (; *s; ++s)
+    {
+        if (*s == '\\' || *s == '"') ret += '\\';
+        if (*s == '\n') ret += "\\n";
+        else ret += *s;
+    }
+    return ret;
+}
+
+static void metric(std::FILE* fs, const char* name, const char* type, const char* help)
+{
+    std::fprintf(fs, "# HELP i8080_%s %s\n# TYPE i8080_%s %s\n", name, help, name, type);
+}
+
+static void sample(std::FILE* fs, const char* name, const std::string& labels,
+    i8080_cycles_t val)
+{
+    std::fprintf(fs, "i8080_%s{%s} %llu\n", name, labels.c_str(), (unsigned long long)val);
+}
+
+// One sample per port that was used.
+static void port_samples(std::FILE* fs, const char* name, const std::string& labels,
+    const i8080_cycles_t* counts)
+{
+    for (unsigned port = 0; port < I8080_NUM_PORTS; ++port)
+        if (counts[port] != 0)
+            sample(fs, name, labels + ",port=\"" + std::to_string(port) + "\"", counts[port]);
+}
+
+bool stats_write(const char* path, const i8080* cpu, const char* progname)
+{
+    std::string tmp = std::string(path) + ".tmp";
+    std::FILE* fs = std::fopen(tmp.c_str(), "w");
+    if (!fs) {
+        emu_printerr("Could not open %s", tmp.c_str());
+        return false;
+    }
+
+    i8080_stats st;
+    i8080_get_stats(cpu, &st);
+    std::string labels = "program=\"" + escape(progname) + "\"";
+
+    metric(fs, "cycles_total", "counter", "Clock cycles run.");
+    sample(fs, "cycles_total", labels, cpu->cycles);
+    metric(fs, "instructions_total", "counter", "Instructions retired.");
+    sample(fs, "instructions_total", labels, st.instructions);
+    metric(fs, "interrupts_total", "counter", "Interrupts accepted.");
+    sample(fs, "interrupts_total", labels, st.interrupts);
+    metric(fs, "interrupt_latency_cycles_total", "counter",
+        "Cycles from interrupt requests to their acceptance.");
+    sample(fs, "interrupt_latency_cycles_total", labels, st.int_latency);
+    metric(fs, "interrupt_latency_cycles_max", "gauge",
+        "Most cycles from an interrupt request to its acceptance.");
+    sample(fs, "interrupt_latency_cycles_max", labels, st.int_latency_max);
+    metric(fs, "io_reads_total", "counter", "IN instructions, by port.");
+    port_samples(fs, "io_reads_total", labels, st.io_reads);
+    metric(fs, "io_writes_total", "counter", "OUT instructions, by port.");
+    port_samples(fs, "io_writes_total", labels, st.io_writes);
+    metric(fs, "memory_reads_total", "counter", "Data reads from memory.");
+    sample(fs, "memory_reads_total", labels, st.mem_reads);
+    metric(fs, "memory_writes_total", "counter", "Data writes to memory.");
+    sample(fs, "memory_writes_total", labels, st.mem_writes);
+    metric(fs, "halts_total", "counter", "HLT instructions.");
+    sample(fs, "halts_total", labels, st.halts);
+    metric(fs, "halted_cycles_total", "counter", "Cycles that passed while halted.");
+    sample(fs, "halted_cycles_total", labels, st.halted_cycles);
+
+    bool ok = !std::ferror(fs);
+    if (std::fclose(fs) != 0)
+        ok = false;
+    if (ok && std::rename(tmp.c_str(), path) != 0)
+    {
+        // Windows does not replace files
+        std::remove(path);
+        ok = std::rename(tmp.c_str(), path) == 0;
+    }
+    if (!ok) {
+        std::remove(tmp.c_str());
+        emu_printerr("Could not write %s", path);
+    }
+    return ok;
+}
+
+#endif
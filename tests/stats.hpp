@@ -0,0 +1,16 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include "i8080/i8080.h"
+
+#ifdef I8080_STATS
+// Write cpu's runtime statistics to path in the Prometheus text
+// exposition format, labelled with progname. The file is written
+// under a temporary name and renamed, so a collector polling it
+// (e.g. the node exporter's textfile collector) never reads half
+// of it.
+// Returns true on success.
+bool stats_write(const char* path, const i8080* cpu, const char* progname);
+#endif
+
+#endif
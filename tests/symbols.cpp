@@ -0,0 +1,91 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <string>
+#include <algorithm>
+
+#include "symbols.hpp"
+#include "emu.hpp"
+
+// Read the next whitespace-separated token, skipping comments.
+static bool next_token(std::FILE* fs, std::string& tok)
+{
+    int c;
+    tok.clear();
+    while ((c = std::fgetc(fs)) != EOF)
+    {
+        if (c == ';') {
+            while ((c = std::fgetc(fs)) != EOF && c != '\n');
+            if (c == EOF) break;
+        }
+        if (std::isspace(c)) {
+            if (!tok.empty()) return true;
+        }
+        else tok += char(c);
+    }
+    return !tok.empty();
+}
+
+bool symtab_load(symtab& tab, const char* path)
+{
+    std::FILE* fs = std::fopen(path, "r");
+    if (!fs) {
+        emu_printerr("Could not open %s", path);
+        return false;
+    }
+
+    tab.syms.clear();
+    std::string addrs, name;
+    while (next_token(fs, addrs))
+    {
+        if (!next_token(fs, name))
+        {
+            emu_printerr("%s: no name for symbol at %s", path, addrs.c_str());
+            std::fclose(fs);
+            return false;
+        }
+        // allow 0x prefix or h suffix
+        if (addrs.back() == 'h' || addrs.back() == 'H')
+            addrs.pop_back();
+        char* end;
+        unsigned long addr = std::strtoul(addrs.c_str(), &end, 16);
+        if (addrs.empty() || *end != '\0' || addr > 0xffff)
+        {
+            emu_printerr("%s: bad address %s", path, addrs.c_str());
+            std::fclose(fs);
+            return false;
+        }
+        tab.syms.push_back({ i8080_addr_t(addr), name });
+    }
+    bool ok = !std::ferror(fs);
+    std::fclose(fs);
+    if (!ok) {
+        emu_printerr("Could not read %s", path);
+        return false;
+    }
+
+    std::stable_sort(tab.syms.begin(), tab.syms.end(),
+        [](const symtab::symbol& s1, const symtab::symbol& s2) {
+            return s1.addr < s2.addr;
+        });
+    return true;
+}
+
+std::string symtab_name(const symtab& tab, i8080_addr_t addr)
+{
+    // last symbol at or before addr
+    auto it = std::upper_bound(tab.syms.begin(), tab.syms.end(), addr,
+        [](i8080_addr_t a, const symtab::symbol& s) { return a < s.addr; });
+
+    char buf[16];
+    if (it == tab.syms.begin())
+    {
+        std::snprintf(buf, sizeof(buf), "0x%04x", unsigned(addr));
+        return buf;
+    }
+    --it;
+    if (it->addr == addr)
+        return it->name;
+    std::snprintf(buf, sizeof(buf), "+%u", unsigned(addr - it->addr));
+    return it->name + buf;
+}
@@ -0,0 +1,30 @@
+#ifndef SYMBOLS_HPP
+#define SYMBOLS_HPP
+
+#include <string>
+#include <vector>
+#include "i8080/i8080.h"
+
+// Symbols of an emulated program, sorted by address.
+struct symtab
+{
+    struct symbol
+    {
+        i8080_addr_t addr;
+        std::string name;
+    };
+    std::vector<symbol> syms;
+};
+
+// Load a symbol file. Each symbol is a hex address followed by
+// a name, separated by whitespace, as in CP/M .SYM files, e.g.
+//  0100 START  0103 LOOP
+// Text from ';' to the end of a line is ignored.
+// Returns true on success.
+bool symtab_load(symtab& tab, const char* path);
+
+// Name of addr, e.g. "loop", "loop+3", or "0x1234"
+// if there is no symbol at or before addr.
+std::string symtab_name(const symtab& tab, i8080_addr_t addr);
+
+#endif
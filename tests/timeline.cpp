@@ -0,0 +1,237 @@
+#include <cstdio>
+#include <string>
+
+#include "i8080/i8080.h"
+#include "timeline.hpp"
+#include "emu.hpp"
+
+// Events are written out when this many bytes are buffered.
+static constexpr std::size_t chunk_size = 1 << 20;
+
+// Track ids.
+enum { TID_CPU = 1, TID_BDOS, TID_IO };
+
+static struct timeline
+{
+    i8080* cpu;
+    std::FILE* fs;
+    std::string path;
+    std::string buf;
+    double us_per_cycle;
+    // Start of the current span on the cpu track.
+    double span_start;
+    bool halted;
+    // Handlers wrapped while the timeline runs.
+    i8080_port ports[I8080_NUM_PORTS];
+    i8080_word_t(*io_read)(const i8080*, i8080_word_t port);
+    void(*io_write)(const i8080*, i8080_word_t port, i8080_word_t word);
+    void(*intr_accept)(const i8080*, i8080_word_t opcode);
+    bool ok;
+}
+TIMELINE;
+
+static std::string json_string(const char* s)
+{
+    std::string out = "\"";
+    for (; *s; ++s)
+    {
+        if (*s == '"' || *s == '\\')
+            out += '\\';
+        if (static_cast<unsigned char>(*s) < 0x20)
+            continue;
+        out += *s;
+    }
+    return out + "\"";
+}
+
+static double now(void)
+{
+    return double(TIMELINE.cpu->cycles) * TIMELINE.us_per_cycle;
+}
+
+static void flush(void)
+{
+    if (TIMELINE.ok && std::fwrite(TIMELINE.buf.data(), 1, TIMELINE.buf.size(),
+        TIMELINE.fs) != TIMELINE.buf.size())
+    {
+        emu_printerr("Could not write %s", TIMELINE.path.c_str());
+        TIMELINE.ok = false;
+    }
+    TIMELINE.buf.clear();
+}
+
+// Add an event. args is the inside of its args object.
+static void event(const char* name, char ph, int tid, double ts, double dur, const char* args)
+{
+    char ev[256];
+    int n = std::snprintf(ev, sizeof ev, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,"
+        "\"ts\":%.3f", name, ph, tid, ts);
+    if (ph == 'X')
+        n += std::snprintf(ev + n, sizeof ev - n, ",\"dur\":%.3f", dur);
+    else if (ph == 'i')
+        n += std::snprintf(ev + n, sizeof ev - n, ",\"s\":\"t\"");
+    std::snprintf(ev + n, sizeof ev - n, ",\"args\":{%s}}", args);
+    TIMELINE.buf += ev;
+    if (TIMELINE.buf.size() >= chunk_size)
+        flush();
+}
+
+static void end_span(double ts)
+{
+    if (ts > TIMELINE.span_start)
+        event(TIMELINE.halted ? "halt" : "run", 'X', TID_CPU,
+            TIMELINE.span_start, ts - TIMELINE.span_start, "");
+    TIMELINE.span_start = ts;
+}
+
+static void io_event(const char* name, i8080_word_t port, i8080_word_t word)
+{
+    char args[64];
+    std::snprintf(args, sizeof args, "\"port\":%u,\"value\":%u", unsigned(port), unsigned(word));
+    event(name, 'i', TID_IO, now(), 0, args);
+}
+
+static i8080_word_t port_in(void*, const i8080* cpu, i8080_word_t port)
+{
+    const i8080_port& p = TIMELINE.ports[port];
+    i8080_word_t word = p.in(p.ctx, cpu, port);
+    io_event("IN", port, word);
+    return word;
+}
+
+static void port_out(void*, const i8080* cpu, i8080_word_t port, i8080_word_t word)
+{
+    io_event("OUT", port, word);
+    const i8080_port& p = TIMELINE.ports[port];
+    p.out(p.ctx, cpu, port, word);
+}
+
+static i8080_word_t io_read(const i8080* cpu, i8080_word_t port)
+{
+    i8080_word_t word = TIMELINE.io_read(cpu, port);
+    io_event("IN", port, word);
+    return word;
+}
+
+static void io_write(const i8080* cpu, i8080_word_t port, i8080_word_t word)
+{
+    io_event("OUT", port, word);
+    TIMELINE.io_write(cpu, port, word);
+}
+
+// Also sees interrupts posted with i8080_interrupt_async(),
+// which never go through intr_read().
+static void intr_accept(const i8080* cpu, i8080_word_t opcode)
+{
+    char args[32];
+    std::snprintf(args, sizeof args, "\"opcode\":%u", unsigned(opcode));
+    event("interrupt", 'i', TID_CPU, now(), 0, args);
+    if (TIMELINE.intr_accept)
+        TIMELINE.intr_accept(cpu, opcode);
+}
+
+static void thread_name(int tid, const char* name)
+{
+    char ev[128];
+    std::snprintf(ev, sizeof ev, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+        "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", tid, name);
+    TIMELINE.buf += ev;
+}
+
+bool timeline_start(i8080* cpu, const char* path, double clock_mhz,
+    const char* progname)
+{
+    TIMELINE.fs = std::fopen(path, "wb");
+    if (!TIMELINE.fs) {
+        emu_printerr("Could not open %s", path);
+        return false;
+    }
+    TIMELINE.cpu = cpu;
+    TIMELINE.path = path;
+    TIMELINE.buf.clear();
+    TIMELINE.buf.reserve(chunk_size + 256);
+    TIMELINE.us_per_cycle = 1.0 / clock_mhz;
+    TIMELINE.halted = false;
+    TIMELINE.ok = true;
+
+    char clock[32];
+    std::snprintf(clock, sizeof clock, "%g", clock_mhz);
+    TIMELINE.buf += "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"clock_mhz\":";
+    TIMELINE.buf += clock;
+    TIMELINE.buf += "},\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+        "\"args\":{\"name\":" + json_string(progname) + "}}";
+    thread_name(TID_CPU, "cpu");
+    thread_name(TID_BDOS, "bdos");
+    thread_name(TID_IO, "io");
+
+    // only wrap what is there, so missing handlers still fail
+    for (unsigned port = 0; cpu->ports && port < I8080_NUM_PORTS; ++port)
+    {
+        i8080_port& p = cpu->ports[port];
+        TIMELINE.ports[port] = p;
+        if (p.in) p.in = port_in;
+        if (p.out) p.out = port_out;
+    }
+    TIMELINE.io_read = cpu->io_read;
+    TIMELINE.io_write = cpu->io_write;
+    TIMELINE.intr_accept = cpu->intr_accept;
+    if (cpu->io_read) cpu->io_read = io_read;
+    if (cpu->io_write) cpu->io_write = io_write;
+    cpu->intr_accept = intr_accept;
+
+    TIMELINE.span_start = now();
+    return true;
+}
+
+void timeline_bdos(int callno)
+{
+    if (!TIMELINE.fs) return;
+    const i8080* cpu = TIMELINE.cpu;
+    char name[16], args[48];
+    std::snprintf(name, sizeof name, "BDOS %d", callno);
+    std::snprintf(args, sizeof args, "\"c\":%d,\"de\":%u", callno,
+        (unsigned(cpu->d) << 8) | cpu->e);
+    event(name, 'i', TID_BDOS, now(), 0, args);
+}
+
+void timeline_halt(i8080_cycles_t start)
+{
+    if (!TIMELINE.fs) return;
+    if (!TIMELINE.halted)
+    {
+        end_span(double(start) * TIMELINE.us_per_cycle);
+        TIMELINE.halted = true;
+    }
+
+    // the only way out of HLT; the interrupt itself is
+    // noted when it is accepted
+    if (i8080_interrupt_pending(TIMELINE.cpu))
+    {
+        end_span(now());
+        TIMELINE.halted = false;
+    }
+}
+
+bool timeline_end(void)
+{
+    if (!TIMELINE.fs) return true;
+    i8080* cpu = TIMELINE.cpu;
+    end_span(now());
+    TIMELINE.buf += "\n]}\n";
+    flush();
+
+    for (unsigned port = 0; cpu->ports && port < I8080_NUM_PORTS; ++port)
+        cpu->ports[port] = TIMELINE.ports[port];
+    cpu->io_read = TIMELINE.io_read;
+    cpu->io_write = TIMELINE.io_write;
+    cpu->intr_accept = TIMELINE.intr_accept;
+
+    if (std::fclose(TIMELINE.fs) != 0 && TIMELINE.ok) {
+        emu_printerr("Could not write %s", TIMELINE.path.c_str());
+        TIMELINE.ok = false;
+    }
+    TIMELINE.fs = nullptr;
+    TIMELINE.cpu = nullptr;
+    std::string().swap(TIMELINE.buf);
+    return TIMELINE.ok;
+}
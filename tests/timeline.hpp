@@ -0,0 +1,33 @@
+
+#ifndef TIMELINE_HPP
+#define TIMELINE_HPP
+
+#include "i8080/i8080.h"
+
+// Timeline of a run as Chrome trace-event JSON, for Perfetto
+// or chrome://tracing. Timestamps are cycles converted to
+// microseconds at a given clock rate; time spent halted is
+// counted in cycles too, see emu_halt_wait(). Tracks:
+// cpu:  time running and halted, and interrupts accepted
+// bdos: BDOS calls
+// io:   IN and OUT, with port and value
+// Events are kept in memory and written in large chunks.
+
+// Start a timeline of cpu, to be written to path. Wraps cpu's
+// I/O handlers and intr_accept until timeline_end().
+// Returns true on success.
+bool timeline_start(i8080* cpu, const char* path, double clock_mhz,
+    const char* progname);
+
+// Note a BDOS call, before it is handled.
+void timeline_bdos(int callno);
+
+// Note that the CPU was halted from cycle start until now,
+// waiting for an interrupt.
+void timeline_halt(i8080_cycles_t start);
+
+// Write the rest of the timeline and restore cpu's handlers.
+// Returns true if the whole timeline was written.
+bool timeline_end(void);
+
+#endif
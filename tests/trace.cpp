@@ -0,0 +1,183 @@
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include "i8080/i8080.h"
+#include "trace.hpp"
+#include "emu.hpp"
+
+#ifdef I8080_TRACE
+
+// Records in the streaming ring (4 MB).
+static constexpr unsigned long trace_ring_size = 1ul << 18;
+// Records per write.
+static constexpr unsigned long trace_chunk = 1ul << 14;
+
+static struct tracer
+{
+    i8080* cpu;
+    i8080_trace ring;
+    std::unique_ptr<i8080_trace_rec[]> buf;
+    std::FILE* fs;
+    std::string path;
+    std::thread writer;
+    std::atomic<bool> stopping;
+    // Set by the writer if a write fails.
+    std::atomic<bool> failed;
+    // Records kept by trace_start_last().
+    unsigned long keep;
+    bool running;
+}
+TRACER;
+
+static bool write_header(std::FILE* fs)
+{
+    unsigned char hdr[TRACE_HEADER_SIZE] = {};
+    std::memcpy(hdr, TRACE_MAGIC, 8);
+    hdr[8] = TRACE_VERSION & 0xff;
+    hdr[9] = (TRACE_VERSION >> 8) & 0xff;
+    hdr[10] = sizeof(i8080_trace_rec) & 0xff;
+    hdr[11] = (sizeof(i8080_trace_rec) >> 8) & 0xff;
+    return std::fwrite(hdr, 1, sizeof(hdr), fs) == sizeof(hdr);
+}
+
+static bool write_recs(std::FILE* fs, const i8080_trace_rec* recs, unsigned long n)
+{
+    return std::fwrite(recs, sizeof(i8080_trace_rec), n, fs) == n;
+}
+
+// Writes whole chunks as they fill, and the rest when stopping.
+static void trace_writer(void)
+{
+    i8080_trace* ring = &TRACER.ring;
+    for (;;)
+    {
+        bool stopping = TRACER.stopping.load(std::memory_order_acquire);
+        unsigned long n;
+        const i8080_trace_rec* recs = i8080_trace_peek(ring, &n);
+
+        if (n >= trace_chunk || (stopping && n > 0))
+        {
+            n = n < trace_chunk ? n : trace_chunk;
+            if (!TRACER.failed.load(std::memory_order_relaxed) &&
+                !write_recs(TRACER.fs, recs, n))
+                TRACER.failed.store(true, std::memory_order_relaxed);
+            // keep consuming after a failure so the CPU never waits forever
+            i8080_trace_consume(ring, n);
+        }
+        else if (stopping)
+            break;
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+// Ring is full, wait for the writer. Not i8080_trace_peek(),
+// which only counts up to the end of the buffer.
+static void trace_full(void*, i8080_trace* ring)
+{
+    do {
+        std::this_thread::yield();
+    } while (i8080_trace_used(ring) == ring->size);
+}
+
+static bool trace_open(const char* path)
+{
+    TRACER.fs = std::fopen(path, "wb");
+    if (!TRACER.fs) {
+        emu_printerr("Could not open %s", path);
+        return false;
+    }
+    // large writes, no extra copy
+    std::setvbuf(TRACER.fs, nullptr, _IONBF, 0);
+    if (!write_header(TRACER.fs)) {
+        emu_printerr("Could not write trace to %s", path);
+        std::fclose(TRACER.fs);
+        return false;
+    }
+    TRACER.path = path;
+    return true;
+}
+
+bool trace_start(i8080* cpu, const char* path)
+{
+    if (!trace_open(path))
+        return false;
+
+    TRACER.buf.reset(new i8080_trace_rec[trace_ring_size]);
+    i8080_trace_init(&TRACER.ring, TRACER.buf.get(), trace_ring_size);
+    TRACER.ring.full = trace_full;
+    TRACER.stopping = false;
+    TRACER.failed = false;
+    TRACER.writer = std::thread(trace_writer);
+
+    TRACER.cpu = cpu;
+    cpu->trace = &TRACER.ring;
+    TRACER.running = true;
+    return true;
+}
+
+bool trace_start_last(i8080* cpu, const char* path, unsigned long n)
+{
+    if (n == 0)
+        return false;
+    if (!trace_open(path))
+        return false;
+
+    unsigned long size = 1;
+    while (size < n)
+        size <<= 1;
+    TRACER.buf.reset(new i8080_trace_rec[size]);
+    i8080_trace_init(&TRACER.ring, TRACER.buf.get(), size);
+    TRACER.ring.overwrite = 1;
+    TRACER.keep = n;
+    TRACER.failed = false;
+
+    TRACER.cpu = cpu;
+    cpu->trace = &TRACER.ring;
+    TRACER.running = true;
+    return true;
+}
+
+bool trace_stop(void)
+{
+    if (!TRACER.running)
+        return true;
+    TRACER.cpu->trace = nullptr;
+    TRACER.running = false;
+
+    i8080_trace* ring = &TRACER.ring;
+    bool ok;
+    if (ring->overwrite)
+    {
+        // oldest first, in up to two pieces
+        unsigned long head = ring->head;
+        unsigned long n = head < TRACER.keep ? head : TRACER.keep;
+        unsigned long first = (head - n) & (ring->size - 1);
+        unsigned long n1 = ring->size - first < n ? ring->size - first : n;
+
+        ok = write_recs(TRACER.fs, ring->buf + first, n1) &&
+            write_recs(TRACER.fs, ring->buf, n - n1);
+    }
+    else
+    {
+        TRACER.stopping.store(true, std::memory_order_release);
+        TRACER.writer.join();
+        ok = !TRACER.failed;
+        if (ring->dropped != 0)
+            emu_printerr("Trace lost %lu records", ring->dropped);
+    }
+
+    if (std::fclose(TRACER.fs) != 0)
+        ok = false;
+    if (!ok)
+        emu_printerr("Could not write trace to %s", TRACER.path.c_str());
+    TRACER.buf.reset();
+    return ok;
+}
+
+#endif
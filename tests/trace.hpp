@@ -0,0 +1,33 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include "i8080/i8080.h"
+
+// Binary execution trace. Files start with a 16-byte header:
+// the magic "I8080TRC", then the format version and record
+// size as 16-bit little-endian numbers, then 4 reserved bytes.
+// Records (i8080_trace_rec) follow, oldest first. Decode with
+// i8080trace.
+
+#define TRACE_MAGIC "I8080TRC"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 16
+
+#ifdef I8080_TRACE
+// Stream every instruction cpu executes to path. A background
+// thread writes the ring out in large chunks; the CPU waits
+// for it if the ring fills.
+// Returns true on success.
+bool trace_start(i8080* cpu, const char* path);
+
+// Keep only the last n instructions cpu executes,
+// and write them to path in trace_stop().
+// Returns true on success.
+bool trace_start_last(i8080* cpu, const char* path, unsigned long n);
+
+// Stop tracing and finish writing the trace.
+// Returns true if the whole trace was written.
+bool trace_stop(void);
+#endif
+
+#endif
@@ -0,0 +1,101 @@
+// Checks that i8080emu --trace loses no records when the file
+// it streams to is slow, by tracing a program into a FIFO read
+// slowly and then quickly, and comparing the two, as a CTest.
+// Usage: i8080tracetest <i8080emu> <program.COM>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Read this much slowly, enough to fill i8080emu's ring
+// several times over.
+static constexpr unsigned long long slow_bytes = 32ull << 20;
+static constexpr std::size_t read_size = 64 << 10;
+
+// Trace prog into fifo and count the bytes read back, pausing
+// after each read until slow_bytes if slow. Also returns
+// i8080emu's stderr.
+static bool trace_run(const char* emu, const char* prog, const std::string& fifo,
+    bool slow, unsigned long long& nbytes, std::string& err)
+{
+    std::string err_path = fifo + ".err";
+    pid_t pid = ::fork();
+    if (pid == 0)
+    {
+        int out = ::open("/dev/null", O_WRONLY);
+        int errfd = ::open(err_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0 || errfd < 0) std::_Exit(127);
+        ::dup2(out, STDOUT_FILENO);
+        ::dup2(errfd, STDERR_FILENO);
+        ::execl(emu, emu, "-f", prog, "--trace", fifo.c_str(), (char*)nullptr);
+        std::_Exit(127);
+    }
+    if (pid < 0) return false;
+
+    int fd = ::open(fifo.c_str(), O_RDONLY);
+    std::vector<char> buf(read_size);
+    nbytes = 0;
+    ::ssize_t n;
+    while (fd >= 0 && (n = ::read(fd, buf.data(), buf.size())) > 0)
+    {
+        nbytes += (unsigned long long)n;
+        if (slow && nbytes < slow_bytes)
+            ::usleep(2000);
+    }
+    if (fd >= 0) ::close(fd);
+
+    int status = 0;
+    bool ok = ::waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+        WEXITSTATUS(status) == 0;
+
+    err.clear();
+    if (std::FILE* fs = std::fopen(err_path.c_str(), "r"))
+    {
+        int c;
+        while ((c = std::fgetc(fs)) != EOF)
+            err += char(c);
+        std::fclose(fs);
+    }
+    ::unlink(err_path.c_str());
+    return ok && fd >= 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        std::fprintf(stderr, "usage: i8080tracetest <i8080emu> <program.COM>\n");
+        return EXIT_FAILURE;
+    }
+    std::string fifo = "i8080tracetest." + std::to_string(::getpid()) + ".fifo";
+    if (::mkfifo(fifo.c_str(), 0600) != 0) {
+        std::perror("i8080tracetest: mkfifo");
+        return EXIT_FAILURE;
+    }
+
+    unsigned long long slow_n = 0, fast_n = 0;
+    std::string slow_err, fast_err;
+    bool slow_ok = trace_run(argv[1], argv[2], fifo, true, slow_n, slow_err);
+    bool fast_ok = trace_run(argv[1], argv[2], fifo, false, fast_n, fast_err);
+    ::unlink(fifo.c_str());
+
+    std::printf("slow sink: %llu bytes%s\n%s", slow_n, slow_ok ? "" : ", failed",
+        slow_err.c_str());
+    std::printf("fast sink: %llu bytes%s\n%s", fast_n, fast_ok ? "" : ", failed",
+        fast_err.c_str());
+
+    bool lost = slow_err.find("lost") != std::string::npos ||
+        fast_err.find("lost") != std::string::npos;
+    if (!slow_ok || !fast_ok || lost || slow_n != fast_n || slow_n <= slow_bytes) {
+        std::printf("FAIL\n");
+        return EXIT_FAILURE;
+    }
+    std::printf("ok\n");
+    return EXIT_SUCCESS;
+}